@@ -9,6 +9,7 @@
 
 */
 
+#define _GNU_SOURCE // recursive mutex initializer
 #include <stdio.h>
 #include <stdlib.h>
 #include <unistd.h>
@@ -20,64 +21,503 @@
 #include <sys/stat.h>
 #include <fcntl.h>
 #include <time.h>
+#include <pthread.h>
+#include <sched.h>
+#if defined(__x86_64__)
+#include <nmmintrin.h>
+#include <wmmintrin.h>
+#endif
 
-/*
-*
-* Initializing the static values like the block size (in bytes), free array size and inode size
-*
-*/
-
-#define BLOCK_SIZE 1024
-#define MAX_FILE_SIZE 4194304 // 4GB of file size
-#define FREE_ARRAY_SIZE 248 // free and inode array size
-#define INODE_SIZE 64
-
+#include "fileSystem.h"
 
-/*************** superBlock block structure**********************/
-typedef struct {
-    unsigned int isize; // 4 byte
-    unsigned int fsize;
-    unsigned int nfree;
-    unsigned short free[FREE_ARRAY_SIZE];
-    unsigned int ninode;
-    unsigned short inode[FREE_ARRAY_SIZE];
-    unsigned short flock;
-    unsigned short ilock;
-    unsigned short fmod;
-    unsigned int time[2];
-} superBlockType;
-
-/****************inode structure ************************/
-typedef struct {
-    unsigned short flags; // 2 bytes
-    char nlinks;  // 1 byte
-    char uid;
-    char gid;
-    unsigned int size; // 32bits  2^32 = 4GB filesize
-    unsigned short addr[22]; // to make total size = 64 byte inode size
-    unsigned int actime;
-    unsigned int modtime;
-} Inode;
-
-/********** Structure of the directory entry ************/
-typedef struct {
-    unsigned short inode;
-    char fileName[14];
-} directoryEntry;
+#ifdef V6FS_ZLIB
+#include <zlib.h>
+#endif
 
 // Initializing the global variables
 superBlockType superBlock;
-int fileDescriptor, currentINodeNumber, totalINodesCount;
+int fileDescriptor = -1;
+int currentINodeNumber, totalINodesCount;
+int mountedSnapshot; // root of the snapshot mounted read-only, 0 for the live tree
 char currentWorkingDirectory[100];
 char fileSystemPath[100];
+cachedBlock blockCache[CACHE_BLOCKS];
+#ifndef V6FS_NO_STATS
+int statsEnabled; // off until "stats on" or -s
+#endif
+ioCounters currentCounters;
+commandStats trackedCommands[MAX_TRACKED_COMMANDS];
+int trackedCommandCount;
+FILE *traceFile;
+int traceCapturing;
+unsigned int traceEvents[TRACE_MAX_EVENTS];
+int traceEventCount, traceEventsDropped;
+unsigned long long traceLastCommandStart;
+int transactionOpen;
+unsigned int blockMapGeneration;
+allocationGroupType *allocationGroups;
+int allocationGroupCount, inodesPerGroup;
+__thread int allocationGroup;
+int directoryRotor; // group the last new directory went to
+unsigned char *freeBlockMap, *freeInodeMap; // one bit per block and i-node, set when it is free
+pthread_mutex_t allocatorLock = PTHREAD_MUTEX_INITIALIZER; // guards the group maps and magazineThreads
+magazineSet *magazineThreads; // magazines of every thread that has allocated or freed
+int magazineThreadCount;
+int magazinesDraining; // free space is low: threads hand their magazines back instead of refilling them
+static __thread magazineSet *ownMagazines;
+static pthread_key_t magazineKey;
+static pthread_once_t magazineKeyOnce = PTHREAD_ONCE_INIT;
+depot *blockDepots, *inodeDepots; // one of each per group
+depotChunk *depotChunks; // the pool every depot's chunks come from
+unsigned long long emptyChunks; // stack of the chunks no depot holds, like a depot's 'top'
+int depotLocked;
+pthread_mutex_t depotLock = PTHREAD_MUTEX_INITIALIZER; // only used with depotLocked
+pthread_mutex_t engineLock = PTHREAD_RECURSIVE_MUTEX_INITIALIZER_NP;
+pthread_cond_t reclaimWork = PTHREAD_COND_INITIALIZER;
+int reclaimerStarted;
+int readaheadEnabled = 1;
+int discardEnabled;
+unsigned char *discardPending; // freed blocks not yet punched and not allocated again, one bit each
+int discardQueue[DISCARD_QUEUE_BLOCKS], discardQueued;
+pthread_mutex_t discardLock = PTHREAD_MUTEX_INITIALIZER;
+int tailPacking;
+fragmentBlock *fragmentBlocks; // blocks shared by packed tails, found in the i-list when first needed
+int fragmentBlockCount, fragmentBlockCapacity, fragmentMapLoaded, fragmentRotor;
+int *fragmentSlots; // 1 + the index in fragmentBlocks of every shared block, 0 for any other block
+int compressionEnabled;
+char clusterData[CLUSTER_SIZE]; // the cluster loadCluster() decompressed last
+int clusterINumber = -1, clusterIndex;
+unsigned int clusterGeneration; // blockMapGeneration when it was, any change to a block map invalidates it
+int dedupEnabled;
+unsigned short *blockShares; // references to each block beyond the first, see loadBlockShares()
+int *dedupBuckets, *dedupNext; // hash chains of the indexed blocks, through the block numbers
+unsigned int *dedupHashes; // hash of every indexed block
+int dedupBucketMask, dedupChanged;
+unsigned int *blockChecksums; // CRC32C of every block below fsize, while an image with checksums is mounted
+unsigned char *checksumUnknown; // blocks whose checksum is not known, one bit each, see forgetBlockChecksum()
+unsigned int zeroBlockChecksum, checksumErrors;
+unsigned int crcTable[8][256]; // the software CRC32C, slicing by 8
+unsigned long long crcShift[2]; // see crcHardwareBlock()
+int crcHardware; // SSE4.2 and PCLMUL are there
+pthread_once_t crcOnce = PTHREAD_ONCE_INIT;
+int scrubNextChunk, scrubErrors, scrubChecked, scrubUnverified;
+int scrubBadBlocks[SCRUB_REPORTED_BLOCKS];
+readaheadBlock readaheadCache[READAHEAD_CACHE_BLOCKS];
+int readaheadStarted, readaheadBusy;
+int readaheadQueue[READAHEAD_QUEUE_LENGTH][2]; // first block and length of the runs to read
+unsigned int readaheadQueueHead, readaheadQueueTail;
+pthread_mutex_t readaheadLock = PTHREAD_MUTEX_INITIALIZER;
+pthread_cond_t readaheadWork = PTHREAD_COND_INITIALIZER, readaheadChanged = PTHREAD_COND_INITIALIZER;
+
+/*
+    Block checksums. An image made by initfs keeps a CRC32C of every block but the superblock in a
+    checksum area past fsize. While it is mounted the checksums are in blockChecksums: a block written
+    whole gets its new checksum as it goes to the image, and every block read from the image is checked
+    against it, by readFromBlockWithOffset(), when the i-list cache fills and when a reader takes a block
+    the readahead worker fetched.
+    The area is written at unmount, so after a crash it is behind the blocks and the checksums are
+    computed from the image again at mount. A block that is only written in part, and is not in the
+    cache, is marked unknown instead of being read back; it gets its checksum on its next whole read,
+    or at unmount
+*/
+#define CRC_STREAM_BYTES (BLOCK_SIZE / 24 * 8) // three interleaved streams of whole words, 336 bytes each
+
+static unsigned int crcSoftware(unsigned int crc, const unsigned char *data, int length) {
+    unsigned long long word;
+    for (; length >= 8; data += 8, length -= 8) {
+        memcpy(&word, data, sizeof(word));
+        word ^= crc;
+        crc = crcTable[7][word & 0xff] ^ crcTable[6][(word >> 8) & 0xff] ^ crcTable[5][(word >> 16) & 0xff]
+              ^ crcTable[4][(word >> 24) & 0xff] ^ crcTable[3][(word >> 32) & 0xff] ^ crcTable[2][(word >> 40) & 0xff]
+              ^ crcTable[1][(word >> 48) & 0xff] ^ crcTable[0][word >> 56];
+    }
+    while(length-- > 0)
+        crc = crcTable[0][(crc ^ *data++) & 0xff] ^ crc >> 8;
+    return crc;
+}
+
+#if defined(__x86_64__)
+/*
+    The crc32 instruction takes 3 cycles but can start one every cycle, so the block is run as three
+    streams side by side. The CRC of the whole block is then that of the last stream, with the other two
+    moved past the bytes after them: multiplied by x^(8n) modulo the polynomial, which a carry-less
+    multiply by crcShift (x^(8n-33), see initChecksums()) and one more crc32 does
+*/
+__attribute__((target("sse4.2,pclmul")))
+static unsigned int crcHardwareBlock(const unsigned char *data) {
+    unsigned long long first = 0xffffffff, second = 0, third = 0, word;
+    int i;
+    for (i = 0; i < CRC_STREAM_BYTES; i += 8) {
+        memcpy(&word, data + i, sizeof(word));
+        first = _mm_crc32_u64(first, word);
+        memcpy(&word, data + CRC_STREAM_BYTES + i, sizeof(word));
+        second = _mm_crc32_u64(second, word);
+        memcpy(&word, data + 2 * CRC_STREAM_BYTES + i, sizeof(word));
+        third = _mm_crc32_u64(third, word);
+    }
+    __m128i moved = _mm_xor_si128(_mm_clmulepi64_si128(_mm_cvtsi64_si128(first), _mm_cvtsi64_si128(crcShift[1]), 0),
+                                  _mm_clmulepi64_si128(_mm_cvtsi64_si128(second), _mm_cvtsi64_si128(crcShift[0]), 0));
+    unsigned long long crc = third ^ _mm_crc32_u64(0, _mm_cvtsi128_si64(moved));
+    for (i = 3 * CRC_STREAM_BYTES; i < BLOCK_SIZE; i += 8) {
+        memcpy(&word, data + i, sizeof(word));
+        crc = _mm_crc32_u64(crc, word);
+    }
+    return ~(unsigned int)crc;
+}
+#endif
+
+static void initChecksums() {
+    static const unsigned char zeros[BLOCK_SIZE];
+    unsigned int n, crc;
+    int bit, k;
+    for (n = 0; n < 256; n++) {
+        for (crc = n, bit = 0; bit < 8; bit++)
+            crc = crc & 1 ? crc >> 1 ^ 0x82f63b78 : crc >> 1;
+        crcTable[0][n] = crc;
+    }
+    for (n = 0; n < 256; n++)
+        for (k = 1; k < 8; k++)
+            crcTable[k][n] = crcTable[k - 1][n] >> 8 ^ crcTable[0][crcTable[k - 1][n] & 0xff];
+    // in the reflected CRC, bit 24 is x^7; n - 5 zero bytes take it to x^(8n-33)
+    crcShift[0] = crcSoftware(1 << 24, zeros, CRC_STREAM_BYTES - 5);
+    crcShift[1] = crcSoftware(1 << 24, zeros, 2 * CRC_STREAM_BYTES - 5);
+#if defined(__x86_64__)
+    crcHardware = __builtin_cpu_supports("sse4.2") && __builtin_cpu_supports("pclmul");
+#endif
+    zeroBlockChecksum = ~crcSoftware(0xffffffff, zeros, BLOCK_SIZE);
+}
+
+/*
+    CRC32C (Castagnoli) of a block, with SSE4.2 and PCLMUL where the CPU has them
+*/
+unsigned int blockChecksum(const void *data) {
+    pthread_once(&crcOnce, initChecksums);
+#if defined(__x86_64__)
+    if(crcHardware)
+        return crcHardwareBlock(data);
+#endif
+    return ~crcSoftware(0xffffffff, data, BLOCK_SIZE);
+}
+
+static int isChecksummed(int blockNumber) {
+    return blockChecksums != NULL && blockNumber > 0 && blockNumber < (int)superBlock.fsize;
+}
+
+static int isChecksumUnknown(int blockNumber) {
+    return (checksumUnknown[blockNumber / 8] >> (blockNumber % 8)) & 1;
+}
+
+static void setBlockChecksum(int blockNumber, unsigned int checksum) {
+    if(!isChecksummed(blockNumber))
+        return;
+    blockChecksums[blockNumber] = checksum;
+    checksumUnknown[blockNumber / 8] &= ~(1 << (blockNumber % 8));
+}
+
+static void forgetBlockChecksum(int blockNumber) {
+    if(isChecksummed(blockNumber))
+        checksumUnknown[blockNumber / 8] |= 1 << (blockNumber % 8);
+}
+
+// for the readahead cache, which leaves the table alone: 0 only for a block known to be damaged
+static int matchesChecksum(int blockNumber, const void *data) {
+    return !isChecksummed(blockNumber) || isChecksumUnknown(blockNumber) || blockChecksum(data) == blockChecksums[blockNumber];
+}
+
+/*
+    Checks a block just read from the image. Returns 0 with errno = EIO if it does not match its checksum
+*/
+static int verifyBlock(int blockNumber, const void *data) {
+    if(!isChecksummed(blockNumber))
+        return 1;
+    if(isChecksumUnknown(blockNumber)) {
+        setBlockChecksum(blockNumber, blockChecksum(data));
+        return 1;
+    }
+    if(blockChecksum(data) == blockChecksums[blockNumber])
+        return 1;
+    checksumErrors++;
+    printf("\nblock %d: checksum mismatch, the block is damaged\n", blockNumber);
+    errno = EIO;
+    return 0;
+}
+
+/*
+    Brings the checksums up to date after 'numberOfBytes' from 'buffer' went to byte 'offset' of block
+    'blockNumber' on. A block only written in part takes its checksum from the i-list cache if it is there
+*/
+static void checksumWrittenBlocks(int blockNumber, int offset, const void *buffer, int numberOfBytes) {
+    int i, end = offset + numberOfBytes;
+    for (i = offset / BLOCK_SIZE; i <= (end - 1) / BLOCK_SIZE; i++) {
+        cachedBlock *slot = &blockCache[CACHE_SLOT(blockNumber + i)];
+        if(offset <= i * BLOCK_SIZE && end >= (i + 1) * BLOCK_SIZE)
+            setBlockChecksum(blockNumber + i, blockChecksum((const char *)buffer + i * BLOCK_SIZE - offset));
+        else if(slot->blockNumber == blockNumber + i)
+            setBlockChecksum(blockNumber + i, blockChecksum(slot->data));
+        else
+            forgetBlockChecksum(blockNumber + i);
+    }
+}
+
+/*
+    Drops every block held in the cache. Called whenever a different image gets mounted
+*/
+void invalidateCache() {
+    int i;
+    drainReadahead();
+    for (i = 0; i < CACHE_BLOCKS; i++) {
+        blockCache[i].blockNumber = -1;
+        blockCache[i].dirty = 0;
+    }
+    transactionOpen = 0;
+}
+
+/*
+    Writes a slot that was modified inside a transaction back to the image
+*/
+void flushCachedBlock(cachedBlock *slot) {
+    if(!slot->dirty)
+        return;
+    pwrite(fileDescriptor, slot->data, BLOCK_SIZE, (off_t)BLOCK_SIZE * slot->blockNumber);
+    if(isChecksummed(slot->blockNumber))
+        setBlockChecksum(slot->blockNumber, blockChecksum(slot->data));
+    slot->dirty = 0;
+    if(__builtin_expect(traceCapturing, 0))
+        traceBlockIO(slot->blockNumber, 1);
+    COUNT_STAT(syscalls, 1);
+    COUNT_STAT(bytesWritten, BLOCK_SIZE);
+}
+
+/*
+    Returns the in-memory copy of the block, reading it from the file only on the first access.
+    The cache is direct mapped, a block can only live in slot CACHE_SLOT(blockNumber)
+*/
+char * getCachedBlock(int blockNumber) {
+    cachedBlock *slot = &blockCache[CACHE_SLOT(blockNumber)];
+    if(slot->blockNumber != blockNumber) {
+        flushCachedBlock(slot);
+        pread(fileDescriptor, slot->data, BLOCK_SIZE, (off_t)BLOCK_SIZE * blockNumber);
+        slot->blockNumber = blockNumber;
+        verifyBlock(blockNumber, slot->data);
+        if(__builtin_expect(traceCapturing, 0))
+            traceBlockIO(blockNumber, 0);
+        COUNT_STAT(cacheMisses, 1);
+        COUNT_STAT(syscalls, 1);
+        COUNT_STAT(bytesRead, BLOCK_SIZE);
+    }
+    else
+        COUNT_STAT(cacheHits, 1);
+    return slot->data;
+}
+
+/*
+    Readahead. A worker thread reads runs of data blocks into readaheadCache ahead of a sequential
+    reader, so the reader finds them in memory instead of waiting for the disk. The main thread only
+    queues the runs; the cache slots are guarded by readaheadLock, which also covers the queue
+*/
+static void * readaheadWorker(void *unused) {
+    char *buffer = malloc((size_t)READAHEAD_MAX_RUN * BLOCK_SIZE);
+    int i;
+    pthread_mutex_lock(&readaheadLock);
+    while(1) {
+        while(readaheadQueueHead == readaheadQueueTail) {
+            readaheadBusy = 0;
+            pthread_cond_broadcast(&readaheadChanged);
+            pthread_cond_wait(&readaheadWork, &readaheadLock);
+        }
+        int first = readaheadQueue[readaheadQueueHead % READAHEAD_QUEUE_LENGTH][0];
+        int count = readaheadQueue[readaheadQueueHead % READAHEAD_QUEUE_LENGTH][1];
+        readaheadQueueHead++;
+        readaheadBusy = 1;
+
+        // claim the slots first, so a write that comes in while the read runs can cancel them
+        for (i = 0; i < count; i++) {
+            readaheadBlock *slot = &readaheadCache[(unsigned int)(first + i) % READAHEAD_CACHE_BLOCKS];
+            if(slot->blockNumber == first + i && slot->state != READAHEAD_EMPTY)
+                continue;
+            slot->blockNumber = first + i;
+            slot->state = READAHEAD_LOADING;
+        }
+        int descriptor = fileDescriptor;
+        pthread_mutex_unlock(&readaheadLock);
+        ssize_t loaded = pread(descriptor, buffer, (size_t)count * BLOCK_SIZE, (off_t)first * BLOCK_SIZE);
+        pthread_mutex_lock(&readaheadLock);
+        for (i = 0; i < count; i++) {
+            readaheadBlock *slot = &readaheadCache[(unsigned int)(first + i) % READAHEAD_CACHE_BLOCKS];
+            if(slot->blockNumber != first + i || slot->state != READAHEAD_LOADING)
+                continue;
+            if(loaded >= (ssize_t)(i + 1) * BLOCK_SIZE) {
+                memcpy(slot->data, buffer + (size_t)i * BLOCK_SIZE, BLOCK_SIZE);
+                slot->state = READAHEAD_VALID;
+                slot->checked = 0;
+            }
+            else {
+                slot->blockNumber = -1;
+                slot->state = READAHEAD_EMPTY;
+            }
+        }
+        pthread_cond_broadcast(&readaheadChanged);
+    }
+    return NULL;
+}
+
+/*
+    Queues a run of consecutive blocks for the worker, starting it on first use. Returns 0 if the queue
+    is full; readahead is only a hint, so the caller simply tries again on a later read
+*/
+static int queueReadahead(int first, int count) {
+    int queued = 0;
+    pthread_mutex_lock(&readaheadLock);
+    if(!readaheadStarted) {
+        pthread_t worker;
+        int i;
+        for (i = 0; i < READAHEAD_CACHE_BLOCKS; i++)
+            readaheadCache[i].blockNumber = -1;
+        if(pthread_create(&worker, NULL, readaheadWorker, NULL) != 0) {
+            pthread_mutex_unlock(&readaheadLock);
+            return 0;
+        }
+        pthread_detach(worker);
+        readaheadStarted = 1;
+    }
+    if(readaheadQueueTail - readaheadQueueHead < READAHEAD_QUEUE_LENGTH) {
+        readaheadQueue[readaheadQueueTail % READAHEAD_QUEUE_LENGTH][0] = first;
+        readaheadQueue[readaheadQueueTail % READAHEAD_QUEUE_LENGTH][1] = count;
+        readaheadQueueTail++;
+        pthread_cond_signal(&readaheadWork);
+        queued = 1;
+    }
+    pthread_mutex_unlock(&readaheadLock);
+    return queued;
+}
+
+/*
+    Copies part of a block out of the readahead cache, waiting if the worker is reading it right now.
+    Returns 0 if the cache does not have the block. A block is checked against its checksum when it is
+    first taken rather than when the worker reads it, so one the reader fetched itself meanwhile is not
+    checked twice; a damaged one is dropped, for the reader to read and report
+*/
+static int readFromReadahead(int blockNumber, int offset, void *buffer, int numberOfBytes) {
+    readaheadBlock *slot = &readaheadCache[(unsigned int)blockNumber % READAHEAD_CACHE_BLOCKS];
+    int found = 0;
+    if(!readaheadStarted)
+        return 0;
+    pthread_mutex_lock(&readaheadLock);
+    while(slot->blockNumber == blockNumber && slot->state == READAHEAD_LOADING)
+        pthread_cond_wait(&readaheadChanged, &readaheadLock);
+    if(slot->blockNumber == blockNumber && slot->state == READAHEAD_VALID && !slot->checked) {
+        slot->checked = matchesChecksum(blockNumber, slot->data);
+        if(!slot->checked) {
+            slot->blockNumber = -1;
+            slot->state = READAHEAD_EMPTY;
+        }
+    }
+    if(slot->blockNumber == blockNumber && slot->state == READAHEAD_VALID) {
+        memcpy(buffer, slot->data + offset, numberOfBytes);
+        found = 1;
+    }
+    pthread_mutex_unlock(&readaheadLock);
+    if(found)
+        COUNT_STAT(cacheHits, 1);
+    return found;
+}
+
+/*
+    Keeps the readahead cache in step with a write: a cached copy is updated, one still being read is
+    cancelled so the worker drops the old data it is about to store
+*/
+static void updateReadahead(int blockNumber, int offset, const void *buffer, int numberOfBytes) {
+    int last = blockNumber + (offset + numberOfBytes - 1) / BLOCK_SIZE;
+    if(!readaheadStarted)
+        return;
+    pthread_mutex_lock(&readaheadLock);
+    for (; blockNumber <= last; blockNumber++) {
+        readaheadBlock *slot = &readaheadCache[(unsigned int)blockNumber % READAHEAD_CACHE_BLOCKS];
+        if(slot->blockNumber != blockNumber)
+            continue;
+        if(slot->state == READAHEAD_VALID && offset + numberOfBytes <= BLOCK_SIZE)
+            memcpy(slot->data + offset, buffer, numberOfBytes);
+        else {
+            slot->blockNumber = -1;
+            slot->state = READAHEAD_EMPTY;
+        }
+    }
+    pthread_mutex_unlock(&readaheadLock);
+}
+
+/*
+    Drops everything queued and cached, after waiting for the run the worker is reading. Called before
+    the image's descriptor is closed or replaced
+*/
+void drainReadahead() {
+    int i;
+    if(!readaheadStarted)
+        return;
+    pthread_mutex_lock(&readaheadLock);
+    readaheadQueueHead = readaheadQueueTail;
+    while(readaheadBusy)
+        pthread_cond_wait(&readaheadChanged, &readaheadLock);
+    for (i = 0; i < READAHEAD_CACHE_BLOCKS; i++) {
+        readaheadCache[i].blockNumber = -1;
+        readaheadCache[i].state = READAHEAD_EMPTY;
+    }
+    pthread_mutex_unlock(&readaheadLock);
+}
+
+/*
+    Called by readFileRange() for every read through a block-map cache. A read that starts where the last
+    one ended is sequential: the window of blocks read ahead doubles from READAHEAD_MIN_BLOCKS up to
+    READAHEAD_MAX_BLOCKS, and the next window is queued once the reader is half way into the current
+    one, so the worker stays ahead. Any other read resets the window. Nothing is read ahead while a trace
+    is recorded: the worker's reads are not traced and which blocks it has ready depends on thread timing,
+    so a replay would see a different block I/O pattern
+*/
+static void scheduleReadahead(const Inode *inode, int firstBlock, int lastBlock, blockMapCache *cache) {
+    int fileBlocks = inodeBlockCount(inode);
+    int sequential = firstBlock == cache->readaheadNext || firstBlock + 1 == cache->readaheadNext;
+    cache->readaheadNext = lastBlock + 1;
+    if(!readaheadEnabled || traceCapturing)
+        return;
+    if(!sequential) {
+        cache->readaheadWindow = READAHEAD_MIN_BLOCKS;
+        cache->readaheadEnd = 0;
+        return;
+    }
+    if(cache->readaheadEnd > lastBlock + cache->readaheadWindow / 2 || cache->readaheadEnd >= fileBlocks)
+        return;
+    if(cache->readaheadEnd != 0 && cache->readaheadWindow < READAHEAD_MAX_BLOCKS)
+        cache->readaheadWindow *= 2;
+    int start = cache->readaheadEnd > lastBlock ? cache->readaheadEnd : lastBlock + 1;
+    int end = start + cache->readaheadWindow < fileBlocks ? start + cache->readaheadWindow : fileBlocks;
+
+    // the file's blocks are queued as runs of blocks that are consecutive on disk. When the queue
+    // fills up the window ends early at the first run that did not fit
+    int runStart = 0, runLength = 0, runFileBlock = start, fileBlock;
+    for (fileBlock = start; fileBlock < end; fileBlock++) {
+        int blockNumber = bmap(inode, fileBlock, cache);
+        if(runLength > 0 && blockNumber == runStart + runLength && runLength < READAHEAD_MAX_RUN) {
+            runLength++;
+            continue;
+        }
+        if(runLength > 0 && !queueReadahead(runStart, runLength)) {
+            cache->readaheadEnd = runFileBlock;
+            return;
+        }
+        runStart = blockNumber;
+        runLength = blockNumber != 0;
+        runFileBlock = fileBlock;
+    }
+    if(runLength > 0 && !queueReadahead(runStart, runLength))
+        end = runFileBlock;
+    cache->readaheadEnd = end;
+}
 
 /* 
     Writes the data in the buffer data structure to the block 
     in the file pointed by the fileDescriptor
 */
 void writeBufferToBlock (int blockNumber, void * buffer, int numberOfBytes) {
-    lseek(fileDescriptor, BLOCK_SIZE * blockNumber, SEEK_SET);
-    write(fileDescriptor, buffer, numberOfBytes);
+    writeToBlockWithOffset(blockNumber, 0, buffer, numberOfBytes);
 }
 
 /* 
@@ -85,102 +525,2702 @@ void writeBufferToBlock (int blockNumber, void * buffer, int numberOfBytes) {
     from the offset position and not from the beginning of the block
 */
 void writeToBlockWithOffset (int blockNumber, int offset, void * buffer, int numberOfBytes) {
-    lseek(fileDescriptor,(BLOCK_SIZE * blockNumber) + offset, SEEK_SET);
-    write(fileDescriptor, buffer, numberOfBytes);
+    cachedBlock *slot = &blockCache[CACHE_SLOT(blockNumber)];
+    if(transactionOpen && offset + numberOfBytes <= BLOCK_SIZE) {
+        // inside a transaction the write only lands in the cache, commitTransaction() stores it
+        if(offset == 0 && numberOfBytes == BLOCK_SIZE && slot->blockNumber != blockNumber) {
+            flushCachedBlock(slot);
+            slot->blockNumber = blockNumber;
+        }
+        else
+            getCachedBlock(blockNumber);
+        memcpy(slot->data + offset, buffer, numberOfBytes);
+        slot->dirty = 1;
+        updateReadahead(blockNumber, offset, buffer, numberOfBytes);
+        return;
+    }
+    pwrite(fileDescriptor, buffer, numberOfBytes, (off_t)BLOCK_SIZE * blockNumber + offset);
+    // only after the write: a run the worker reads meanwhile is cancelled here instead of keeping old data
+    updateReadahead(blockNumber, offset, buffer, numberOfBytes);
+    int last = blockNumber + (offset + numberOfBytes - 1) / BLOCK_SIZE;
+    if(__builtin_expect(traceCapturing, 0)) {
+        int traced;
+        for (traced = blockNumber; traced <= last; traced++)
+            traceBlockIO(traced, 1);
+    }
+    COUNT_STAT(syscalls, 1);
+    COUNT_STAT(bytesWritten, numberOfBytes);
+    // write through, so a cached copy of a block never goes stale. A write of several blocks (a run of
+    // file data) may cover more than one slot
+    int first = blockNumber, firstOffset = offset;
+    for (; blockNumber <= last; blockNumber++, offset -= BLOCK_SIZE) {
+        slot = &blockCache[CACHE_SLOT(blockNumber)];
+        if(slot->blockNumber != blockNumber)
+            continue;
+        int from = offset > 0 ? offset : 0;
+        int to = offset + numberOfBytes < BLOCK_SIZE ? offset + numberOfBytes : BLOCK_SIZE;
+        memcpy(slot->data + from, (char *)buffer + from - offset, to - from);
+    }
+    if(blockChecksums != NULL)
+        checksumWrittenBlocks(first, firstOffset, buffer, numberOfBytes);
+}
+
+/*
+    With checksums, reads a range that does not cover whole blocks in pieces: the blocks it only has a
+    part of are read whole, so they can be checked, and the rest with one call
+*/
+static int readBlockPieces(int blockNumber, int offset, char *buffer, int numberOfBytes) {
+    char data[BLOCK_SIZE];
+    int chunk, ok = 1;
+    blockNumber += offset / BLOCK_SIZE;
+    offset %= BLOCK_SIZE;
+    for (; numberOfBytes > 0; buffer += chunk, numberOfBytes -= chunk) {
+        if(offset == 0 && numberOfBytes >= BLOCK_SIZE) {
+            chunk = numberOfBytes / BLOCK_SIZE * BLOCK_SIZE;
+            ok &= readFromBlockWithOffset(blockNumber, 0, buffer, chunk);
+        }
+        else {
+            chunk = BLOCK_SIZE - offset < numberOfBytes ? BLOCK_SIZE - offset : numberOfBytes;
+            ok &= readFromBlockWithOffset(blockNumber, 0, data, BLOCK_SIZE);
+            memcpy(buffer, data + offset, chunk);
+        }
+        blockNumber += (offset + chunk) / BLOCK_SIZE;
+        offset = (offset + chunk) % BLOCK_SIZE;
+    }
+    return ok;
 }
 
 /* 
     Reads data from the block in the file to the buffer data structure, from the offset position
-    and not from the beginning of the block
+    and not from the beginning of the block. The range may run on into the blocks that follow.
+    Returns 0 with errno = EIO if a block read from the image does not match its checksum; the data
+    is copied all the same
 */
-void readFromBlockWithOffset(int blockNumber, int offset, void * buffer, int numberOfBytes) {
-    lseek(fileDescriptor,(BLOCK_SIZE * blockNumber) + offset, SEEK_SET);
-    read(fileDescriptor, buffer, numberOfBytes);
+int readFromBlockWithOffset(int blockNumber, int offset, void * buffer, int numberOfBytes) {
+    cachedBlock *slot = &blockCache[CACHE_SLOT(blockNumber)];
+    int i, ok = 1;
+    if(slot->dirty && slot->blockNumber == blockNumber && offset + numberOfBytes <= BLOCK_SIZE) {
+        memcpy(buffer, slot->data + offset, numberOfBytes);
+        return 1;
+    }
+    if(blockChecksums != NULL && (offset % BLOCK_SIZE != 0 || numberOfBytes % BLOCK_SIZE != 0))
+        return readBlockPieces(blockNumber, offset, buffer, numberOfBytes);
+    pread(fileDescriptor, buffer, numberOfBytes, (off_t)BLOCK_SIZE * blockNumber + offset);
+    if(__builtin_expect(traceCapturing, 0)) {
+        int traced, last = blockNumber + (offset + numberOfBytes - 1) / BLOCK_SIZE;
+        for (traced = blockNumber; traced <= last; traced++)
+            traceBlockIO(traced, 0);
+    }
+    COUNT_STAT(syscalls, 1);
+    COUNT_STAT(bytesRead, numberOfBytes);
+    for (i = 0; blockChecksums != NULL && i < numberOfBytes / BLOCK_SIZE; i++)
+        ok &= verifyBlock(blockNumber + offset / BLOCK_SIZE + i, (char *)buffer + i * BLOCK_SIZE);
+    return ok;
 }
 
 /*
-    Adds the newly deallocated blocks to the free list. Checks if the nfree variable is equal to FREE_ARRAY_SIZE.
-    If so, copies the array to a new block and sets the nfree variable to zero.
-    In any case, add the block to the free list, and increment the nfree variable. 
+    Starts grouping block writes. Until commitTransaction() they are only applied to the cache, so a run
+    of metadata commands that keeps updating the same directory and i-list blocks writes each of them once
 */
-void addAFreeBlock(int blockNumber) {
-    if(superBlock.nfree == FREE_ARRAY_SIZE) {
-        // write to the new block
-        writeBufferToBlock(blockNumber, superBlock.free, FREE_ARRAY_SIZE * 2);
-        superBlock.nfree = 0;
+void beginTransaction() {
+    transactionOpen = 1;
+}
+
+int compareSlotsByBlock(const void *a, const void *b) {
+    return (*(cachedBlock * const *)a)->blockNumber - (*(cachedBlock * const *)b)->blockNumber;
+}
+
+/*
+    Writes every block changed since beginTransaction() in block order and ends the transaction
+*/
+void commitTransaction() {
+    cachedBlock *dirtySlots[CACHE_BLOCKS];
+    int i, count = 0;
+    transactionOpen = 0;
+    for (i = 0; i < CACHE_BLOCKS; i++)
+        if(blockCache[i].dirty)
+            dirtySlots[count++] = &blockCache[i];
+    qsort(dirtySlots, count, sizeof(cachedBlock *), compareSlotsByBlock);
+    for (i = 0; i < count; i++)
+        flushCachedBlock(dirtySlots[i]);
+    if(discardQueued)
+        punchFreedBlocks(); // what the transaction freed can go now that it is on disk
+}
+
+static int compareBlockNumbers(const void *a, const void *b) {
+    return *(const int *)a - *(const int *)b;
+}
+
+/*
+    Allocation groups. The data blocks are split into groups of GROUP_BLOCKS blocks, and the i-list into
+    as many equal parts. While the image is mounted the free blocks and i-nodes are kept in bitmaps, one
+    bit per block or i-node, and every group counts what it has free. Allocation starts in the group
+    'allocationGroup' names: a new file goes to its directory's group, a file's blocks to the group of
+    its i-node, and new directories are spread over the groups (see createFileIn()), so the blocks of a
+    directory and its files end up close together. On disk the lists keep their V6 form: the chain is
+    read into the bitmaps at mount and written back at unmount
+*/
+static int mapBit(const unsigned char *map, int n) {
+    return map[n / 8] & (1 << (n % 8));
+}
+
+static void setMapBit(unsigned char *map, int n) {
+    map[n / 8] |= 1 << (n % 8);
+}
+
+static void clearMapBit(unsigned char *map, int n) {
+    map[n / 8] &= ~(1 << (n % 8));
+}
+
+// group 0 while no image is mounted, there are no groups to divide by then
+int blockGroup(int blockNumber) {
+    if(allocationGroupCount == 0)
+        return 0;
+    int group = (blockNumber - (INODE_TABLE_START + (int)superBlock.isize)) / GROUP_BLOCKS;
+    return group < allocationGroupCount ? group : allocationGroupCount - 1;
+}
+
+int inodeGroup(int iNumber) {
+    if(allocationGroupCount == 0)
+        return 0;
+    int group = iNumber / inodesPerGroup;
+    return group < allocationGroupCount ? group : allocationGroupCount - 1;
+}
+
+/*
+    Sizes the groups, bitmaps and depots for the mounted image. Every block starts out in use and no
+    group's i-node map is loaded yet
+*/
+void setupAllocationGroups() {
+    int dataStart = INODE_TABLE_START + superBlock.isize, group, chunk;
+    int dataBlocks = (int)superBlock.fsize > dataStart ? (int)superBlock.fsize - dataStart : 1;
+    releaseAllocationGroups();
+    allocationGroupCount = (dataBlocks + GROUP_BLOCKS - 1) / GROUP_BLOCKS;
+    inodesPerGroup = (superBlock.ninodes + allocationGroupCount - 1) / allocationGroupCount;
+    if(inodesPerGroup == 0)
+        inodesPerGroup = 1;
+    allocationGroups = calloc(allocationGroupCount, sizeof(allocationGroupType));
+    freeBlockMap = calloc(superBlock.fsize / 8 + 1, 1);
+    freeInodeMap = calloc(superBlock.ninodes / 8 + 1, 1);
+    blockDepots = calloc(allocationGroupCount, sizeof(depot));
+    inodeDepots = calloc(allocationGroupCount, sizeof(depot));
+    // enough chunks for every block and i-node to be on a depot, all of them on emptyChunks for now
+    int chunkCount = (superBlock.fsize + superBlock.ninodes) / MAGAZINE_SIZE + 1;
+    depotChunks = calloc(chunkCount, sizeof(depotChunk));
+    for (chunk = 0; chunk < chunkCount; chunk++)
+        depotChunks[chunk].next = chunk;
+    emptyChunks = chunkCount;
+    for (group = 0; group < allocationGroupCount; group++) {
+        allocationGroups[group].firstBlock = dataStart + group * GROUP_BLOCKS;
+        allocationGroups[group].blockCount = group == allocationGroupCount - 1 ? dataBlocks - group * GROUP_BLOCKS : GROUP_BLOCKS;
+        allocationGroups[group].blockRotor = allocationGroups[group].firstBlock;
+        allocationGroups[group].firstInode = group * inodesPerGroup;
+        allocationGroups[group].inodeCount = group == allocationGroupCount - 1 ? (int)superBlock.ninodes - group * inodesPerGroup : inodesPerGroup;
+        if(allocationGroups[group].inodeCount < 0)
+            allocationGroups[group].inodeCount = 0;
+        allocationGroups[group].inodeRotor = allocationGroups[group].firstInode;
     }
-    superBlock.free[superBlock.nfree] = blockNumber;
-    superBlock.nfree++;
+    allocationGroup = directoryRotor = 0;
 }
 
+static void freeInodeInMap(int iNumber);
+static int takeInodeFromGroup(int group);
+static long long freeInodesInMap();
+
 /*
-    Gets a free block from the free array and returns the block number. If the nfree variable reaches zero,
-    copies the block numbers from the free[0] block into the free array, and sets the nfree variable to 
-    FREE_ARRAY_SIZE
+    Drops what the magazines of every thread hold, they belong to the maps that are going away
 */
-int getAFreeBlock() {
-    if(superBlock.nfree == 0) {
-        int blockNumber = superBlock.free[0];
-        lseek(fileDescriptor, BLOCK_SIZE * blockNumber , SEEK_SET);
-        read(fileDescriptor, superBlock.free, FREE_ARRAY_SIZE * 2);
-        superBlock.nfree = FREE_ARRAY_SIZE;
-        return blockNumber;
+static void discardMagazines() {
+    magazineSet *set;
+    for (set = magazineThreads; set != NULL; set = set->next) {
+        set->blocks.count = set->inodes.count = 0;
+        set->blocks.group = set->inodes.group = -1;
     }
-    superBlock.nfree--;
-    return superBlock.free[superBlock.nfree];
+    __atomic_store_n(&magazinesDraining, 0, __ATOMIC_RELAXED);
+}
+
+void releaseAllocationGroups() {
+    pthread_mutex_lock(&allocatorLock);
+    discardMagazines();
+    free(allocationGroups);
+    free(freeBlockMap);
+    free(freeInodeMap);
+    free(blockDepots);
+    free(inodeDepots);
+    free(depotChunks);
+    allocationGroups = NULL;
+    freeBlockMap = freeInodeMap = NULL;
+    blockDepots = inodeDepots = NULL;
+    depotChunks = NULL;
+    emptyChunks = 0;
+    allocationGroupCount = 0;
+    pthread_mutex_lock(&discardLock);
+    free(discardPending);
+    discardPending = NULL;
+    discardQueued = 0;
+    pthread_mutex_unlock(&discardLock);
+    pthread_mutex_unlock(&allocatorLock);
 }
 
 /*
-    Checks if the ninode variable is equal to FREE_ARRAY_SIZE. If not, add the inode to the free inode list
-    and increment ninode variable
+    Whether a block or i-node is free in the maps, for the callers that do not hold allocatorLock. Its
+    own bit does not change under them, only its neighbours' may
 */
-void addAFreeInode(int iNumber) {
-    if(superBlock.ninode == FREE_ARRAY_SIZE)
-        return; 
-    superBlock.inode[superBlock.ninode] = iNumber;
-    superBlock.ninode++;
+static int isFreeInMap(const unsigned char *map, int n) {
+    return __atomic_load_n(&map[n / 8], __ATOMIC_RELAXED) & (1 << (n % 8));
 }
 
 /*
-    Returns the inode data for the given i-number
+    Marks a block free in its group's map. Blocks outside the data area, and blocks that are free
+    already, are ignored. The caller holds allocatorLock
 */
-Inode getAnInode(int iNumber) {
-    Inode iNode;
-    int blockNumber = (iNumber * INODE_SIZE) / BLOCK_SIZE;
-    int offset = (iNumber * INODE_SIZE) % BLOCK_SIZE;
-    lseek(fileDescriptor,(BLOCK_SIZE * blockNumber) + offset, SEEK_SET);
-    read(fileDescriptor,&iNode,INODE_SIZE);
-    return iNode;
+static void freeBlockInMap(int blockNumber) {
+    if(allocationGroups == NULL || blockNumber < INODE_TABLE_START + (int)superBlock.isize || blockNumber >= (int)superBlock.fsize
+            || mapBit(freeBlockMap, blockNumber))
+        return;
+    setMapBit(freeBlockMap, blockNumber);
+    allocationGroups[blockGroup(blockNumber)].freeBlocks++;
 }
 
 /*
-    Gets a free inode from the free-inode array and returns. Checks if the ninode variable is 
-    less than or equal to zero. If so, iterates the i-list and adds the free inodes to the 
-    free-inode list, and returns the last added inode, and decrements ninode variable
+    Takes the first free block at or after the group's rotor off the map
 */
-int getAFreeInode(){
-        if (superBlock.ninode <= 0) {
-            int i;
-            for (i = 2; i<totalINodesCount; i++) {
-                Inode freeInode = getAnInode(superBlock.inode[i]);
-                if (freeInode.flags != 1<<15) {
-                    superBlock.inode[superBlock.ninode] = i;
-                    superBlock.ninode++;
-                }
+static int takeBlockFromGroup(int group) {
+    allocationGroupType *g = &allocationGroups[group];
+    int end = g->firstBlock + g->blockCount, pass, blockNumber;
+    if(g->freeBlocks == 0)
+        return 0;
+    for (pass = 0; pass < 2; pass++) {
+        int from = pass == 0 ? g->blockRotor : g->firstBlock;
+        int to = pass == 0 ? end : g->blockRotor;
+        for (blockNumber = from; blockNumber < to; blockNumber++) {
+            if(freeBlockMap[blockNumber / 8] == 0) {
+                blockNumber |= 7; // the rest of this byte is in use as well
+                continue;
             }
+            if(mapBit(freeBlockMap, blockNumber)) {
+                clearMapBit(freeBlockMap, blockNumber);
+                g->freeBlocks--;
+                g->blockRotor = blockNumber + 1 < end ? blockNumber + 1 : g->firstBlock;
+                return blockNumber;
+            }
+        }
+    }
+    return 0;
+}
+
+static long long freeBlocksInMap() {
+    long long freeBlocks = 0;
+    int group;
+    for (group = 0; group < allocationGroupCount; group++)
+        freeBlocks += allocationGroups[group].freeBlocks;
+    return freeBlocks;
+}
+
+/*
+    What the magazine and depot code needs to know about blocks or i-nodes. The map functions are
+    called with allocatorLock held
+*/
+typedef struct {
+    int (*takeFromGroup)(int group); // 0 when the group's map is empty
+    void (*release)(int round);
+    long long (*available)(); // free in the maps
+    depot **depots; // one per group
+} roundKind;
+
+static const roundKind blockRounds = { takeBlockFromGroup, freeBlockInMap, freeBlocksInMap, &blockDepots };
+static const roundKind inodeRounds = { takeInodeFromGroup, freeInodeInMap, freeInodesInMap, &inodeDepots };
+
+/*
+    Takes a free block or i-node off the maps, from 'allocationGroup' if it has one and otherwise from
+    the groups after it. Returns 0 once the maps are empty. The caller holds allocatorLock
+*/
+static int takeRound(const roundKind *kind) {
+    int i;
+    for (i = 0; i < allocationGroupCount; i++) {
+        int round = kind->takeFromGroup((allocationGroup + i) % allocationGroupCount);
+        if(round != 0)
+            return round;
+    }
+    return 0;
+}
+
+/*
+    Depots. Between the threads' magazines and the maps every group has a depot for blocks and one for
+    i-nodes: a lock-free stack of chunks of up to MAGAZINE_SIZE rounds. A thread whose magazine runs
+    empty takes a chunk off its group's depot, one whose magazine is full pushes it there, both with a
+    compare-and-swap and no lock. Only when the depot is empty as well does the thread take
+    allocatorLock, to refill its magazine from the maps and put DEPOT_REFILL_CHUNKS more chunks on the
+    depot for whoever comes next. The chunks come from one pool, sized so that it can hold every free
+    block and i-node, and unused ones wait on the emptyChunks stack
+*/
+static int popChunk(unsigned long long *top) {
+    unsigned long long old, new;
+    if(depotLocked)
+        pthread_mutex_lock(&depotLock);
+    old = __atomic_load_n(top, __ATOMIC_ACQUIRE);
+    do {
+        if((old & 0xffffffff) == 0)
+            break;
+        new = ((old >> 32) + 1) << 32 | (unsigned int)__atomic_load_n(&depotChunks[(old & 0xffffffff) - 1].next, __ATOMIC_RELAXED);
+    } while(!__atomic_compare_exchange_n(top, &old, new, 1, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE));
+    if(depotLocked)
+        pthread_mutex_unlock(&depotLock);
+    return (int)(old & 0xffffffff);
+}
+
+static void pushChunk(unsigned long long *top, int index) {
+    unsigned long long old, new;
+    if(depotLocked)
+        pthread_mutex_lock(&depotLock);
+    old = __atomic_load_n(top, __ATOMIC_RELAXED);
+    do {
+        __atomic_store_n(&depotChunks[index - 1].next, (int)(old & 0xffffffff), __ATOMIC_RELAXED);
+        new = ((old >> 32) + 1) << 32 | (unsigned int)index;
+    } while(!__atomic_compare_exchange_n(top, &old, new, 1, __ATOMIC_RELEASE, __ATOMIC_RELAXED));
+    if(depotLocked)
+        pthread_mutex_unlock(&depotLock);
+}
+
+/*
+    Moves what the magazine holds onto a depot. Returns 0, and leaves the magazine alone, when the pool
+    has no empty chunk
+*/
+static int depositMagazine(magazine *m, depot *d) {
+    int index = popChunk(&emptyChunks);
+    if(index == 0)
+        return 0;
+    depotChunk *chunk = &depotChunks[index - 1];
+    memcpy(chunk->rounds, m->rounds, m->count * sizeof(int));
+    chunk->count = m->count;
+    __atomic_fetch_add(&d->rounds, m->count, __ATOMIC_RELAXED);
+    m->count = 0;
+    pushChunk(&d->top, index);
+    return 1;
+}
+
+/*
+    Fills an empty magazine with the top chunk of the group's depot. Returns 0 if the depot is empty
+*/
+static int withdrawMagazine(magazine *m, depot *d, int group) {
+    int index = popChunk(&d->top);
+    if(index == 0)
+        return 0;
+    depotChunk *chunk = &depotChunks[index - 1];
+    memcpy(m->rounds, chunk->rounds, chunk->count * sizeof(int));
+    m->count = chunk->count;
+    m->group = group;
+    __atomic_fetch_sub(&d->rounds, chunk->count, __ATOMIC_RELAXED);
+    pushChunk(&emptyChunks, index);
+    return 1;
+}
+
+/*
+    Gives everything on the depots back to the maps. The caller holds allocatorLock
+*/
+static void drainDepots(const roundKind *kind) {
+    int group, index, i;
+    for (group = 0; group < allocationGroupCount; group++) {
+        depot *d = &(*kind->depots)[group];
+        while((index = popChunk(&d->top)) != 0) {
+            depotChunk *chunk = &depotChunks[index - 1];
+            for (i = 0; i < chunk->count; i++)
+                kind->release(chunk->rounds[i]);
+            __atomic_fetch_sub(&d->rounds, chunk->count, __ATOMIC_RELAXED);
+            pushChunk(&emptyChunks, index);
+        }
+    }
+}
+
+// free in the maps and on the depots
+static long long availableRounds(const roundKind *kind) {
+    long long available = kind->available();
+    int group;
+    for (group = 0; group < allocationGroupCount; group++)
+        available += __atomic_load_n(&(*kind->depots)[group].rounds, __ATOMIC_RELAXED);
+    return available;
+}
+
+/*
+    Magazines. Every thread keeps up to MAGAZINE_SIZE free blocks and as many free i-nodes of its own,
+    taken for the group its allocationGroup named at the time. Allocating and freeing work on them
+    without a lock or atomic operation; the depots are only touched when a magazine runs empty or full,
+    or the thread moves on to another group. When the maps and depots are down to less than a magazine
+    per thread, magazinesDraining is set and every thread hands back what it holds on its next call, so
+    the last free blocks do not sit unused in another thread's magazine. A thread's magazines go back
+    to the maps when it exits, and those of all threads before saveFreeLists() writes the maps out
+*/
+static void releaseMagazineSet(void *data) {
+    magazineSet *set = data, **link;
+    pthread_mutex_lock(&allocatorLock);
+    while(set->blocks.count > 0)
+        freeBlockInMap(set->blocks.rounds[--set->blocks.count]);
+    while(set->inodes.count > 0)
+        freeInodeInMap(set->inodes.rounds[--set->inodes.count]);
+    for (link = &magazineThreads; *link != set; link = &(*link)->next)
+        ;
+    *link = set->next;
+    magazineThreadCount--;
+    pthread_mutex_unlock(&allocatorLock);
+    free(set);
+}
+
+static void createMagazineKey() {
+    pthread_key_create(&magazineKey, releaseMagazineSet);
+}
+
+/*
+    The calling thread's magazines, set up on its first call. NULL if there is no memory for them, the
+    thread then allocates from the maps directly
+*/
+static magazineSet *getOwnMagazines() {
+    if(ownMagazines != NULL)
+        return ownMagazines;
+    pthread_once(&magazineKeyOnce, createMagazineKey);
+    magazineSet *set = calloc(1, sizeof(magazineSet));
+    if(set == NULL)
+        return NULL;
+    set->blocks.group = set->inodes.group = -1;
+    pthread_mutex_lock(&allocatorLock);
+    set->next = magazineThreads;
+    magazineThreads = set;
+    magazineThreadCount++;
+    pthread_mutex_unlock(&allocatorLock);
+    pthread_setspecific(magazineKey, set);
+    return ownMagazines = set;
+}
+
+/*
+    Gives the 'count' rounds at the bottom of a magazine, the ones it would hand out last, back to the
+    maps. The caller holds allocatorLock
+*/
+static void returnRounds(magazine *m, int count, void (*release)(int)) {
+    int i;
+    for (i = 0; i < count; i++)
+        release(m->rounds[i]);
+    memmove(m->rounds, m->rounds + count, (m->count - count) * sizeof(int));
+    m->count -= count;
+}
+
+/*
+    Puts up to DEPOT_REFILL_CHUNKS chunks from the group's map on its depot. The chunk to be handed out
+    first is pushed last, so the rounds come off the depot in the order the map gave them out. The
+    caller holds allocatorLock
+*/
+static void refillDepot(const roundKind *kind, int group) {
+    int taken[DEPOT_REFILL_CHUNKS * MAGAZINE_SIZE], got = 0, first, i, index;
+    depot *d = &(*kind->depots)[group];
+    while(got < DEPOT_REFILL_CHUNKS * MAGAZINE_SIZE && (taken[got] = kind->takeFromGroup(group)) != 0)
+        got++;
+    for (first = (got - 1) / MAGAZINE_SIZE * MAGAZINE_SIZE; got > 0; got = first, first -= MAGAZINE_SIZE) {
+        if((index = popChunk(&emptyChunks)) == 0) {
+            while(got > 0)
+                kind->release(taken[--got]);
+            return;
+        }
+        depotChunk *chunk = &depotChunks[index - 1];
+        chunk->count = got - first;
+        for (i = 0; i < chunk->count; i++)
+            chunk->rounds[chunk->count - 1 - i] = taken[first + i];
+        __atomic_fetch_add(&d->rounds, chunk->count, __ATOMIC_RELAXED);
+        pushChunk(&d->top, index);
+    }
+}
+
+/*
+    Allocates a block or i-node through a magazine (NULL for none). An empty magazine is refilled from
+    the group's depot, and only when that is empty too from the maps under allocatorLock. A magazine
+    that holds rounds for another group goes back to that group's depot first, or to the maps while
+    free space is low. Returns 0 when the maps are empty as well
+*/
+static int allocateRound(magazine *m, const roundKind *kind) {
+    int taken[MAGAZINE_SIZE], got = 0, first, i;
+    int draining = __atomic_load_n(&magazinesDraining, __ATOMIC_RELAXED);
+    if(m != NULL && m->count > 0 && m->group == allocationGroup && !draining)
+        return m->rounds[--m->count];
+    if(m != NULL && !draining && allocationGroups != NULL) {
+        if(m->count > 0 && !depositMagazine(m, &(*kind->depots)[m->group]))
+            goto locked;
+        if(withdrawMagazine(m, &(*kind->depots)[allocationGroup], allocationGroup))
+            return m->rounds[--m->count];
+    }
+locked:
+    pthread_mutex_lock(&allocatorLock);
+    if(m != NULL && (m->group != allocationGroup || magazinesDraining))
+        returnRounds(m, m->count, kind->release);
+    if(m != NULL && m->count > 0)
+        first = m->rounds[--m->count];
+    else if((first = takeRound(kind)) == 0 && availableRounds(kind) > 0) {
+        // what is left sits on the depots
+        drainDepots(kind);
+        first = takeRound(kind);
+    }
+    int low = availableRounds(kind) < (long long)MAGAZINE_SIZE * magazineThreadCount;
+    __atomic_store_n(&magazinesDraining, low, __ATOMIC_RELAXED);
+    if(low)
+        drainDepots(kind);
+    if(m != NULL && first != 0 && !low) {
+        while(got < MAGAZINE_SIZE - m->count && (taken[got] = takeRound(kind)) != 0)
+            got++;
+        // the first one taken goes on top, so the thread gets them in the order the maps gave them out
+        memmove(m->rounds + got, m->rounds, m->count * sizeof(int));
+        for (i = 0; i < got; i++)
+            m->rounds[got - 1 - i] = taken[i];
+        m->count += got;
+        m->group = allocationGroup;
+        refillDepot(kind, allocationGroup);
+    }
+    pthread_mutex_unlock(&allocatorLock);
+    return first;
+}
+
+/*
+    Frees a block or i-node of 'group' into a magazine (NULL for none). A full magazine is pushed on the
+    group's depot first, or gives its bottom half back to the maps if the pool has no chunk left; a
+    round of another group, or any while free space is low, goes straight to the maps
+*/
+static void freeRound(magazine *m, int round, int group, const roundKind *kind) {
+    int draining = __atomic_load_n(&magazinesDraining, __ATOMIC_RELAXED);
+    if(m != NULL && m->count == 0)
+        m->group = group;
+    if(m != NULL && m->group == group && !draining
+            && (m->count < MAGAZINE_SIZE || depositMagazine(m, &(*kind->depots)[group]))) {
+        m->rounds[m->count++] = round;
+        return;
+    }
+    pthread_mutex_lock(&allocatorLock);
+    if(m != NULL && magazinesDraining)
+        returnRounds(m, m->count, kind->release);
+    if(m != NULL && m->group == group && !magazinesDraining) {
+        returnRounds(m, m->count - MAGAZINE_SIZE / 2, kind->release);
+        m->rounds[m->count++] = round;
+    }
+    else
+        kind->release(round);
+    pthread_mutex_unlock(&allocatorLock);
+}
+
+// takes up to 'count' blocks, the magazine and depot first, and returns how many it got
+static int takeFreeBlocks(int *blocks, int count) {
+    magazineSet *own = getOwnMagazines();
+    int got = 0;
+    if(own != NULL && allocationGroups != NULL && !__atomic_load_n(&magazinesDraining, __ATOMIC_RELAXED)) {
+        magazine *m = &own->blocks;
+        if(m->count == 0 || m->group == allocationGroup || depositMagazine(m, &blockDepots[m->group]))
+            while(got < count && (m->count > 0 || withdrawMagazine(m, &blockDepots[allocationGroup], allocationGroup)))
+                blocks[got++] = m->rounds[--m->count];
+    }
+    pthread_mutex_lock(&allocatorLock);
+    if(own != NULL && magazinesDraining)
+        returnRounds(&own->blocks, own->blocks.count, freeBlockInMap);
+    while(got < count && (blocks[got] = takeRound(&blockRounds)) != 0)
+        got++;
+    if(got < count && availableRounds(&blockRounds) > 0) {
+        drainDepots(&blockRounds);
+        while(got < count && (blocks[got] = takeRound(&blockRounds)) != 0)
+            got++;
+    }
+    pthread_mutex_unlock(&allocatorLock);
+    return got;
+}
+
+/*
+    Discard. With discardEnabled every freed block is queued, and the queue is punched out of the image
+    file with fallocate(FALLOC_FL_PUNCH_HOLE) when it fills, when a command ends and before the free
+    lists are written at unmount: sorted, so each run of consecutive blocks costs one call. A block that
+    was allocated again while it waited has its bit in discardPending cleared by getAFreeBlock() or
+    getFreeBlocks() and is skipped. Punching is done under engineLock, which every writer of file data
+    holds, and never while a transaction is open, so the i-nodes that dropped the blocks are on disk
+    first. A punched block reads back as zeros, its contents no longer matter
+*/
+static void keepFromDiscard(int blockNumber) {
+    if(discardPending != NULL)
+        __atomic_fetch_and(&discardPending[blockNumber / 8], (unsigned char)~(1 << (blockNumber % 8)), __ATOMIC_RELAXED);
+}
+
+// punches blocks [first, first + count), returns 0 if the host filesystem cannot
+static int punchRun(int first, int count) {
+    int i;
+    if(fallocate(fileDescriptor, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE, (off_t)first * BLOCK_SIZE,
+                 (off_t)count * BLOCK_SIZE) == 0) {
+        for (i = 0; blockChecksums != NULL && i < count; i++)
+            setBlockChecksum(first + i, zeroBlockChecksum);
+        return 1;
+    }
+    if(errno == EOPNOTSUPP || errno == ENOSYS) {
+        printf("\nThe host filesystem cannot punch holes, discard is off\n");
+        discardEnabled = 0;
+    }
+    return 0;
+}
+
+static void queueDiscard(const int *blocks, int count) {
+    int i, full = 0;
+    pthread_mutex_lock(&discardLock);
+    if(discardPending == NULL)
+        discardPending = calloc(superBlock.fsize / 8 + 1, 1);
+    for (i = 0; i < count && discardPending != NULL; i++) {
+        if(discardQueued == DISCARD_QUEUE_BLOCKS)
+            break; // left for fstrim
+        if(blocks[i] <= 0 || blocks[i] >= (int)superBlock.fsize)
+            continue;
+        __atomic_fetch_or(&discardPending[blocks[i] / 8], (unsigned char)(1 << (blocks[i] % 8)), __ATOMIC_RELAXED);
+        discardQueue[discardQueued++] = blocks[i];
+        full = discardQueued == DISCARD_QUEUE_BLOCKS;
+        if(full && i + 1 < count) {
+            pthread_mutex_unlock(&discardLock);
+            punchFreedBlocks();
+            pthread_mutex_lock(&discardLock);
+            full = 0;
+        }
+    }
+    pthread_mutex_unlock(&discardLock);
+    if(full)
+        punchFreedBlocks();
+}
+
+/*
+    Punches the queued blocks that are still free, coalesced into runs
+*/
+void punchFreedBlocks() {
+    static int queued[DISCARD_QUEUE_BLOCKS];
+    int count, i, run;
+    pthread_mutex_lock(&engineLock);
+    if(transactionOpen || fileDescriptor == -1) {
+        pthread_mutex_unlock(&engineLock);
+        return;
+    }
+    pthread_mutex_lock(&discardLock);
+    count = discardQueued;
+    memcpy(queued, discardQueue, count * sizeof(int));
+    discardQueued = 0;
+    pthread_mutex_unlock(&discardLock);
+    qsort(queued, count, sizeof(int), compareBlockNumbers);
+    for (i = 0; i < count && discardEnabled; i += run) {
+        run = 0;
+        while(i + run < count && queued[i + run] == queued[i] + run && discardPending[queued[i + run] / 8] & (1 << (queued[i + run] % 8))) {
+            keepFromDiscard(queued[i + run]);
+            run++;
+        }
+        if(run == 0)
+            run = 1; // allocated again, or queued twice
+        else
+            punchRun(queued[i], run);
+    }
+    pthread_mutex_unlock(&engineLock);
+}
+
+/*
+    fstrim: punches every free range of the image, whether or not discard was on when it was freed.
+    Removed files still on the orphan list are reclaimed and the depots are emptied into the maps
+    first; the few blocks in the threads' magazines are skipped.
+    Returns the number of blocks punched, -1 if the host filesystem does not support it
+*/
+int trimFreeBlocks() {
+    int blockNumber, run, punched = 0, ranges = 0, failed = 0;
+    pthread_mutex_lock(&engineLock);
+    if(transactionOpen)
+        commitTransaction();
+    reclaimOrphans();
+    punchFreedBlocks();
+    pthread_mutex_lock(&allocatorLock);
+    drainDepots(&blockRounds);
+    for (blockNumber = INODE_TABLE_START + superBlock.isize; blockNumber < (int)superBlock.fsize && !failed; blockNumber += run + 1) {
+        for (run = 0; blockNumber + run < (int)superBlock.fsize && mapBit(freeBlockMap, blockNumber + run); run++)
+            ;
+        if(run == 0)
+            continue;
+        if(punchRun(blockNumber, run)) {
+            punched += run;
+            ranges++;
+        }
+        else
+            failed = 1;
+    }
+    pthread_mutex_unlock(&allocatorLock);
+    pthread_mutex_unlock(&engineLock);
+    if(failed && punched == 0)
+        return -1;
+    printf("\npunched %d free blocks in %d ranges\n", punched, ranges);
+    return punched;
+}
+
+/*
+    Shared blocks. With dedup on, several files may point at the same data block. Once that can happen
+    superBlock.sharedBlocks is set, and while the image is mounted blockShares counts the references to
+    each block beyond the first. Unmount writes the counts into the share area after the checksums, and
+    the next mount reads them back; after a crash they are taken from the block maps of every file.
+    Freeing a shared block only drops a reference, and a file gets a copy of its own of a shared block
+    before writing to it (see unshareFileBlock()). Used under engineLock
+*/
+static void countBlockReference(void *counts, int fileBlock, int blockNumber) {
+    if(fileBlock != FRAGMENT_FILE_BLOCK && blockNumber < (int)superBlock.fsize)
+        ((unsigned short *)counts)[blockNumber]++;
+}
+
+// the share area, which initfs keeps right after the checksum area
+static off_t shareAreaOffset() {
+    return (off_t)(superBlock.fsize + CHECKSUM_AREA_BLOCKS(superBlock.fsize)) * BLOCK_SIZE;
+}
+
+static int loadBlockShares() {
+    int iNumber, blockNumber;
+    size_t size = (size_t)superBlock.fsize * sizeof(unsigned short);
+    if(blockShares != NULL || !superBlock.sharedBlocks)
+        return 1;
+    if((blockShares = calloc(superBlock.fsize, sizeof(unsigned short))) == NULL)
+        return 0;
+    // the saved counts go stale as soon as a block is shared or freed, the image is marked for a walk
+    // until unmount saves them again
+    if(superBlock.sharedBlocks == SHARES_SAVED && superBlock.clean == FS_CLEAN) {
+        superBlock.sharedBlocks = 1;
+        COUNT_STAT(syscalls, 1);
+        if(pread(fileDescriptor, blockShares, size, shareAreaOffset()) == (ssize_t)size)
+            return 1;
+        memset(blockShares, 0, size); // an image from before the share area
+    }
+    superBlock.sharedBlocks = 1;
+    for (iNumber = 0; iNumber < (int)superBlock.ninodes; iNumber++) {
+        Inode inode = getAnInode(iNumber);
+        if(inode.flags & INODE_ALLOCATED)
+            walkFileBlocks(fileDescriptor, superBlock.fsize, &inode, countBlockReference, blockShares);
+    }
+    for (blockNumber = 0; blockNumber < (int)superBlock.fsize; blockNumber++)
+        if(blockShares[blockNumber] > 0)
+            blockShares[blockNumber]--;
+    return 1;
+}
+
+static int isSharedBlock(int blockNumber) {
+    return superBlock.sharedBlocks && blockShares != NULL && blockNumber > 0 && blockNumber < (int)superBlock.fsize
+           && blockShares[blockNumber] > 0;
+}
+
+// counts one more reference to a block; the first one on an image marks it as having shared blocks
+static int shareBlock(int blockNumber) {
+    if(!superBlock.sharedBlocks) {
+        if(blockShares == NULL && (blockShares = calloc(superBlock.fsize, sizeof(unsigned short))) == NULL)
+            return 0;
+        superBlock.sharedBlocks = 1;
+        writeSuperBlock();
+    }
+    if(blockShares[blockNumber] == 0xffff)
+        return 0;
+    blockShares[blockNumber]++;
+    return 1;
+}
+
+// drops a reference to a shared block. Returns 0 for a block nobody else uses, the caller frees it
+static int dropBlockShare(int blockNumber) {
+    if(!isSharedBlock(blockNumber))
+        return 0;
+    blockShares[blockNumber]--;
+    return 1;
+}
+
+/*
+    Writes the share counts into the share area at unmount and drops them. An image on which no block is
+    shared any more is marked as having none, and its next mount has nothing to load
+*/
+static void saveBlockShares() {
+    int blockNumber;
+    size_t size = (size_t)superBlock.fsize * sizeof(unsigned short);
+    if(blockShares != NULL && superBlock.sharedBlocks) {
+        for (blockNumber = 0; blockNumber < (int)superBlock.fsize && blockShares[blockNumber] == 0; blockNumber++)
+            ;
+        if(blockNumber == (int)superBlock.fsize)
+            superBlock.sharedBlocks = 0;
+        else if(pwrite(fileDescriptor, blockShares, size, shareAreaOffset()) == (ssize_t)size)
+            superBlock.sharedBlocks = SHARES_SAVED;
+        COUNT_STAT(syscalls, 1);
+    }
+    free(blockShares);
+    blockShares = NULL;
+}
+
+/*
+    The hash index of the data blocks cpin wrote with dedup on: chains of blocks with the same hash
+    bits, one chain per bucket, kept in arrays of one entry per block. It is saved in a file of its own
+    (superBlock.dedupIndex, in no directory) at unmount and read back at mount, when every block that
+    is not in use is still free in the maps, so entries for blocks freed since are dropped then. A block
+    that is freed while mounted leaves the index, one that is written in place keeps a stale hash; a
+    lookup compares the contents before it trusts an entry
+*/
+static void forgetIndexedBlock(int blockNumber) {
+    int *link;
+    if(dedupNext == NULL || blockNumber <= 0 || blockNumber >= (int)superBlock.fsize || dedupNext[blockNumber] == DEDUP_UNINDEXED)
+        return;
+    for (link = &dedupBuckets[dedupHashes[blockNumber] & dedupBucketMask]; *link != -1; link = &dedupNext[*link]) {
+        if(*link == blockNumber) {
+            *link = dedupNext[blockNumber];
+            break;
+        }
+    }
+    dedupNext[blockNumber] = DEDUP_UNINDEXED;
+    dedupChanged = 1;
+}
+
+static void indexBlock(int blockNumber, unsigned int hash) {
+    forgetIndexedBlock(blockNumber);
+    dedupHashes[blockNumber] = hash;
+    dedupNext[blockNumber] = dedupBuckets[hash & dedupBucketMask];
+    dedupBuckets[hash & dedupBucketMask] = blockNumber;
+    dedupChanged = 1;
+}
+
+static void releaseDedupIndex() {
+    free(dedupBuckets);
+    free(dedupNext);
+    free(dedupHashes);
+    dedupBuckets = dedupNext = NULL;
+    dedupHashes = NULL;
+}
+
+/*
+    Sets up the index, with the entries of the saved one whose blocks are still in use. Returns 0 if
+    there was no memory for it
+*/
+static int loadDedupIndex() {
+    dedupEntry entries[BLOCK_SIZE / sizeof(dedupEntry)];
+    int i, got, blockNumber, buckets = 1;
+    unsigned int offset = 0;
+    if(dedupNext != NULL)
+        return 1;
+    while(buckets < (int)superBlock.fsize)
+        buckets *= 2;
+    dedupBuckets = malloc(buckets * sizeof(int));
+    dedupNext = malloc(superBlock.fsize * sizeof(int));
+    dedupHashes = malloc(superBlock.fsize * sizeof(unsigned int));
+    if(dedupBuckets == NULL || dedupNext == NULL || dedupHashes == NULL) {
+        releaseDedupIndex();
+        return 0;
+    }
+    dedupBucketMask = buckets - 1;
+    for (i = 0; i < buckets; i++)
+        dedupBuckets[i] = -1;
+    for (i = 0; i < (int)superBlock.fsize; i++)
+        dedupNext[i] = DEDUP_UNINDEXED;
+    if(superBlock.dedupIndex == 0 || superBlock.dedupIndex >= superBlock.ninodes)
+        return 1;
+    while((got = readFileRange(superBlock.dedupIndex, entries, sizeof(entries), offset, NULL)) > 0) {
+        for (i = 0; i < got / (int)sizeof(dedupEntry); i++) {
+            blockNumber = entries[i].blockNumber;
+            if(blockNumber >= INODE_TABLE_START + (int)superBlock.isize && blockNumber < (int)superBlock.fsize
+                    && !isFreeInMap(freeBlockMap, blockNumber))
+                indexBlock(blockNumber, entries[i].hash);
+        }
+        offset += got;
+    }
+    dedupChanged = 0;
+    return 1;
+}
+
+/*
+    Writes the index into its file, which gets an i-node the first time. An index that does not fit
+    is dropped, it only costs the duplicates that are not found
+*/
+static void saveDedupIndex() {
+    int blockNumber, count = 0, iNumber = superBlock.dedupIndex;
+    if(dedupNext == NULL || !dedupChanged)
+        return;
+    dedupEntry *entries = malloc(superBlock.fsize * sizeof(dedupEntry));
+    if(entries == NULL)
+        return;
+    for (blockNumber = 0; blockNumber < (int)superBlock.fsize; blockNumber++) {
+        if(dedupNext[blockNumber] == DEDUP_UNINDEXED)
+            continue;
+        entries[count].hash = dedupHashes[blockNumber];
+        entries[count++].blockNumber = blockNumber;
+    }
+    if(iNumber == 0 && (iNumber = getAFreeInode()) != 0) {
+        Inode inode;
+        memset(&inode, 0, sizeof(inode));
+        inode.flags = INODE_ALLOCATED;
+        inode.actime = inode.modtime = time(NULL);
+        writeTheInode(iNumber, inode);
+        superBlock.dedupIndex = iNumber;
+    }
+    if(iNumber != 0) {
+        truncateFile(iNumber, 0);
+        int length = count * sizeof(dedupEntry);
+        if(writeFileRange(iNumber, entries, length, 0, NULL) != length)
+            truncateFile(iNumber, 0);
+    }
+    free(entries);
+    dedupChanged = 0;
+}
+
+/*
+    Adds a deallocated block to the free blocks. Blocks outside the data area, and blocks that are free
+    already, are ignored. A block other files share only loses a reference
+*/
+void addAFreeBlock(int blockNumber) {
+    magazineSet *own = getOwnMagazines();
+    if(allocationGroups == NULL || blockNumber < INODE_TABLE_START + (int)superBlock.isize || blockNumber >= (int)superBlock.fsize
+            || isFreeInMap(freeBlockMap, blockNumber) || dropBlockShare(blockNumber))
+        return;
+    forgetIndexedBlock(blockNumber);
+    freeRound(own ? &own->blocks : NULL, blockNumber, blockGroup(blockNumber), &blockRounds);
+    if(discardEnabled)
+        queueDiscard(&blockNumber, 1);
+}
+
+/*
+    Returns a free block, from 'allocationGroup' if it has one and otherwise from the groups after it.
+    When the disk is full the orphans still waiting for the reclaimer are freed first.
+    Returns 0 once the disk is full
+*/
+int getAFreeBlock() {
+    magazineSet *own = getOwnMagazines();
+    int blockNumber = allocateRound(own ? &own->blocks : NULL, &blockRounds);
+    if(blockNumber == 0 && superBlock.orphanList != 0 && reclaimOrphans())
+        blockNumber = allocateRound(own ? &own->blocks : NULL, &blockRounds);
+    if(blockNumber == 0)
+        printf("\n%s\n","NO FREE BLOCKS LEFT!");
+    else
+        keepFromDiscard(blockNumber);
+    return blockNumber;
+}
+
+/*
+    Takes 'count' free blocks in ascending order. Each group hands out its blocks from a rotor that only
+    moves forwards, so what was free next to each other comes out as runs of consecutive blocks. The
+    thread's magazine and the group's depot hold the blocks just before the rotor, they are used first.
+    Returns how many blocks it got, fewer than 'count' when the disk is full even without the orphans
+*/
+int getFreeBlocks(int *blocks, int count) {
+    int got = takeFreeBlocks(blocks, count), i;
+    if(got < count && superBlock.orphanList != 0 && reclaimOrphans())
+        got += takeFreeBlocks(blocks + got, count - got);
+    if(got < count)
+        printf("\n%s\n","NO FREE BLOCKS LEFT!");
+    if(discardPending != NULL)
+        for (i = 0; i < got; i++)
+            keepFromDiscard(blocks[i]);
+    for (i = 1; i < got && blocks[i] > blocks[i - 1]; i++)
+        ;
+    if(i < got)
+        qsort(blocks, got, sizeof(int), compareBlockNumbers);
+    return got;
+}
+
+/*
+    Adds a block to the V6 free list in the superblock. When the array is full it is copied into the
+    block, which becomes the next link of the chain
+*/
+static void pushFreeListBlock(int blockNumber) {
+    if(superBlock.nfree == FREE_ARRAY_SIZE) {
+        // write to the new block
+        writeBufferToBlock(blockNumber, superBlock.free, FREE_ARRAY_SIZE * 2);
+        superBlock.nfree = 0;
+        COUNT_STAT(allocatorSpills, 1);
+    }
+    superBlock.free[superBlock.nfree] = blockNumber;
+    superBlock.nfree++;
+}
+
+/*
+    Reads the V6 free-block list into the group maps, following the chain from the superblock. The
+    number of links followed is bounded, so a damaged chain cannot loop
+*/
+void loadFreeBlockList() {
+    unsigned short list[FREE_ARRAY_SIZE];
+    int count = superBlock.nfree, links = superBlock.fsize / (FREE_ARRAY_SIZE - 1) + 2, i;
+    setupAllocationGroups();
+    memcpy(list, superBlock.free, sizeof(list));
+    pthread_mutex_lock(&allocatorLock);
+    while(count > 0 && count <= FREE_ARRAY_SIZE && links-- > 0) {
+        for (i = count - 1; i >= 1; i--)
+            freeBlockInMap(list[i]);
+        if(list[0] == 0 || list[0] >= superBlock.fsize)
+            break;
+        freeBlockInMap(list[0]);
+        readFromBlockWithOffset(list[0], 0, list, sizeof(list));
+        COUNT_STAT(allocatorRefills, 1);
+        count = FREE_ARRAY_SIZE;
+    }
+    pthread_mutex_unlock(&allocatorLock);
+}
+
+/*
+    Writes the free maps back as V6 lists: the free-block chain, and as many free i-nodes as the
+    superblock array holds. What the threads' magazines and the depots hold goes back to the maps
+    first. Block 0 goes in first as the end-of-list marker
+*/
+void saveFreeLists() {
+    int blockNumber, group, iNumber;
+    magazineSet *set;
+    pthread_mutex_lock(&allocatorLock);
+    for (set = magazineThreads; set != NULL; set = set->next) {
+        returnRounds(&set->blocks, set->blocks.count, freeBlockInMap);
+        returnRounds(&set->inodes, set->inodes.count, freeInodeInMap);
+    }
+    drainDepots(&blockRounds);
+    drainDepots(&inodeRounds);
+    superBlock.nfree = 0;
+    pushFreeListBlock(0);
+    for (blockNumber = INODE_TABLE_START + superBlock.isize; blockNumber < superBlock.fsize; blockNumber++)
+        if(mapBit(freeBlockMap, blockNumber))
+            pushFreeListBlock(blockNumber);
+    superBlock.ninode = 0;
+    for (group = 0; group < allocationGroupCount && superBlock.ninode < FREE_ARRAY_SIZE; group++) {
+        allocationGroupType *g = &allocationGroups[group];
+        loadInodeMap(group);
+        for (iNumber = g->firstInode; iNumber < g->firstInode + g->inodeCount && superBlock.ninode < FREE_ARRAY_SIZE; iNumber++)
+            if(mapBit(freeInodeMap, iNumber))
+                superBlock.inode[superBlock.ninode++] = iNumber;
+    }
+    pthread_mutex_unlock(&allocatorLock);
+}
+
+/*
+    Builds a group's free i-node map the first time the group is used. Its part of the i-list is read
+    with one call; blocks changed by an open transaction are taken from the cache instead
+*/
+void loadInodeMap(int group) {
+    allocationGroupType *g = &allocationGroups[group];
+    int iNumber, blockNumber;
+    if(g->inodeMapLoaded)
+        return;
+    g->inodeMapLoaded = 1;
+    if(g->inodeCount == 0)
+        return;
+    int firstBlock = INODE_TABLE_START + g->firstInode * INODE_SIZE / BLOCK_SIZE;
+    int lastBlock = INODE_TABLE_START + ((g->firstInode + g->inodeCount) * INODE_SIZE - 1) / BLOCK_SIZE;
+    char *blocks = malloc((size_t)(lastBlock - firstBlock + 1) * BLOCK_SIZE);
+    if(blocks == NULL) {
+        g->inodeMapLoaded = 0;
+        return;
+    }
+    COUNT_STAT(inodeRescans, 1);
+    readFromBlockWithOffset(firstBlock, 0, blocks, (lastBlock - firstBlock + 1) * BLOCK_SIZE);
+    for (blockNumber = firstBlock; blockNumber <= lastBlock; blockNumber++) {
+        cachedBlock *slot = &blockCache[CACHE_SLOT(blockNumber)];
+        if(slot->dirty && slot->blockNumber == blockNumber)
+            memcpy(blocks + (size_t)(blockNumber - firstBlock) * BLOCK_SIZE, slot->data, BLOCK_SIZE);
+    }
+    for (iNumber = g->firstInode; iNumber < g->firstInode + g->inodeCount; iNumber++) {
+        Inode *inode = (Inode *)(blocks + (size_t)(INODE_TABLE_START * BLOCK_SIZE + iNumber * INODE_SIZE - firstBlock * BLOCK_SIZE));
+        if(iNumber != 0 && !(inode->flags & INODE_ALLOCATED)) {
+            setMapBit(freeInodeMap, iNumber);
+            g->freeInodes++;
+        }
+    }
+    free(blocks);
+}
+
+/*
+    Marks the i-node free in its group's map. A group whose map is not loaded yet finds it free in the
+    i-list when it is. The caller holds allocatorLock
+*/
+static void freeInodeInMap(int iNumber) {
+    if(allocationGroups == NULL || iNumber <= 0 || iNumber >= (int)superBlock.ninodes)
+        return;
+    allocationGroupType *g = &allocationGroups[inodeGroup(iNumber)];
+    if(!g->inodeMapLoaded || mapBit(freeInodeMap, iNumber))
+        return;
+    setMapBit(freeInodeMap, iNumber);
+    g->freeInodes++;
+    if(iNumber < g->inodeRotor)
+        g->inodeRotor = iNumber;
+}
+
+/*
+    Takes the lowest free i-node of the group off its map, loading the map first if needed. The caller
+    holds allocatorLock
+*/
+static int takeInodeFromGroup(int group) {
+    allocationGroupType *g = &allocationGroups[group];
+    int iNumber;
+    loadInodeMap(group);
+    if(g->freeInodes == 0)
+        return 0; // i-node 0 is the root, so it never comes off the free list
+    // the lowest free i-node, so the group's part of the i-list stays dense
+    for (iNumber = g->inodeRotor; !mapBit(freeInodeMap, iNumber); iNumber++)
+        ;
+    clearMapBit(freeInodeMap, iNumber);
+    g->freeInodes--;
+    g->inodeRotor = iNumber + 1;
+    return iNumber;
+}
+
+// groups whose map is not loaded yet are counted as all free
+static long long freeInodesInMap() {
+    long long freeInodes = 0;
+    int group;
+    for (group = 0; group < allocationGroupCount; group++)
+        freeInodes += allocationGroups[group].inodeMapLoaded ? allocationGroups[group].freeInodes : allocationGroups[group].inodeCount;
+    return freeInodes;
+}
+
+/*
+    Adds a released i-node to the free i-nodes. One of a group whose map is not loaded yet goes to the
+    map, which ignores it: it is found free in the i-list once the map is loaded, so no magazine may
+    hold it as well
+*/
+void addAFreeInode(int iNumber) {
+    magazineSet *own = getOwnMagazines();
+    if(allocationGroups == NULL || iNumber <= 0 || iNumber >= (int)superBlock.ninodes || isFreeInMap(freeInodeMap, iNumber))
+        return;
+    int group = inodeGroup(iNumber);
+    int loaded = __atomic_load_n(&allocationGroups[group].inodeMapLoaded, __ATOMIC_RELAXED);
+    freeRound(own && loaded ? &own->inodes : NULL, iNumber, group, &inodeRounds);
+}
+
+/*
+    Frees many blocks or i-nodes at once, straight into the maps under one hold of allocatorLock instead
+    of one magazine push each. Sorted input touches every map byte and group counter in turn
+*/
+void addFreeBlocks(const int *blocks, int count) {
+    int i, kept = 0;
+    pthread_mutex_lock(&allocatorLock);
+    for (i = 0; i < count; i++) {
+        if(dropBlockShare(blocks[i])) {
+            kept++;
+            continue;
+        }
+        forgetIndexedBlock(blocks[i]);
+        freeBlockInMap(blocks[i]);
+    }
+    pthread_mutex_unlock(&allocatorLock);
+    if(discardEnabled && kept == 0)
+        queueDiscard(blocks, count);
+    else if(discardEnabled)
+        for (i = 0; i < count; i++)
+            if(isFreeInMap(freeBlockMap, blocks[i]))
+                queueDiscard(&blocks[i], 1); // not the blocks other files still use
+}
+
+void addFreeInodes(const int *iNumbers, int count) {
+    int i;
+    pthread_mutex_lock(&allocatorLock);
+    for (i = 0; i < count; i++)
+        freeInodeInMap(iNumbers[i]);
+    pthread_mutex_unlock(&allocatorLock);
+}
+
+/*
+    Returns the inode data for the given i-number
+*/
+Inode getAnInode(int iNumber) {
+    Inode iNode;
+    int blockNumber = INODE_TABLE_START + (iNumber * INODE_SIZE) / BLOCK_SIZE;
+    int offset = (iNumber * INODE_SIZE) % BLOCK_SIZE;
+    memcpy(&iNode, getCachedBlock(blockNumber) + offset, INODE_SIZE);
+    return iNode;
+}
+
+/*
+    Gets a free i-node, from 'allocationGroup' if it has one and otherwise from the groups after it.
+    Returns 0 when no i-node is free, not even after the orphans have been reclaimed
+*/
+int getAFreeInode() {
+    magazineSet *own = getOwnMagazines();
+    int iNumber = allocateRound(own ? &own->inodes : NULL, &inodeRounds);
+    if(iNumber == 0 && superBlock.orphanList != 0 && reclaimOrphans())
+        iNumber = allocateRound(own ? &own->inodes : NULL, &inodeRounds);
+    if(iNumber == 0)
+        printf("\n%s\n","NO FREE INODES LEFT!");
+    return iNumber;
+}
+
+/*
+    Picks the group for a new directory: the next group, after the one the last directory went to, that
+    has a free i-node and at least the average number of free blocks. Directories, and the files that
+    will follow them, spread over the disk instead of piling up in one group
+*/
+int directoryGroup(int parentINumber) {
+    long long freeBlocks = 0;
+    int i;
+    for (i = 0; i < allocationGroupCount; i++)
+        freeBlocks += allocationGroups[i].freeBlocks;
+    for (i = 1; i <= allocationGroupCount; i++) {
+        int group = (directoryRotor + i) % allocationGroupCount;
+        loadInodeMap(group);
+        if(allocationGroups[group].freeInodes > 0
+                && (long long)allocationGroups[group].freeBlocks * allocationGroupCount >= freeBlocks)
+            return directoryRotor = group;
+    }
+    return inodeGroup(parentINumber);
+}
+
+/*
+    Writes the data of the inode structure into the inode in the filesystem, specified
+    by the i-number
+*/
+void writeTheInode(int iNumber, Inode inode) {
+    int blockNumber = INODE_TABLE_START + (iNumber * INODE_SIZE )/ BLOCK_SIZE;
+    int offset = (iNumber * INODE_SIZE) % BLOCK_SIZE;
+    writeToBlockWithOffset(blockNumber, offset, &inode, sizeof(Inode));
+}
+
+/*
+    Returns the number of file blocks covered by the i-node's size. A directory always owns at least
+    its first block
+*/
+int inodeBlockCount(const Inode *inode) {
+    if(inode->flags & INODE_INLINE)
+        return 0;
+    int blocks = (inode->size + BLOCK_SIZE - 1) / BLOCK_SIZE;
+    if(blocks == 0 && (inode->flags & INODE_DIRECTORY))
+        blocks = 1;
+    if(blocks > MAX_FILE_BLOCKS)
+        blocks = MAX_FILE_BLOCKS;
+    return blocks;
+}
+
+/*
+    Copies the entries of a directory into the array, through the block cache
+*/
+void readDirectoryEntries(const Inode *directoryInode, directoryEntry *entries) {
+    memcpy(entries, getCachedBlock(directoryInode->addr[0]), directoryInode->size);
+}
+
+/*
+    Sets up an empty block-map cache, which also holds the readahead state of the file it is used for.
+    releaseBlockMapCache() frees the copies of indirect blocks it collected
+*/
+void initBlockMapCache(blockMapCache *cache) {
+    memset(cache, 0, sizeof(blockMapCache));
+    cache->generation = blockMapGeneration;
+    cache->readaheadWindow = READAHEAD_MIN_BLOCKS;
+}
+
+/*
+    Frees what the cache holds and returns unused reserved blocks. Appends still buffered in it are
+    dropped, flushDelayedWrite() first
+*/
+void releaseBlockMapCache(blockMapCache *cache) {
+    int slot;
+    for (slot = 0; slot < INDIRECT_MAP_SLOTS; slot++)
+        free(cache->entries[slot]);
+    free(cache->delayedData);
+    releaseReservedBlocks(cache);
+    initBlockMapCache(cache);
+}
+
+/*
+    Returns entry 'index' of an indirect block. 'slot' says which indirect block of the file it is: 0 for
+    the single indirect block, 1 for the top of the double indirect tree, 2 + n for its n-th child.
+    With a cache the block is read once and kept; any change to a block map since it was read (the
+    generation moved on) drops everything the cache holds
+*/
+static int indirectEntry(int blockNumber, int slot, int index, blockMapCache *cache) {
+    unsigned short entry;
+    if(blockNumber == 0)
+        return 0;
+    if(cache == NULL) {
+        readFromBlockWithOffset(blockNumber, index * sizeof(unsigned short), &entry, sizeof(unsigned short));
+        return entry;
+    }
+    if(cache->generation != blockMapGeneration) {
+        memset(cache->blockNumbers, 0, sizeof(cache->blockNumbers));
+        cache->generation = blockMapGeneration;
+    }
+    if(cache->blockNumbers[slot] != blockNumber) {
+        if(cache->entries[slot] == NULL && (cache->entries[slot] = malloc(BLOCK_SIZE)) == NULL) {
+            readFromBlockWithOffset(blockNumber, index * sizeof(unsigned short), &entry, sizeof(unsigned short));
+            return entry;
+        }
+        readFromBlockWithOffset(blockNumber, 0, cache->entries[slot], BLOCK_SIZE);
+        cache->blockNumbers[slot] = blockNumber;
+    }
+    return cache->entries[slot][index];
+}
+
+/*
+    Returns the block holding byte (fileBlock * BLOCK_SIZE) of the file, 0 for a hole. addr[0..19] point
+    at data blocks, addr[20] at a single indirect block and addr[21] at a double indirect block, each
+    indirect block holding ADDRESSES_PER_BLOCK block numbers. A file with inline data has no blocks, and
+    a packed tail (see isPackedTail()) reads as a hole here
+*/
+int bmap(const Inode *inode, int fileBlock, blockMapCache *cache) {
+    if(fileBlock < 0 || fileBlock >= MAX_FILE_BLOCKS || (inode->flags & INODE_INLINE))
+        return 0;
+    if((inode->flags & INODE_TAIL_PACKED) && fileBlock >= DIRECT_ADDRESSES)
+        return 0;
+    if(fileBlock < DIRECT_ADDRESSES)
+        return inode->addr[fileBlock];
+    fileBlock -= DIRECT_ADDRESSES;
+    if(fileBlock < ADDRESSES_PER_BLOCK)
+        return indirectEntry(inode->addr[SINGLE_INDIRECT], 0, fileBlock, cache);
+    fileBlock -= ADDRESSES_PER_BLOCK;
+    int middle = indirectEntry(inode->addr[DOUBLE_INDIRECT], 1, fileBlock / ADDRESSES_PER_BLOCK, cache);
+    return indirectEntry(middle, 2 + fileBlock / ADDRESSES_PER_BLOCK, fileBlock % ADDRESSES_PER_BLOCK, cache);
+}
+
+/*
+    Returns the number of blocks, indirect blocks included, a file of 'size' bytes occupies
+*/
+int blocksForSize(unsigned int size) {
+    int dataBlocks = (size + BLOCK_SIZE - 1) / BLOCK_SIZE;
+    int blocks = dataBlocks;
+    if(dataBlocks > DIRECT_ADDRESSES)
+        blocks++;
+    if(dataBlocks > DIRECT_ADDRESSES + ADDRESSES_PER_BLOCK)
+        blocks += 1 + (dataBlocks - DIRECT_ADDRESSES - ADDRESSES_PER_BLOCK + ADDRESSES_PER_BLOCK - 1) / ADDRESSES_PER_BLOCK;
+    return blocks;
+}
+
+/*
+    Reserves every block a file of 'size' bytes will need, as one ascending run taken off the free list.
+    Allocations made through the cache use the reservation before the free list: data blocks from its
+    start and indirect blocks from its end, so the data stays one run. releaseBlockMapCache() puts back
+    what was not used. Returns 0 with errno = ENOSPC, and nothing reserved, if the blocks are not all free
+*/
+int reserveFileBlocks(blockMapCache *cache, unsigned int size) {
+    int count = blocksForSize(size);
+    if(count == 0)
+        return 1;
+    if((cache->reservedBlocks = malloc(count * sizeof(int))) == NULL) {
+        errno = ENOMEM;
+        return 0;
+    }
+    cache->reservedCount = getFreeBlocks(cache->reservedBlocks, count);
+    cache->reservedNext = 0;
+    if(cache->reservedCount < count) {
+        releaseReservedBlocks(cache);
+        errno = ENOSPC;
+        return 0;
+    }
+    return 1;
+}
+
+/*
+    Returns the blocks of the cache's reservation that were not used to the free list
+*/
+void releaseReservedBlocks(blockMapCache *cache) {
+    while(cache->reservedCount > cache->reservedNext)
+        addAFreeBlock(cache->reservedBlocks[--cache->reservedCount]);
+    free(cache->reservedBlocks);
+    cache->reservedBlocks = NULL;
+    cache->reservedCount = cache->reservedNext = 0;
+}
+
+/*
+    Allocates a block, out of the cache's reservation if it has one left. Indirect blocks ('fromEnd')
+    come from the end of the reservation, data blocks from its start
+*/
+static int allocateBlock(blockMapCache *cache, int fromEnd) {
+    if(cache == NULL || cache->reservedNext == cache->reservedCount)
+        return getAFreeBlock();
+    return fromEnd ? cache->reservedBlocks[--cache->reservedCount] : cache->reservedBlocks[cache->reservedNext++];
+}
+
+/*
+    Allocates a block and fills it with zeros, for new indirect blocks
+*/
+static int getAZeroedBlock(blockMapCache *cache) {
+    char zeros[BLOCK_SIZE] = {0};
+    int blockNumber = allocateBlock(cache, 1);
+    if(blockNumber != 0)
+        writeBufferToBlock(blockNumber, zeros, BLOCK_SIZE);
+    return blockNumber;
+}
+
+/*
+    Returns entry 'index' of the indirect block, first filling it if it is empty: with a zeroed block
+    when it will be an indirect block itself, otherwise with 'dataBlock', or a block off the free list
+    if that is 0. Every change moves the block-map generation on; the caller's own cache is updated
+    instead of dropped
+*/
+static int allocateIndirectEntry(int blockNumber, int slot, int index, int zeroed, int dataBlock, int *fresh,
+                                 blockMapCache *cache) {
+    unsigned short entry = indirectEntry(blockNumber, slot, index, cache);
+    if(entry != 0)
+        return entry;
+    if((entry = zeroed ? getAZeroedBlock(cache) : dataBlock != 0 ? dataBlock : allocateBlock(cache, 0)) == 0)
+        return 0;
+    writeToBlockWithOffset(blockNumber, index * sizeof(unsigned short), &entry, sizeof(unsigned short));
+    *fresh = !zeroed;
+    if(cache != NULL && cache->generation == blockMapGeneration) {
+        if(cache->blockNumbers[slot] == blockNumber)
+            cache->entries[slot][index] = entry;
+        cache->generation = ++blockMapGeneration;
+    }
+    else
+        blockMapGeneration++;
+    return entry;
+}
+
+/*
+    Maps file block 'fileBlock' to 'dataBlock' (a block off the free list if that is 0), allocating any
+    indirect block on the way. A block the file already has there is kept and returned instead. Inline
+    data has to be spilled, and a packed tail unpacked, first
+*/
+static int bmapAssign(Inode *inode, int fileBlock, int dataBlock, int *fresh, blockMapCache *cache) {
+    *fresh = 0;
+    if(fileBlock < 0 || fileBlock >= MAX_FILE_BLOCKS || (inode->flags & (INODE_INLINE | INODE_TAIL_PACKED)))
+        return 0;
+    if(fileBlock < DIRECT_ADDRESSES) {
+        if(inode->addr[fileBlock] == 0) {
+            inode->addr[fileBlock] = dataBlock != 0 ? dataBlock : allocateBlock(cache, 0);
+            *fresh = inode->addr[fileBlock] != 0;
+        }
+        return inode->addr[fileBlock];
+    }
+    fileBlock -= DIRECT_ADDRESSES;
+    if(fileBlock < ADDRESSES_PER_BLOCK) {
+        if(inode->addr[SINGLE_INDIRECT] == 0 && (inode->addr[SINGLE_INDIRECT] = getAZeroedBlock(cache)) == 0)
+            return 0;
+        return allocateIndirectEntry(inode->addr[SINGLE_INDIRECT], 0, fileBlock, 0, dataBlock, fresh, cache);
+    }
+    fileBlock -= ADDRESSES_PER_BLOCK;
+    if(inode->addr[DOUBLE_INDIRECT] == 0 && (inode->addr[DOUBLE_INDIRECT] = getAZeroedBlock(cache)) == 0)
+        return 0;
+    int middle = allocateIndirectEntry(inode->addr[DOUBLE_INDIRECT], 1, fileBlock / ADDRESSES_PER_BLOCK, 1, 0, fresh, cache);
+    if(middle == 0)
+        return 0;
+    return allocateIndirectEntry(middle, 2 + fileBlock / ADDRESSES_PER_BLOCK, fileBlock % ADDRESSES_PER_BLOCK, 0,
+                                 dataBlock, fresh, cache);
+}
+
+/*
+    Like bmap(), but allocates the block, and any indirect block on the way to it, if the file has none
+    there yet. *fresh is set when the data block is new, so the caller knows it holds old data.
+    Returns 0 when the disk is full or the file cannot grow further
+*/
+int bmapAllocate(Inode *inode, int fileBlock, int *fresh, blockMapCache *cache) {
+    return bmapAssign(inode, fileBlock, 0, fresh, cache);
+}
+
+/*
+    Points file block 'fileBlock' at another data block. The block map must already reach it, so no
+    indirect block gets allocated here. Returns 0 if it does not
+*/
+int bmapReplace(Inode *inode, int fileBlock, int blockNumber) {
+    unsigned short entry = blockNumber;
+    int indirect, index;
+    if(fileBlock < 0 || fileBlock >= MAX_FILE_BLOCKS || (inode->flags & (INODE_INLINE | INODE_TAIL_PACKED)))
+        return 0;
+    if(fileBlock < DIRECT_ADDRESSES) {
+        inode->addr[fileBlock] = blockNumber;
+        return 1;
+    }
+    fileBlock -= DIRECT_ADDRESSES;
+    if(fileBlock < ADDRESSES_PER_BLOCK) {
+        indirect = inode->addr[SINGLE_INDIRECT];
+        index = fileBlock;
+    }
+    else {
+        fileBlock -= ADDRESSES_PER_BLOCK;
+        indirect = indirectEntry(inode->addr[DOUBLE_INDIRECT], 1, fileBlock / ADDRESSES_PER_BLOCK, NULL);
+        index = fileBlock % ADDRESSES_PER_BLOCK;
+    }
+    if(indirect == 0)
+        return 0;
+    writeToBlockWithOffset(indirect, index * sizeof(unsigned short), &entry, sizeof(unsigned short));
+    blockMapGeneration++;
+    return 1;
+}
+
+/*
+    Tail packing. With tailPacking on, cpin puts the partial last block of a file of at most
+    DIRECT_ADDRESSES blocks into FRAGMENT_SIZE fragments of a block shared with the tails of other files:
+    addr[TAIL_BLOCK] holds the shared block, addr[TAIL_FRAGMENT] the first fragment, the length follows
+    from the size, and the file's own slot for that block stays 0. The fragment allocator keeps which
+    fragments of each shared block are in use. That map is not stored on the image: it is rebuilt from
+    the packed i-nodes the first time it is needed after a mount, and a shared block goes back to the
+    free blocks once its last fragment is freed. Used under engineLock
+*/
+static int tailLength(const Inode *inode) {
+    return inode->size - (inode->size - 1) / BLOCK_SIZE * BLOCK_SIZE;
+}
+
+static int fragmentsFor(int length) {
+    return (length + FRAGMENT_SIZE - 1) / FRAGMENT_SIZE;
+}
+
+static unsigned short fragmentMask(int first, int count) {
+    return ((1u << count) - 1) << first;
+}
+
+static fragmentBlock *addFragmentBlock(int blockNumber) {
+    if(fragmentBlockCount == fragmentBlockCapacity) {
+        int capacity = fragmentBlockCapacity ? 2 * fragmentBlockCapacity : 64;
+        fragmentBlock *grown = realloc(fragmentBlocks, capacity * sizeof(fragmentBlock));
+        if(grown == NULL)
+            return NULL;
+        fragmentBlocks = grown;
+        fragmentBlockCapacity = capacity;
+    }
+    fragmentBlocks[fragmentBlockCount].blockNumber = blockNumber;
+    fragmentBlocks[fragmentBlockCount].used = 0;
+    fragmentSlots[blockNumber] = ++fragmentBlockCount;
+    return &fragmentBlocks[fragmentBlockCount - 1];
+}
+
+// reads the packed tails of the i-list into the fragment map
+static int loadFragmentMap() {
+    int iNumber;
+    if(fragmentMapLoaded)
+        return 1;
+    if((fragmentSlots = calloc(superBlock.fsize, sizeof(int))) == NULL)
+        return 0;
+    fragmentMapLoaded = 1;
+    for (iNumber = 0; iNumber < (int)superBlock.ninodes; iNumber++) {
+        Inode inode = getAnInode(iNumber);
+        int blockNumber = inode.addr[TAIL_BLOCK], first = inode.addr[TAIL_FRAGMENT];
+        int count = fragmentsFor(tailLength(&inode));
+        if((inode.flags & (INODE_ALLOCATED | INODE_TAIL_PACKED)) != (INODE_ALLOCATED | INODE_TAIL_PACKED)
+                || blockNumber >= (int)superBlock.fsize || first + count > FRAGMENTS_PER_BLOCK)
+            continue;
+        fragmentBlock *shared = fragmentSlots[blockNumber] ? &fragmentBlocks[fragmentSlots[blockNumber] - 1] : addFragmentBlock(blockNumber);
+        if(shared != NULL)
+            shared->used |= fragmentMask(first, count);
+    }
+    return 1;
+}
+
+static void releaseFragmentMap() {
+    free(fragmentBlocks);
+    free(fragmentSlots);
+    fragmentBlocks = NULL;
+    fragmentSlots = NULL;
+    fragmentBlockCount = fragmentBlockCapacity = fragmentMapLoaded = fragmentRotor = 0;
+}
+
+/*
+    Finds 'count' free fragments in a row, in a shared block from the rotor on or else in a new one.
+    Returns the block, with the first fragment in *first, or 0 if there is no room and no free block
+*/
+static int allocateFragments(int count, int *first) {
+    int i, n;
+    if(!loadFragmentMap())
+        return 0;
+    for (i = 0; i < fragmentBlockCount; i++) {
+        fragmentBlock *shared = &fragmentBlocks[(fragmentRotor + i) % fragmentBlockCount];
+        for (n = 0; n + count <= FRAGMENTS_PER_BLOCK; n++) {
+            if(shared->used & fragmentMask(n, count))
+                continue;
+            shared->used |= fragmentMask(n, count);
+            fragmentRotor = (fragmentRotor + i) % fragmentBlockCount;
+            *first = n;
+            return shared->blockNumber;
+        }
+    }
+    int blockNumber = getAFreeBlock();
+    fragmentBlock *shared;
+    if(blockNumber == 0)
+        return 0;
+    if((shared = addFragmentBlock(blockNumber)) == NULL) {
+        addAFreeBlock(blockNumber);
+        return 0;
+    }
+    shared->used = fragmentMask(0, count);
+    fragmentRotor = fragmentBlockCount - 1;
+    *first = 0;
+    return blockNumber;
+}
+
+// frees the fragments of a packed tail, and the shared block with the last of them
+static void releaseFragments(int blockNumber, int first, int count) {
+    if(!loadFragmentMap() || blockNumber <= 0 || blockNumber >= (int)superBlock.fsize || fragmentSlots[blockNumber] == 0)
+        return;
+    int slot = fragmentSlots[blockNumber] - 1;
+    fragmentBlocks[slot].used &= ~fragmentMask(first, count);
+    if(fragmentBlocks[slot].used != 0)
+        return;
+    // the last block of the array takes the place of the empty one
+    fragmentSlots[blockNumber] = 0;
+    fragmentBlocks[slot] = fragmentBlocks[--fragmentBlockCount];
+    if(slot < fragmentBlockCount)
+        fragmentSlots[fragmentBlocks[slot].blockNumber] = slot + 1;
+    if(fragmentRotor >= fragmentBlockCount)
+        fragmentRotor = 0;
+    addAFreeBlock(blockNumber);
+}
+
+// drops the packed tail of the i-node, the caller writes it
+static void releaseTail(Inode *inode) {
+    if(!(inode->flags & INODE_TAIL_PACKED))
+        return;
+    releaseFragments(inode->addr[TAIL_BLOCK], inode->addr[TAIL_FRAGMENT], fragmentsFor(tailLength(inode)));
+    inode->flags &= ~INODE_TAIL_PACKED;
+    inode->addr[TAIL_BLOCK] = inode->addr[TAIL_FRAGMENT] = 0;
+}
+
+/*
+    Whether file block 'fileBlock' is the packed tail of the file
+*/
+static int isPackedTail(const Inode *inode, int fileBlock) {
+    return (inode->flags & INODE_TAIL_PACKED) && inode->size > 0 && fileBlock == (int)((inode->size - 1) / BLOCK_SIZE);
+}
+
+/*
+    Puts the tail of a file into fragments. The i-node must have no block for it yet and 'length' must
+    leave it smaller than a block; its size is set to cover the tail. Returns 0 if there was no room
+*/
+static int packTail(Inode *inode, unsigned int tailStart, const char *tail, int length) {
+    int first, count = fragmentsFor(length);
+    if(count >= FRAGMENTS_PER_BLOCK || tailStart / BLOCK_SIZE >= DIRECT_ADDRESSES)
+        return 0;
+    int blockNumber = allocateFragments(count, &first);
+    if(blockNumber == 0)
+        return 0;
+    writeToBlockWithOffset(blockNumber, first * FRAGMENT_SIZE, (void *)tail, length);
+    inode->flags |= INODE_TAIL_PACKED;
+    inode->addr[TAIL_BLOCK] = blockNumber;
+    inode->addr[TAIL_FRAGMENT] = first;
+    inode->size = tailStart + length;
+    return 1;
+}
+
+/*
+    Moves a packed tail back into a block of the file's own, before the file is changed. Returns 0 with
+    errno = ENOSPC, and the file unchanged, if no block is free
+*/
+static int unpackTail(int iNumber, Inode *inode) {
+    char tail[BLOCK_SIZE];
+    if(!(inode->flags & INODE_TAIL_PACKED))
+        return 1;
+    Inode packed = *inode;
+    unsigned int tailStart = (inode->size - 1) / BLOCK_SIZE * BLOCK_SIZE;
+    int length = tailLength(inode);
+    readFromBlockWithOffset(inode->addr[TAIL_BLOCK], inode->addr[TAIL_FRAGMENT] * FRAGMENT_SIZE, tail, length);
+    inode->flags &= ~INODE_TAIL_PACKED;
+    inode->addr[TAIL_BLOCK] = inode->addr[TAIL_FRAGMENT] = 0;
+    inode->size = tailStart;
+    writeTheInode(iNumber, *inode);
+    if(writeFileRange(iNumber, tail, length, tailStart, NULL) != length) {
+        *inode = packed;
+        writeTheInode(iNumber, *inode);
+        errno = ENOSPC;
+        return 0;
+    }
+    releaseFragments(packed.addr[TAIL_BLOCK], packed.addr[TAIL_FRAGMENT], fragmentsFor(length));
+    *inode = getAnInode(iNumber);
+    return 1;
+}
+
+/*
+    Compression. With compressionEnabled, cpin stores a file in clusters of CLUSTER_BLOCKS blocks. A
+    cluster that compresses into fewer blocks is stored as a clusterHeader and the compressed bytes in the
+    first of its blocks, and the rest of its blocks stay holes; any other cluster is stored as it is. A
+    compressed file (INODE_COMPRESSED) has no holes of its own, so a cluster is compressed exactly when its
+    last block is a hole. Reads decompress a whole cluster, and the last one decompressed is kept; the
+    first change to the file expands it back into plain blocks. Used under engineLock
+*/
+#ifndef V6FS_ZLIB
+static unsigned int readWord(const unsigned char *bytes) {
+    unsigned int word;
+    memcpy(&word, bytes, sizeof(word));
+    return word;
+}
+
+// the part of a length that does not fit in the token, in bytes of 255 and a last one below that
+static unsigned char *putLength(unsigned char *out, int length) {
+    for (; length >= 255; length -= 255)
+        *out++ = 255;
+    *out++ = length;
+    return out;
+}
+
+/*
+    The built-in codec: every sequence is a token with the literal count in its high and the match length
+    - 4 in its low 4 bits, the literals, and the 16 bit distance back to the match; the last sequence
+    has literals only. Matches are found with a hash table of the last position of every 4 byte word.
+    Returns the compressed length, 0 if it would not fit in 'room'
+*/
+static int lzCompress(const unsigned char *in, int length, unsigned char *out, int room) {
+    unsigned short last[1 << LZ_HASH_BITS] = {0}; // position + 1
+    unsigned char *op = out, *end = out + room;
+    int i = 0, anchor = 0, literals;
+    while(i + 4 <= length) {
+        unsigned int word = readWord(in + i);
+        unsigned int hash = word * 2654435761u >> (32 - LZ_HASH_BITS);
+        int candidate = last[hash] - 1, match = 4;
+        last[hash] = i + 1;
+        if(candidate < 0 || readWord(in + candidate) != word) {
+            i++;
+            continue;
+        }
+        while(i + match < length && in[candidate + match] == in[i + match])
+            match++;
+        literals = i - anchor;
+        if(end - op < 1 + literals / 255 + 1 + literals + 2 + (match - 4) / 255 + 1)
+            return 0;
+        *op++ = (literals < 15 ? literals : 15) << 4 | (match - 4 < 15 ? match - 4 : 15);
+        if(literals >= 15)
+            op = putLength(op, literals - 15);
+        memcpy(op, in + anchor, literals);
+        op += literals;
+        *op++ = (i - candidate) & 0xff;
+        *op++ = (i - candidate) >> 8;
+        if(match - 4 >= 15)
+            op = putLength(op, match - 4 - 15);
+        i += match;
+        anchor = i;
+    }
+    literals = length - anchor;
+    if(end - op < 1 + literals / 255 + 1 + literals)
+        return 0;
+    *op++ = (literals < 15 ? literals : 15) << 4;
+    if(literals >= 15)
+        op = putLength(op, literals - 15);
+    memcpy(op, in + anchor, literals);
+    return op + literals - out;
+}
+#endif
+
+// reads such a length back, 0 if the input ends inside it
+static int getLength(const unsigned char **in, const unsigned char *end, int *length) {
+    int extra;
+    do {
+        if(*in >= end)
+            return 0;
+        extra = *(*in)++;
+        *length += extra;
+    } while(extra == 255);
+    return 1;
+}
+
+/*
+    Returns the decompressed length, -1 if the input is damaged or decompresses to more than 'room'
+*/
+static int lzDecompress(const unsigned char *in, int length, unsigned char *out, int room) {
+    const unsigned char *end = in + length;
+    int op = 0;
+    while(in < end) {
+        int token = *in++, literals = token >> 4, match = token & 15;
+        if(literals == 15 && !getLength(&in, end, &literals))
+            return -1;
+        if(literals > end - in || literals > room - op)
+            return -1;
+        memcpy(out + op, in, literals);
+        in += literals;
+        op += literals;
+        if(in == end)
+            break;
+        if(end - in < 2)
+            return -1;
+        int distance = in[0] | in[1] << 8;
+        in += 2;
+        if(match == 15 && !getLength(&in, end, &match))
+            return -1;
+        match += 4;
+        if(distance == 0 || distance > op || match > room - op)
+            return -1;
+        // byte by byte, the match may overlap what it copies
+        for (; match > 0; match--, op++)
+            out[op] = out[op - distance];
+    }
+    return op;
+}
+
+/*
+    Compresses with zlib when the engine was built with it, with the built-in codec otherwise. Returns
+    the compressed length and the codec used, 0 if the result would not fit in 'room'
+*/
+static int compressCluster(const char *in, int length, unsigned char *out, int room, int *codec) {
+#ifdef V6FS_ZLIB
+    uLongf compressed = room;
+    *codec = CODEC_ZLIB;
+    if(compress2(out, &compressed, (const Bytef *)in, length, 1) != Z_OK)
+        return 0;
+    return compressed;
+#else
+    *codec = CODEC_LZ;
+    return lzCompress((const unsigned char *)in, length, out, room);
+#endif
+}
+
+// whether this build can decompress what the codec wrote
+static int hasCodec(int codec) {
+#ifdef V6FS_ZLIB
+    if(codec == CODEC_ZLIB)
+        return 1;
+#endif
+    return codec == CODEC_LZ;
+}
+
+static int decompressCluster(int codec, const unsigned char *in, int length, char *out, int room) {
+    if(codec == CODEC_LZ)
+        return lzDecompress(in, length, (unsigned char *)out, room);
+#ifdef V6FS_ZLIB
+    uLongf decompressed = room;
+    if(codec == CODEC_ZLIB && uncompress((Bytef *)out, &decompressed, in, length) == Z_OK)
+        return decompressed;
+#endif
+    return -1;
+}
+
+static int isCompressedCluster(const Inode *inode, int cluster, blockMapCache *cache) {
+    int lastBlock = (inode->size - 1) / BLOCK_SIZE;
+    if(cluster * CLUSTER_BLOCKS + CLUSTER_BLOCKS - 1 < lastBlock)
+        lastBlock = cluster * CLUSTER_BLOCKS + CLUSTER_BLOCKS - 1;
+    return (inode->flags & INODE_COMPRESSED) && bmap(inode, lastBlock, cache) == 0;
+}
+
+/*
+    Returns the plain bytes of a cluster of a compressed file, with their count in *length, or NULL with
+    errno = EIO if the cluster does not decompress or a block of it is damaged, EOPNOTSUPP if it was
+    written with a codec this build lacks
+*/
+static const char *loadCluster(int iNumber, const Inode *inode, int cluster, int *length, blockMapCache *cache) {
+    unsigned char packed[CLUSTER_SIZE];
+    clusterHeader header;
+    int first = cluster * CLUSTER_BLOCKS, blocks, i;
+    unsigned int start = cluster * CLUSTER_SIZE;
+    *length = inode->size - start < CLUSTER_SIZE ? inode->size - start : CLUSTER_SIZE;
+    if(clusterINumber == iNumber && clusterIndex == cluster && clusterGeneration == blockMapGeneration)
+        return clusterData;
+    clusterINumber = -1;
+    if(!isCompressedCluster(inode, cluster, cache)) {
+        for (i = 0; i * BLOCK_SIZE < *length; i++) {
+            int blockNumber = bmap(inode, first + i, cache);
+            int chunk = *length - i * BLOCK_SIZE < BLOCK_SIZE ? *length - i * BLOCK_SIZE : BLOCK_SIZE;
+            if(blockNumber != 0 && !readFromBlockWithOffset(blockNumber, 0, clusterData + i * BLOCK_SIZE, chunk))
+                return NULL;
+            else if(blockNumber == 0)
+                memset(clusterData + i * BLOCK_SIZE, 0, chunk);
+        }
+    }
+    else {
+        int blockNumber = bmap(inode, first, cache);
+        blocks = 0;
+        if(blockNumber != 0 && readFromBlockWithOffset(blockNumber, 0, &header, sizeof(header)))
+            blocks = (sizeof(header) + header.length + BLOCK_SIZE - 1) / BLOCK_SIZE;
+        if(blocks == 0 || blocks >= CLUSTER_BLOCKS) {
+            errno = EIO;
+            return NULL;
+        }
+        for (i = 0; i < blocks; i++) {
+            if((blockNumber = bmap(inode, first + i, cache)) == 0
+                    || !readFromBlockWithOffset(blockNumber, 0, packed + i * BLOCK_SIZE, BLOCK_SIZE)) {
+                errno = EIO;
+                return NULL;
+            }
+        }
+        if(!hasCodec(header.codec)) {
+            if(header.codec == CODEC_ZLIB)
+                printf("\nThe file is compressed with zlib, which this build lacks (build with -DV6FS_ZLIB -lz)\n");
+            else
+                printf("\nThe file is compressed with unknown codec %d\n", header.codec);
+            errno = EOPNOTSUPP;
+            return NULL;
+        }
+        if(decompressCluster(header.codec, packed + sizeof(header), header.length, clusterData, *length) != *length) {
+            errno = EIO;
+            return NULL;
+        }
+    }
+    clusterINumber = iNumber;
+    clusterIndex = cluster;
+    clusterGeneration = blockMapGeneration;
+    return clusterData;
+}
+
+/*
+    Turns the compressed clusters of a file into plain blocks, before the file is changed. The blocks
+    after the compressed bytes are written first, so a cluster whose expansion runs out of blocks still
+    reads as compressed. Returns 0 with errno = ENOSPC (or EIO) and the rest of the file still compressed
+*/
+static int expandCompressedFile(int iNumber, Inode *inode) {
+    int clusters = (inode->size + CLUSTER_SIZE - 1) / CLUSTER_SIZE, cluster, length, packedBlocks;
+    Inode compressed;
+    if(!(inode->flags & INODE_COMPRESSED))
+        return 1;
+    inode->flags &= ~INODE_COMPRESSED;
+    writeTheInode(iNumber, *inode);
+    for (cluster = 0; cluster < clusters; cluster++) {
+        compressed = getAnInode(iNumber);
+        compressed.flags |= INODE_COMPRESSED;
+        if(!isCompressedCluster(&compressed, cluster, NULL))
+            continue;
+        const char *plain = loadCluster(iNumber, &compressed, cluster, &length, NULL);
+        for (packedBlocks = 0; plain != NULL && bmap(&compressed, cluster * CLUSTER_BLOCKS + packedBlocks, NULL) != 0; packedBlocks++)
+            ;
+        int rest = length - packedBlocks * BLOCK_SIZE;
+        unsigned int start = cluster * CLUSTER_SIZE;
+        if(plain == NULL || writeFileRange(iNumber, plain + packedBlocks * BLOCK_SIZE, rest, start + packedBlocks * BLOCK_SIZE, NULL) != rest) {
+            if(plain != NULL)
+                errno = ENOSPC;
+            *inode = getAnInode(iNumber);
+            inode->flags |= INODE_COMPRESSED;
+            writeTheInode(iNumber, *inode);
+            return 0;
+        }
+        writeFileRange(iNumber, plain, packedBlocks * BLOCK_SIZE, start, NULL); // these blocks are already there
+    }
+    *inode = getAnInode(iNumber);
+    return 1;
+}
+
+// frees the block now, or adds it to 'freed' for the caller to free later
+static void releaseFileBlock(int blockNumber, int *freed, int *freedCount) {
+    if(freed != NULL)
+        freed[(*freedCount)++] = blockNumber;
+    else
+        addAFreeBlock(blockNumber);
+}
+
+/*
+    Frees the blocks an indirect block points at, from entry 'first' on ('first' counts file blocks, so
+    for the top of a double indirect tree it is divided among the children). Entries that are freed
+    completely are cleared in the block when it is kept
+*/
+static void freeIndirectBlocks(int blockNumber, int level, int first, int *freed, int *freedCount) {
+    unsigned short entries[ADDRESSES_PER_BLOCK];
+    int span = level == 1 ? 1 : ADDRESSES_PER_BLOCK;
+    int i, changed = 0;
+    readFromBlockWithOffset(blockNumber, 0, entries, BLOCK_SIZE);
+    for (i = first / span; i < ADDRESSES_PER_BLOCK; i++) {
+        int start = first > i * span ? first - i * span : 0;
+        if(entries[i] == 0)
+            continue;
+        if(level == 1)
+            releaseFileBlock(entries[i], freed, freedCount);
+        else {
+            freeIndirectBlocks(entries[i], 1, start, freed, freedCount);
+            if(start == 0)
+                releaseFileBlock(entries[i], freed, freedCount);
+        }
+        if(start == 0) {
+            entries[i] = 0;
+            changed = 1;
+        }
+    }
+    if(changed && first > 0)
+        writeBufferToBlock(blockNumber, entries, BLOCK_SIZE);
+}
+
+/*
+    Clears the addresses from file block 'firstFileBlock' on, and those of indirect blocks that no
+    longer map anything. The blocks are freed at once, or collected in 'freed' when it is not NULL
+*/
+static void releaseFileBlocks(Inode *inode, int firstFileBlock, int *freed, int *freedCount) {
+    int x, blocks = inodeBlockCount(inode);
+    if((inode->flags & INODE_TAIL_PACKED) && firstFileBlock < blocks)
+        releaseTail(inode);
+    if(firstFileBlock == 0)
+        inode->flags &= ~INODE_COMPRESSED; // nothing left to be compressed
+    for (x = firstFileBlock; x < blocks && x < DIRECT_ADDRESSES; x++) {
+        if(inode->addr[x] != 0)
+            releaseFileBlock(inode->addr[x], freed, freedCount);
+        inode->addr[x] = 0;
+    }
+    int first = firstFileBlock > DIRECT_ADDRESSES ? firstFileBlock - DIRECT_ADDRESSES : 0;
+    if(blocks > DIRECT_ADDRESSES && inode->addr[SINGLE_INDIRECT] != 0 && first < ADDRESSES_PER_BLOCK) {
+        freeIndirectBlocks(inode->addr[SINGLE_INDIRECT], 1, first, freed, freedCount);
+        if(first == 0) {
+            releaseFileBlock(inode->addr[SINGLE_INDIRECT], freed, freedCount);
+            inode->addr[SINGLE_INDIRECT] = 0;
+        }
+    }
+    first = first > ADDRESSES_PER_BLOCK ? first - ADDRESSES_PER_BLOCK : 0;
+    if(blocks > DIRECT_ADDRESSES + ADDRESSES_PER_BLOCK && inode->addr[DOUBLE_INDIRECT] != 0) {
+        freeIndirectBlocks(inode->addr[DOUBLE_INDIRECT], 2, first, freed, freedCount);
+        if(first == 0) {
+            releaseFileBlock(inode->addr[DOUBLE_INDIRECT], freed, freedCount);
+            inode->addr[DOUBLE_INDIRECT] = 0;
+        }
+    }
+    blockMapGeneration++;
+}
+
+/*
+    Returns the blocks from file block 'firstFileBlock' on to the free list and clears their addresses.
+    Indirect blocks that no longer map anything are freed as well
+*/
+void freeFileBlocks(Inode *inode, int firstFileBlock) {
+    releaseFileBlocks(inode, firstFileBlock, NULL, NULL);
+}
+
+/*
+    Calls visit() for every block the i-node uses: data blocks with their file block number, indirect
+    blocks with -1, and the block a packed tail shares with other files with FRAGMENT_FILE_BLOCK.
+    Indirect blocks are read with pread on 'descriptor', so the checker threads can use it on their own
+    descriptor; pointers outside the image are passed to visit() but not followed
+*/
+void walkFileBlocks(int descriptor, unsigned int fsize, const Inode *inode,
+                    void (*visit)(void *context, int fileBlock, int blockNumber), void *context) {
+    unsigned short top[ADDRESSES_PER_BLOCK], entries[ADDRESSES_PER_BLOCK];
+    int x, i, blocks = inodeBlockCount(inode);
+    for (x = 0; x < blocks && x < DIRECT_ADDRESSES; x++)
+        if(inode->addr[x] != 0)
+            visit(context, x, inode->addr[x]);
+    if(inode->flags & INODE_TAIL_PACKED) {
+        if(inode->addr[TAIL_BLOCK] != 0)
+            visit(context, FRAGMENT_FILE_BLOCK, inode->addr[TAIL_BLOCK]);
+        return;
+    }
+    if(blocks > DIRECT_ADDRESSES && inode->addr[SINGLE_INDIRECT] != 0) {
+        visit(context, -1, inode->addr[SINGLE_INDIRECT]);
+        if(inode->addr[SINGLE_INDIRECT] < fsize) {
+            pread(descriptor, entries, BLOCK_SIZE, (off_t)inode->addr[SINGLE_INDIRECT] * BLOCK_SIZE);
+            for (i = 0; i < ADDRESSES_PER_BLOCK && DIRECT_ADDRESSES + i < blocks; i++)
+                if(entries[i] != 0)
+                    visit(context, DIRECT_ADDRESSES + i, entries[i]);
+        }
+    }
+    if(blocks > DIRECT_ADDRESSES + ADDRESSES_PER_BLOCK && inode->addr[DOUBLE_INDIRECT] != 0) {
+        visit(context, -1, inode->addr[DOUBLE_INDIRECT]);
+        if(inode->addr[DOUBLE_INDIRECT] >= fsize)
+            return;
+        pread(descriptor, top, BLOCK_SIZE, (off_t)inode->addr[DOUBLE_INDIRECT] * BLOCK_SIZE);
+        for (x = 0; x < ADDRESSES_PER_BLOCK; x++) {
+            int firstBlock = DIRECT_ADDRESSES + ADDRESSES_PER_BLOCK + x * ADDRESSES_PER_BLOCK;
+            if(top[x] == 0 || firstBlock >= blocks)
+                continue;
+            visit(context, -1, top[x]);
+            if(top[x] >= fsize)
+                continue;
+            pread(descriptor, entries, BLOCK_SIZE, (off_t)top[x] * BLOCK_SIZE);
+            for (i = 0; i < ADDRESSES_PER_BLOCK && firstBlock + i < blocks; i++)
+                if(entries[i] != 0)
+                    visit(context, firstBlock + i, entries[i]);
+        }
+    }
+}
+
+/*
+    Frees the blocks and the i-node of a file or directory that is no longer linked anywhere
+*/
+void releaseInode(int iNumber) {
+    Inode inode = getAnInode(iNumber);
+    freeFileBlocks(&inode, 0);
+    inode.flags = 0;
+    writeTheInode(iNumber, inode);
+    addAFreeInode(iNumber);
+}
+
+/*
+    Deferred deletion. Removing a file that has indirect blocks only takes its name away: the i-node is
+    marked INODE_ORPHAN and put on the orphan list, which starts in the superblock and is linked through
+    the orphans' actime, and a reclaimer thread frees its blocks while the shell waits for the next
+    command. The reclaimer cuts RECLAIM_BATCH_BLOCKS blocks at a time off the end of the file and writes
+    the shorter i-node before it hands them to the allocator, so an orphan never points at a block that
+    may already belong to another file. The list is kept on disk, and reclaiming carries on where it
+    stopped when the image is mounted again, after a crash as well. The reclaimer holds engineLock for
+    one batch at a time
+*/
+static int reclaimBatch() {
+    static int freed[RECLAIM_BATCH_BLOCKS + RECLAIM_BATCH_BLOCKS / ADDRESSES_PER_BLOCK + 3];
+    int iNumber = superBlock.orphanList, freedCount = 0, i;
+    if(iNumber == 0 || fileDescriptor == -1)
+        return 0;
+    if(transactionOpen)
+        commitTransaction(); // the shorter i-node has to be on disk before its blocks are reused
+    Inode inode = getAnInode(iNumber < (int)superBlock.ninodes ? iNumber : 0);
+    if(iNumber >= (int)superBlock.ninodes || (inode.flags & (INODE_ALLOCATED | INODE_ORPHAN)) != (INODE_ALLOCATED | INODE_ORPHAN)) {
+        // released already, the image went down before the superblock was written
+        superBlock.orphanList = iNumber < (int)superBlock.ninodes && inode.actime < superBlock.ninodes ? inode.actime : 0;
+        writeSuperBlock();
+        return 1;
+    }
+    int blocks = inodeBlockCount(&inode);
+    int first = blocks > RECLAIM_BATCH_BLOCKS ? blocks - RECLAIM_BATCH_BLOCKS : 0;
+    releaseFileBlocks(&inode, first, freed, &freedCount);
+    if(first > 0)
+        inode.size = (unsigned int)first * BLOCK_SIZE;
+    else {
+        inode.flags = 0; // actime keeps the link to the next orphan until the superblock is written
+        inode.size = 0;
+    }
+    writeTheInode(iNumber, inode);
+    if(first == 0) {
+        superBlock.orphanList = inode.actime;
+        writeSuperBlock();
+    }
+    for (i = 0; i < freedCount; i++)
+        addAFreeBlock(freed[i]);
+    if(first == 0)
+        addAFreeInode(iNumber);
+    if(discardQueued)
+        punchFreedBlocks();
+    return 1;
+}
+
+/*
+    Frees everything on the orphan list in the calling thread, for when the space is needed now.
+    Returns 1 if the list was not empty
+*/
+int reclaimOrphans() {
+    int reclaimed = 0;
+    pthread_mutex_lock(&engineLock);
+    while(reclaimBatch())
+        reclaimed = 1;
+    pthread_mutex_unlock(&engineLock);
+    return reclaimed;
+}
+
+static void * reclaimWorker(void *unused) {
+    pthread_mutex_lock(&engineLock);
+    while(1) {
+        if(!reclaimBatch()) {
+            pthread_cond_wait(&reclaimWork, &engineLock);
+            continue;
+        }
+        // a command that is waiting gets in between two batches
+        pthread_mutex_unlock(&engineLock);
+        sched_yield();
+        pthread_mutex_lock(&engineLock);
+    }
+    return NULL;
+}
+
+/*
+    Wakes the reclaimer up, starting it the first time. Without a thread the orphans are freed right away
+*/
+void startReclaimer() {
+    pthread_mutex_lock(&engineLock);
+    if(!reclaimerStarted) {
+        pthread_t worker;
+        if(pthread_create(&worker, NULL, reclaimWorker, NULL) != 0) {
+            pthread_mutex_unlock(&engineLock);
+            reclaimOrphans();
+            return;
+        }
+        pthread_detach(worker);
+        reclaimerStarted = 1;
+    }
+    pthread_cond_signal(&reclaimWork);
+    pthread_mutex_unlock(&engineLock);
+}
+
+/*
+    Frees a file or directory whose last name was removed. Small ones are freed on the spot; one with
+    indirect blocks goes on the orphan list for the reclaimer. While a trace is recorded it is freed
+    right away as well, because a replay compares each command's block I/O with its own
+*/
+void unlinkInode(int iNumber) {
+    Inode inode = getAnInode(iNumber);
+    if(inodeBlockCount(&inode) <= DIRECT_ADDRESSES) {
+        releaseInode(iNumber);
+        return;
+    }
+    inode.flags |= INODE_ORPHAN;
+    inode.actime = superBlock.orphanList;
+    writeTheInode(iNumber, inode);
+    superBlock.orphanList = iNumber;
+    writeSuperBlock();
+    if(traceCapturing)
+        reclaimOrphans();
+    else
+        startReclaimer();
+}
+
+/*
+    Gives the file a copy of its own of file block 'fileBlock' (block 'blockNumber') if other files
+    share that block, before it is written. Returns the block to write, 0 with errno = ENOSPC if no
+    block was free. The caller writes the i-node
+*/
+static int unshareFileBlock(Inode *inode, int fileBlock, int blockNumber) {
+    char data[BLOCK_SIZE];
+    if(!isSharedBlock(blockNumber))
+        return blockNumber;
+    int copy = getAFreeBlock();
+    if(copy == 0) {
+        errno = ENOSPC;
+        return 0;
+    }
+    readFromBlockWithOffset(blockNumber, 0, data, BLOCK_SIZE);
+    writeBufferToBlock(copy, data, BLOCK_SIZE);
+    bmapReplace(inode, fileBlock, copy);
+    blockShares[blockNumber]--;
+    return copy;
+}
+
+/*
+    Copies up to 'length' bytes from byte 'offset' of the file into the buffer. Holes read as zeros.
+    The cache (may be NULL) keeps the file's indirect blocks, so once it is warm every block of the range
+    costs one read. Returns the number of bytes copied, which is short only at the end of the file, or
+    with errno = EIO where a compressed cluster does not decompress or a block fails its checksum
+*/
+int readFileRange(int iNumber, void *buffer, int length, unsigned int offset, blockMapCache *cache) {
+    // appends still buffered in the cache are written first, so the read sees them
+    if(cache != NULL)
+        flushDelayedWrite(cache);
+    Inode inode = getAnInode(iNumber);
+    int copied = 0;
+    if(offset >= inode.size)
+        return 0;
+    if(length > inode.size - offset)
+        length = inode.size - offset;
+    if(inode.flags & INODE_INLINE) {
+        memcpy(buffer, (char *)inode.addr + offset, length);
+        return length;
+    }
+    while((inode.flags & INODE_COMPRESSED) && copied < length) {
+        int available, clusterOffset = (offset + copied) % CLUSTER_SIZE;
+        const char *plain = loadCluster(iNumber, &inode, (offset + copied) / CLUSTER_SIZE, &available, cache);
+        if(plain == NULL)
+            break;
+        int chunk = available - clusterOffset < length - copied ? available - clusterOffset : length - copied;
+        memcpy((char *)buffer + copied, plain + clusterOffset, chunk);
+        copied += chunk;
+    }
+    if(inode.flags & INODE_COMPRESSED)
+        return copied;
+    if(cache != NULL && length > 0)
+        scheduleReadahead(&inode, offset / BLOCK_SIZE, (offset + length - 1) / BLOCK_SIZE, cache);
+    while(copied < length) {
+        int blockOffset = (offset + copied) % BLOCK_SIZE;
+        int chunk = BLOCK_SIZE - blockOffset < length - copied ? BLOCK_SIZE - blockOffset : length - copied;
+        int blockNumber = bmap(&inode, (offset + copied) / BLOCK_SIZE, cache);
+        if(isPackedTail(&inode, (offset + copied) / BLOCK_SIZE)) {
+            if(!readFromBlockWithOffset(inode.addr[TAIL_BLOCK], inode.addr[TAIL_FRAGMENT] * FRAGMENT_SIZE + blockOffset,
+                                        (char *)buffer + copied, chunk))
+                return copied;
+            copied += chunk;
+            continue;
+        }
+        if(blockNumber == 0) {
+            memset((char *)buffer + copied, 0, chunk);
+            copied += chunk;
+            continue;
+        }
+        if(readFromReadahead(blockNumber, blockOffset, (char *)buffer + copied, chunk)) {
+            copied += chunk;
+            continue;
+        }
+        // blocks that follow each other on disk are read with one call. Only with a cache, where looking
+        // ahead is free, and outside transactions, where the cache may hold newer copies of single blocks.
+        // The run stops at a block the readahead worker has already fetched
+        while(cache != NULL && !transactionOpen && copied + chunk < length) {
+            int next = blockNumber + (blockOffset + chunk) / BLOCK_SIZE;
+            if(bmap(&inode, (offset + copied + chunk) / BLOCK_SIZE, cache) != next
+                    || (readaheadStarted && readaheadCache[(unsigned int)next % READAHEAD_CACHE_BLOCKS].blockNumber == next))
+                break;
+            chunk += length - copied - chunk < BLOCK_SIZE ? length - copied - chunk : BLOCK_SIZE;
+        }
+        if(!readFromBlockWithOffset(blockNumber, blockOffset, (char *)buffer + copied, chunk))
+            return copied;
+        copied += chunk;
+    }
+    return copied;
+}
+
+/*
+    Inline data. A file of up to INLINE_DATA_BYTES keeps its data in addr[] instead of a block
+    (INODE_INLINE), so writing or reading it needs no block allocation and no I/O besides its i-list
+    block. It gets ordinary blocks the first time it grows past that
+*/
+static int fitsInline(const Inode *inode, unsigned int end) {
+    return !(inode->flags & INODE_DIRECTORY) && end <= INLINE_DATA_BYTES && ((inode->flags & INODE_INLINE) || inode->size == 0);
+}
+
+/*
+    Moves inline data into a block of its own. Returns 0 with errno = ENOSPC, and the file unchanged, if
+    no block is free
+*/
+static int spillInlineData(int iNumber, Inode *inode) {
+    char data[INLINE_DATA_BYTES];
+    unsigned int size = inode->size;
+    if(!(inode->flags & INODE_INLINE))
+        return 1;
+    memcpy(data, inode->addr, INLINE_DATA_BYTES);
+    inode->flags &= ~INODE_INLINE;
+    memset(inode->addr, 0, sizeof(inode->addr));
+    writeTheInode(iNumber, *inode);
+    if(size > 0 && writeFileRange(iNumber, data, size, 0, NULL) != (int)size) {
+        inode->flags |= INODE_INLINE;
+        memcpy(inode->addr, data, INLINE_DATA_BYTES);
+        inode->size = size;
+        writeTheInode(iNumber, *inode);
+        errno = ENOSPC;
+        return 0;
+    }
+    *inode = getAnInode(iNumber);
+    return 1;
+}
+
+/*
+    Delayed allocation. Appends made through a block-map cache are collected in the cache, and blocks
+    are only allocated when it is flushed: by then the length of the new data is known, so it gets one
+    run of consecutive blocks, written with one call. Takes what fits into the buffer of an append that
+    continues the buffered data or starts at a block boundary at or past the end of the file (past it
+    leaves a hole). Returns 0 for any other write
+*/
+static int delayAppend(int iNumber, const void *buffer, int length, unsigned int offset, blockMapCache *cache) {
+    if(cache->delayedLength > 0) {
+        if(cache->delayedINumber != iNumber || offset != cache->delayedOffset + cache->delayedLength)
+            return 0;
+    }
+    else {
+        if(offset % BLOCK_SIZE != 0 || offset >= MAX_FILE_SIZE || offset < getAnInode(iNumber).size)
+            return 0;
+        if(cache->delayedData == NULL && (cache->delayedData = malloc(DELAYED_ALLOCATION_BLOCKS * BLOCK_SIZE)) == NULL)
+            return 0;
+        cache->delayedINumber = iNumber;
+        cache->delayedOffset = offset;
+    }
+    unsigned int room = DELAYED_ALLOCATION_BLOCKS * BLOCK_SIZE - cache->delayedLength;
+    if(room > MAX_FILE_SIZE - offset)
+        room = MAX_FILE_SIZE - offset;
+    int taken = (unsigned int)length < room ? length : (int)room;
+    memcpy(cache->delayedData + cache->delayedLength, buffer, taken);
+    cache->delayedLength += taken;
+    return taken;
+}
+
+/*
+    Allocates blocks for the appends buffered in the cache and writes them. Returns 0 with errno = ENOSPC
+    if the disk filled up; the file then ends with the data that did fit. The buffer is empty afterwards
+*/
+int flushDelayedWrite(blockMapCache *cache) {
+    int blocks[DELAYED_ALLOCATION_BLOCKS];
+    int count = (cache->delayedLength + BLOCK_SIZE - 1) / BLOCK_SIZE;
+    int firstBlock = cache->delayedOffset / BLOCK_SIZE;
+    int got, mapped, i, run, fresh, ownTransaction = !transactionOpen;
+    if(cache->delayedLength == 0)
+        return 1;
+    Inode inode = getAnInode(cache->delayedINumber);
+    allocationGroup = inodeGroup(cache->delayedINumber);
+    if(!spillInlineData(cache->delayedINumber, &inode) || !unpackTail(cache->delayedINumber, &inode)
+            || !expandCompressedFile(cache->delayedINumber, &inode)) {
+        cache->delayedLength = 0;
+        return 0;
+    }
+    memset(cache->delayedData + cache->delayedLength, 0, count * BLOCK_SIZE - cache->delayedLength);
+    // the indirect entries of the whole run go out as one write per indirect block
+    if(ownTransaction)
+        beginTransaction();
+    for (got = 0; got < count && cache->reservedNext < cache->reservedCount; got++)
+        blocks[got] = cache->reservedBlocks[cache->reservedNext++];
+    got += getFreeBlocks(blocks + got, count - got);
+    for (mapped = 0; mapped < got; mapped++) {
+        int blockNumber = bmapAssign(&inode, firstBlock + mapped, blocks[mapped], &fresh, cache);
+        if(blockNumber == 0)
+            break;
+        if(blockNumber != blocks[mapped] && isSharedBlock(blockNumber)) {
+            // written whole, so the file's own block needs nothing of the shared one
+            bmapReplace(&inode, firstBlock + mapped, blocks[mapped]);
+            dropBlockShare(blockNumber);
+        }
+        else if(blockNumber != blocks[mapped]) {
+            addAFreeBlock(blocks[mapped]);
+            blocks[mapped] = blockNumber;
+        }
+    }
+    for (i = mapped; i < got; i++)
+        addAFreeBlock(blocks[i]);
+    for (i = 0; i < mapped; i += run) {
+        for (run = 1; i + run < mapped && blocks[i + run] == blocks[i] + run; run++)
+            ;
+        writeToBlockWithOffset(blocks[i], 0, cache->delayedData + i * BLOCK_SIZE, run * BLOCK_SIZE);
+    }
+    unsigned int end = cache->delayedOffset + (mapped == count ? cache->delayedLength : mapped * BLOCK_SIZE);
+    if(end > inode.size)
+        inode.size = end;
+    inode.modtime = time(NULL);
+    writeTheInode(cache->delayedINumber, inode);
+    if(ownTransaction)
+        commitTransaction();
+    cache->delayedLength = 0;
+    if(mapped < count) {
+        errno = ENOSPC;
+        return 0;
+    }
+    return 1;
+}
+
+/*
+    The last flush of a file written from start to end (cpin). With tailPacking on, the partial last
+    block of a file of at most DIRECT_ADDRESSES blocks goes into fragments instead of a block of its own
+*/
+static int flushPackingTail(blockMapCache *cache) {
+    unsigned int end = cache->delayedOffset + cache->delayedLength;
+    int length = end % BLOCK_SIZE;
+    char tail[BLOCK_SIZE];
+    if(!tailPacking || length == 0 || cache->delayedLength < (unsigned int)length || end <= INLINE_DATA_BYTES
+            || end > DIRECT_ADDRESSES * BLOCK_SIZE || fragmentsFor(length) >= FRAGMENTS_PER_BLOCK)
+        return flushDelayedWrite(cache);
+    cache->delayedLength -= length;
+    memcpy(tail, cache->delayedData + cache->delayedLength, length);
+    if(!flushDelayedWrite(cache))
+        return 0;
+    Inode inode = getAnInode(cache->delayedINumber);
+    if(packTail(&inode, end - length, tail, length)) {
+        writeTheInode(cache->delayedINumber, inode);
+        return 1;
+    }
+    // no fragments to be had, the tail gets a block after all
+    if(writeFileRange(cache->delayedINumber, tail, length, end - length, NULL) != length) {
+        errno = ENOSPC;
+        return 0;
+    }
+    return 1;
+}
+
+/*
+    Writes 'length' bytes at byte 'offset' of the file, allocating blocks as needed and growing the file.
+    A newly allocated block is written whole, with zeros around the data, so it never exposes old contents.
+    With a cache, appends are buffered there until flushDelayedWrite() (see delayAppend()).
+    An empty or inline file that still fits stays inline (see fitsInline()).
+    Returns the number of bytes written, short when the disk ran out or the file reached MAX_FILE_SIZE
+*/
+int writeFileRange(int iNumber, const void *buffer, int length, unsigned int offset, blockMapCache *cache) {
+    char padded[BLOCK_SIZE];
+    int written = 0, fresh;
+    Inode current = getAnInode(iNumber);
+    if(fitsInline(&current, offset + length) && (cache == NULL || cache->delayedLength == 0)) {
+        if(!(current.flags & INODE_INLINE)) {
+            current.flags |= INODE_INLINE;
+            memset(current.addr, 0, sizeof(current.addr));
+        }
+        memcpy((char *)current.addr + offset, buffer, length);
+        if(offset + length > current.size)
+            current.size = offset + length;
+        current.modtime = time(NULL);
+        writeTheInode(iNumber, current);
+        return length;
+    }
+    if(!spillInlineData(iNumber, &current) || !unpackTail(iNumber, &current) || !expandCompressedFile(iNumber, &current))
+        return 0;
+    while(cache != NULL && written < length) {
+        written += delayAppend(iNumber, (const char *)buffer + written, length - written, offset + written, cache);
+        if(written == length)
+            return length;
+        // the buffer is full, or this is not an append to it
+        if(cache->delayedLength == 0)
+            break;
+        if(!flushDelayedWrite(cache))
+            return written;
+    }
+    Inode inode = getAnInode(iNumber);
+    allocationGroup = inodeGroup(iNumber);
+    while(written < length) {
+        int blockOffset = (offset + written) % BLOCK_SIZE;
+        int chunk = BLOCK_SIZE - blockOffset < length - written ? BLOCK_SIZE - blockOffset : length - written;
+        int blockNumber = bmapAllocate(&inode, (offset + written) / BLOCK_SIZE, &fresh, cache);
+        if(blockNumber != 0 && !fresh)
+            blockNumber = unshareFileBlock(&inode, (offset + written) / BLOCK_SIZE, blockNumber);
+        if(blockNumber == 0)
+            break;
+        if(fresh && chunk < BLOCK_SIZE) {
+            memset(padded, 0, BLOCK_SIZE);
+            memcpy(padded + blockOffset, (const char *)buffer + written, chunk);
+            writeBufferToBlock(blockNumber, padded, BLOCK_SIZE);
+        }
+        else
+            writeToBlockWithOffset(blockNumber, blockOffset, (char *)buffer + written, chunk);
+        written += chunk;
+    }
+    if(offset + written > inode.size)
+        inode.size = offset + written;
+    inode.modtime = time(NULL);
+    writeTheInode(iNumber, inode);
+    return written;
+}
+
+/*
+    Sets the file size. Shrinking frees the blocks past the new end and zeroes the rest of the last block,
+    growing leaves a hole; inline data past the new end is zeroed. Returns 0 with errno = EFBIG if the
+    size is beyond MAX_FILE_SIZE, or ENOSPC if inline data, a packed tail, compressed clusters or a last
+    block shared with other files found no blocks to move to
+*/
+int truncateFile(int iNumber, unsigned int size) {
+    Inode inode = getAnInode(iNumber);
+    char zeros[BLOCK_SIZE] = {0};
+    if(size > MAX_FILE_SIZE) {
+        errno = EFBIG;
+        return 0;
+    }
+    if((inode.flags & INODE_INLINE) && size > INLINE_DATA_BYTES && !spillInlineData(iNumber, &inode))
+        return 0;
+    // a tail cut off whole is freed with the blocks below
+    if(size > (inode.size - 1) / BLOCK_SIZE * BLOCK_SIZE && !unpackTail(iNumber, &inode))
+        return 0;
+    if(size > 0 && !expandCompressedFile(iNumber, &inode))
+        return 0;
+    if(inode.flags & INODE_INLINE) {
+        if(size < inode.size)
+            memset((char *)inode.addr + size, 0, INLINE_DATA_BYTES - size);
+    }
+    else if(size < inode.size) {
+        int blockNumber = bmap(&inode, size / BLOCK_SIZE, NULL);
+        // the new last block gets zeroed past the end, in a copy of its own if other files share it
+        if(size % BLOCK_SIZE != 0 && blockNumber != 0 && (blockNumber = unshareFileBlock(&inode, size / BLOCK_SIZE, blockNumber)) == 0)
+            return 0;
+        freeFileBlocks(&inode, (size + BLOCK_SIZE - 1) / BLOCK_SIZE);
+        if(size % BLOCK_SIZE != 0 && blockNumber != 0)
+            writeToBlockWithOffset(blockNumber, size % BLOCK_SIZE, zeros, BLOCK_SIZE - size % BLOCK_SIZE);
+    }
+    inode.size = size;
+    inode.modtime = time(NULL);
+    writeTheInode(iNumber, inode);
+    return 1;
+}
+
+/*
+    Returns the i-number of the entry 'name' in the directory, -1 if there is none
+*/
+int findDirectoryEntry(int directoryINumber, const char *name) {
+    Inode directoryInode = getAnInode(directoryINumber);
+    directoryEntry directory[BLOCK_SIZE / sizeof(directoryEntry)];
+    int i;
+    readDirectoryEntries(&directoryInode, directory);
+    for (i = 0; i < directoryInode.size / sizeof(directoryEntry); i++)
+        if(strncmp(directory[i].fileName, name, sizeof(directory[i].fileName)) == 0)
+            return directory[i].inode;
+    return -1;
+}
+
+/*
+    Appends an entry to the directory. A directory is a single block, so it holds at most 64 entries.
+    Returns 0 with errno = ENOSPC if it is full
+*/
+int addDirectoryEntry(int directoryINumber, const char *name, int iNumber) {
+    Inode directoryInode = getAnInode(directoryINumber);
+    directoryEntry newEntry;
+    if(directoryInode.size + sizeof(directoryEntry) > BLOCK_SIZE) {
+        errno = ENOSPC;
+        return 0;
+    }
+    memset(&newEntry, 0, sizeof(newEntry));
+    newEntry.inode = iNumber;
+    strncpy(newEntry.fileName, name, sizeof(newEntry.fileName) - 1);
+    writeToBlockWithOffset(directoryInode.addr[0], directoryInode.size, &newEntry, sizeof(directoryEntry));
+    directoryInode.size += sizeof(directoryEntry);
+    writeTheInode(directoryINumber, directoryInode);
+    return 1;
+}
+
+/*
+    Removes the entry 'name' from the directory, moving the last entry into its place.
+    Returns 0 if there is no such entry
+*/
+int removeDirectoryEntry(int directoryINumber, const char *name) {
+    Inode directoryInode = getAnInode(directoryINumber);
+    directoryEntry directory[BLOCK_SIZE / sizeof(directoryEntry)];
+    int i, count = directoryInode.size / sizeof(directoryEntry);
+    readDirectoryEntries(&directoryInode, directory);
+    for (i = 0; i < count; i++) {
+        if(strncmp(directory[i].fileName, name, sizeof(directory[i].fileName)) == 0) {
+            directory[i] = directory[count - 1];
+            directoryInode.size -= sizeof(directoryEntry);
+            writeToBlockWithOffset(directoryInode.addr[0], i * sizeof(directoryEntry), &directory[i], sizeof(directoryEntry));
+            writeTheInode(directoryINumber, directoryInode);
+            return 1;
+        }
+    }
+    return 0;
+}
+
+/*
+    Creates an empty file or directory i-node ('flags' = INODE_ALLOCATED, plus INODE_DIRECTORY for a
+    directory) and links it into the directory as 'name'. Returns its i-number, or 0 with errno set
+*/
+int createFileIn(int directoryINumber, const char *name, int flags) {
+    Inode inode;
+    int iNumber, blockNumber = 0;
+    if(name == NULL || *name == 0 || strchr(name, '/') != NULL) {
+        errno = EINVAL;
+        return 0;
+    }
+    if(strlen(name) >= sizeof(((directoryEntry *)0)->fileName)) {
+        errno = ENAMETOOLONG;
+        return 0;
+    }
+    if(findDirectoryEntry(directoryINumber, name) != -1) {
+        errno = EEXIST;
+        return 0;
+    }
+    // files go to their directory's group, directories are spread out
+    allocationGroup = (flags & INODE_DIRECTORY) ? directoryGroup(directoryINumber) : inodeGroup(directoryINumber);
+    if((iNumber = getAFreeInode()) == 0) {
+        errno = ENOSPC;
+        return 0;
+    }
+    allocationGroup = inodeGroup(iNumber);
+
+    memset(&inode, 0, sizeof(inode));
+    inode.flags = flags;
+    inode.nlinks = 1;
+    inode.actime = time(NULL);
+    inode.modtime = time(NULL);
+    if(flags & INODE_DIRECTORY) {
+        directoryEntry directory[2];
+        memset(directory, 0, sizeof(directory));
+        if((blockNumber = getAFreeBlock()) == 0) {
+            addAFreeInode(iNumber);
+            errno = ENOSPC;
+            return 0;
+        }
+        directory[0].inode = iNumber;
+        strcpy(directory[0].fileName,".");
+        directory[1].inode = directoryINumber;
+        strcpy(directory[1].fileName,"..");
+        writeBufferToBlock(blockNumber, directory, 2*sizeof(directoryEntry));
+        inode.size = 2*sizeof(directoryEntry);
+        inode.addr[0] = blockNumber;
+    }
+    writeTheInode(iNumber, inode);
+    if(!addDirectoryEntry(directoryINumber, name, iNumber)) {
+        releaseInode(iNumber);
+        errno = ENOSPC;
+        return 0;
+    }
+    return iNumber;
+}
+
+/*
+    Resolves a path to an i-number. Absolute paths start at the root (of the mounted snapshot, if one is),
+    others at the current directory.
+    Returns -1 with errno = ENOENT if a component does not exist, ENOTDIR if a file is used as a directory
+*/
+int lookupPath(const char *path) {
+    char component[BLOCK_SIZE];
+    int iNumber = path[0] == '/' ? mountedSnapshot : currentINodeNumber;
+    while(*path) {
+        size_t length;
+        while(*path == '/')
+            path++;
+        if(*path == 0)
+            break;
+        length = strcspn(path, "/");
+        if(length >= sizeof(component)) {
+            errno = ENAMETOOLONG;
+            return -1;
+        }
+        memcpy(component, path, length);
+        component[length] = 0;
+        path += length;
+        Inode directoryInode = getAnInode(iNumber);
+        if(!(directoryInode.flags & INODE_DIRECTORY)) {
+            errno = ENOTDIR;
+            return -1;
         }
-        superBlock.ninode--;
-        return superBlock.inode[superBlock.ninode];
+        if((iNumber = findDirectoryEntry(iNumber, component)) == -1) {
+            errno = ENOENT;
+            return -1;
+        }
+    }
+    return iNumber;
 }
 
 /*
-    Writes the data of the inode structure into the inode in the filesystem, specified
-    by the i-number
+    Resolves everything but the last component of the path and copies that component into 'name'
+    (at least 14 bytes). Returns the directory's i-number, or -1 with errno set
 */
-void writeTheInode(int iNumber, Inode inode) {
-    int blockNumber = (iNumber * INODE_SIZE )/ BLOCK_SIZE;
-    int offset = (iNumber * INODE_SIZE) % BLOCK_SIZE;
-    writeToBlockWithOffset(blockNumber, offset, &inode, sizeof(Inode));
+int lookupParent(const char *path, char *name) {
+    char parent[512];
+    const char *end = path + strlen(path);
+    while(end > path && end[-1] == '/')
+        end--;
+    const char *last = end;
+    while(last > path && last[-1] != '/')
+        last--;
+    if(end - last == 0) {
+        errno = EINVAL;
+        return -1;
+    }
+    if(end - last >= sizeof(((directoryEntry *)0)->fileName) || last - path >= sizeof(parent)) {
+        errno = ENAMETOOLONG;
+        return -1;
+    }
+    memcpy(name, last, end - last);
+    name[end - last] = 0;
+    memcpy(parent, path, last - path);
+    parent[last - path] = 0;
+    int iNumber = last == path ? currentINodeNumber : lookupPath(parent);
+    if(iNumber != -1 && !(getAnInode(iNumber).flags & INODE_DIRECTORY)) {
+        errno = ENOTDIR;
+        return -1;
+    }
+    return iNumber;
 }
 
 /*
@@ -217,16 +3257,16 @@ void initializeRootDirectory() {
     Lists the contents of the current directory, by reading the i-node that represents 
     the current directory
 */
-void ls() {                                                              
+int ls() {                                                              
     // list directory contents
     Inode currentINode = getAnInode(currentINodeNumber);
-    int blockNumber = currentINode.addr[0];
     directoryEntry directory[100];
     int i;
-    readFromBlockWithOffset(blockNumber, 0, directory, currentINode.size);
+    readDirectoryEntries(&currentINode, directory);
     for(i = 0; i < currentINode.size/sizeof(directoryEntry); i++) {
         printf("%s\n",directory[i].fileName);
     }
+    return 1;
 }
 
 /*
@@ -236,41 +3276,16 @@ void ls() {
     block into the inode, sets the current and parent directory values as the first two entries,
     and writes the inode numbers into the memory address
 */
-void makeDirectory (char* dirName) {
-    int blockNumber = getAFreeBlock(); // block to store directory table
-    int iNumber = getAFreeInode(); // inode numbr for directory
-    directoryEntry directory[2];
-    directory[0].inode = iNumber;
-    strcpy(directory[0].fileName,".");
-    printf("%s",directory[0].fileName);
-
-    directory[1].inode = currentINodeNumber;
-    strcpy(directory[1].fileName,"..");
-    printf("%s",directory[1].fileName);
-
-    writeBufferToBlock(blockNumber, directory, 2*sizeof(directoryEntry));
-    // write directory i node
-    Inode dir;
-    dir.flags = 1<<14 | 1<<15; // setting 14th and 15th bit to 1, 15: allocated and 14: directory
-    dir.nlinks = 1;
-    dir.uid = 0;
-    dir.gid = 0;
-    dir.size = 2*sizeof(directoryEntry);
-    dir.addr[0] = blockNumber;
-    dir.actime = time(NULL);
-    dir.modtime = time(NULL);
-
-    writeTheInode(iNumber,dir);
-
-    Inode currentINode = getAnInode(currentINodeNumber);
-    blockNumber = currentINode.addr[0];
-    directoryEntry newDir;
-    newDir.inode = iNumber ;
-    strcpy(newDir.fileName,dirName);
-    int i;
-    writeToBlockWithOffset(blockNumber,currentINode.size,&newDir,sizeof(directoryEntry));
-    currentINode.size += sizeof(directoryEntry);
-    writeTheInode(currentINodeNumber,currentINode);
+int makeDirectory (char* dirName) {
+    if(dirName == NULL) {
+        printf("use: mkdir <directory>\n");
+        return 0;
+    }
+    if(createFileIn(currentINodeNumber, dirName, INODE_ALLOCATED | INODE_DIRECTORY) == 0) {
+        printf("\nError while creating %s [%s]\n", dirName, strerror(errno));
+        return 0;
+    }
+    return 1;
 }
 
 /*
@@ -306,18 +3321,17 @@ void sliceString(const char * str, char * buffer, size_t startPosition, size_t e
     cd directoryName -> checks if the directory named 'directoryName' exists, 
     if so, moves into that directory
 */
-void changeDirectory(char* directoryName) {
+int changeDirectory(char* directoryName) {
     Inode currentINode = getAnInode(currentINodeNumber);
-    int blockNumber = currentINode.addr[0];
     directoryEntry directory[100];
     int i;
-    readFromBlockWithOffset(blockNumber,0,directory,currentINode.size);
+    readDirectoryEntries(&currentINode, directory);
     for(i = 0; i < currentINode.size/sizeof(directoryEntry); i++) {
         if(strcmp(directoryName,directory[i].fileName)==0) {
             Inode dir = getAnInode(directory[i].inode);
             if(dir.flags ==( 1<<14 | 1<<15)) {
                 if (strcmp(directoryName, ".") == 0) {
-                        return;
+                        return 1;
                 }
                 else if (strcmp(directoryName, "..") == 0) {
                     currentINodeNumber=directory[i].inode;
@@ -331,178 +3345,1207 @@ void changeDirectory(char* directoryName) {
                     strcat(currentWorkingDirectory, "/");
                     strcat(currentWorkingDirectory, directoryName);
                 } 
+                return 1;
             }
             else {
                 printf("\n%s\n","NOT A DIRECTORY!");
             }
-            return;
+            return 0;
+        }
+    }
+    printf("\n%s\n","NO SUCH DIRECTORY!");
+    return 0;
+}
+
+/*
+    Copies the data regions of a sparse host file. SEEK_DATA and SEEK_HOLE find them, widened to whole
+    blocks, and the blocks in between are left unallocated: they read as zeros. Returns 0 if a region did
+    not fit, -1 if the host filesystem cannot report holes (nothing was copied then)
+*/
+static int copyDataRegions(int source, off_t size, int iNumber, blockMapCache *cache) {
+    static char buffer[COPY_CHUNK];
+    off_t data = 0, hole, next;
+    while(data < size) {
+        COUNT_STAT(syscalls, 2);
+        if((next = lseek(source, data, SEEK_DATA)) == -1)
+            return errno == ENXIO ? 1 : (data == 0 ? -1 : 0); // ENXIO: only a hole is left
+        data = next;
+        if((hole = lseek(source, data, SEEK_HOLE)) == -1)
+            return 0;
+        data -= data % BLOCK_SIZE;
+        if(hole % BLOCK_SIZE != 0)
+            hole += BLOCK_SIZE - hole % BLOCK_SIZE;
+        if(hole > size)
+            hole = size;
+        while(data < hole) {
+            int length = hole - data < COPY_CHUNK ? hole - data : COPY_CHUNK;
+            COUNT_STAT(syscalls, 1);
+            if((length = pread(source, buffer, length, data)) <= 0)
+                return 0;
+            if(writeFileRange(iNumber, buffer, length, data, cache) != length)
+                return 0;
+            data += length;
+        }
+    }
+    return 1;
+}
+
+/*
+    Copies the source in clusters of CLUSTER_SIZE, each compressed if that saves at least a block, and
+    marks the file compressed if any was. Returns 0 if the file did not fit
+*/
+static int copyCompressed(int source, int iNumber, blockMapCache *cache) {
+    static char plain[CLUSTER_SIZE];
+    static unsigned char packed[CLUSTER_SIZE];
+    unsigned int offset = 0;
+    int length, got = 0, anyCompressed = 0;
+    do {
+        for (length = 0; length < CLUSTER_SIZE && (got = read(source, plain + length, CLUSTER_SIZE - length)) > 0; length += got)
+            COUNT_STAT(syscalls, 1);
+        int blocks = (length + BLOCK_SIZE - 1) / BLOCK_SIZE, codec, packedLength = 0;
+        if(blocks > 1)
+            packedLength = compressCluster(plain, length, packed + sizeof(clusterHeader),
+                                           (blocks - 1) * BLOCK_SIZE - sizeof(clusterHeader), &codec);
+        if(packedLength > 0) {
+            clusterHeader header = {packedLength, codec, 0};
+            int stored = (sizeof(header) + packedLength + BLOCK_SIZE - 1) / BLOCK_SIZE * BLOCK_SIZE;
+            memcpy(packed, &header, sizeof(header));
+            memset(packed + sizeof(header) + packedLength, 0, stored - sizeof(header) - packedLength);
+            if(writeFileRange(iNumber, packed, stored, offset, cache) != stored)
+                return 0;
+            anyCompressed = 1;
+        }
+        else if(length > 0 && writeFileRange(iNumber, plain, length, offset, cache) != length)
+            return 0;
+        offset += length;
+    } while(length == CLUSTER_SIZE);
+    if(got < 0 || !flushDelayedWrite(cache))
+        return 0;
+    // the last compressed cluster left the size short of the end
+    Inode inode = getAnInode(iNumber);
+    inode.size = offset;
+    if(anyCompressed)
+        inode.flags |= INODE_COMPRESSED;
+    writeTheInode(iNumber, inode);
+    return 1;
+}
+
+/*
+    Hash of a block's contents for the dedup index: four independent lanes of multiply and rotate over
+    the 64-bit words, which the compiler can keep in flight side by side, folded to 32 bits at the end
+*/
+static unsigned int hashBlock(const void *data) {
+    unsigned long long lanes[4] = {0x9e3779b97f4a7c15ULL, 0xc2b2ae3d27d4eb4fULL, 0x165667b19e3779f9ULL, 0x27d4eb2f165667c5ULL};
+    unsigned long long word, hash = 0;
+    int i, lane;
+    for (i = 0; i < BLOCK_SIZE; i += 4 * sizeof(word)) {
+        for (lane = 0; lane < 4; lane++) {
+            memcpy(&word, (const char *)data + i + lane * sizeof(word), sizeof(word));
+            lanes[lane] += word * 0xc2b2ae3d27d4eb4fULL;
+            lanes[lane] = (lanes[lane] << 31 | lanes[lane] >> 33) * 0x9e3779b97f4a7c15ULL;
+        }
+    }
+    for (lane = 0; lane < 4; lane++)
+        hash = (hash ^ lanes[lane]) * 0xff51afd7ed558ccdULL;
+    hash ^= hash >> 33;
+    return (unsigned int)(hash ^ hash >> 32);
+}
+
+/*
+    Returns a block of the index with the same contents as 'data', 0 if there is none. Entries are only
+    trusted after comparing the contents, and a block with as many references as its count holds is
+    passed over
+*/
+static int findIndexedBlock(const void *data, unsigned int hash) {
+    char candidate[BLOCK_SIZE];
+    int blockNumber;
+    for (blockNumber = dedupBuckets[hash & dedupBucketMask]; blockNumber != -1; blockNumber = dedupNext[blockNumber]) {
+        if(dedupHashes[blockNumber] != hash || (blockShares != NULL && blockShares[blockNumber] == 0xffff))
+            continue;
+        readFromBlockWithOffset(blockNumber, 0, candidate, BLOCK_SIZE);
+        if(memcmp(candidate, data, BLOCK_SIZE) == 0)
+            return blockNumber;
+    }
+    return 0;
+}
+
+/*
+    Makes block 'blockNumber' file block 'fileBlock' of the file as well, the file then ends with it.
+    Returns 0 with errno = ENOSPC if an indirect block on the way found no room
+*/
+static int mapSharedBlock(int iNumber, int fileBlock, int blockNumber, blockMapCache *cache) {
+    int fresh;
+    Inode inode = getAnInode(iNumber);
+    if(!shareBlock(blockNumber)) {
+        errno = ENOSPC;
+        return 0;
+    }
+    allocationGroup = inodeGroup(iNumber);
+    if(bmapAssign(&inode, fileBlock, blockNumber, &fresh, cache) != blockNumber) {
+        dropBlockShare(blockNumber);
+        errno = ENOSPC;
+        return 0;
+    }
+    inode.size = (fileBlock + 1) * BLOCK_SIZE;
+    inode.modtime = time(NULL);
+    writeTheInode(iNumber, inode);
+    return 1;
+}
+
+/*
+    Writes the blocks cpin buffered in the cache, with the tail packed if it is the end of the file, and
+    enters the whole ones into the index now that they have block numbers
+*/
+static int indexPendingBlocks(int iNumber, unsigned int *hashes, int pending, int firstBlock, blockMapCache *cache,
+                              int last) {
+    int i, blockNumber;
+    if(!(last ? flushPackingTail(cache) : flushDelayedWrite(cache)))
+        return 0;
+    Inode inode = getAnInode(iNumber);
+    for (i = 0; i < pending; i++)
+        if((blockNumber = bmap(&inode, firstBlock + i, cache)) != 0)
+            indexBlock(blockNumber, hashes[i]);
+    return 1;
+}
+
+/*
+    Copies the source a block at a time with dedup on. A whole block with the contents of one in the
+    index is mapped to that block, any other one is written and indexed. The blocks written since the
+    last flush have no block numbers yet, so their hashes wait in 'pending', and a block whose hash bits
+    are set in 'filter' may repeat one of them: they are flushed, and indexed, before it is looked up.
+    A run of shared blocks only changes metadata, and goes out as one transaction. Returns 0 if the file
+    did not fit, -1 if there was no memory for the index (nothing was copied then)
+*/
+static int copyDeduplicated(int source, int iNumber, blockMapCache *cache) {
+    static char buffer[COPY_CHUNK];
+    static unsigned int pending[DELAYED_ALLOCATION_BLOCKS];
+    unsigned char filter[DEDUP_PENDING_FILTER / 8];
+    unsigned int offset = 0;
+    int length, got = 0, i, chunk, pendingCount = 0, pendingStart = 0, sharing = 0, ok = 1;
+    if(!loadDedupIndex())
+        return -1;
+    memset(filter, 0, sizeof(filter));
+    do {
+        for (length = 0; length < COPY_CHUNK && (got = read(source, buffer + length, COPY_CHUNK - length)) > 0; length += got)
+            COUNT_STAT(syscalls, 1);
+        for (i = 0; ok && i < length; i += chunk, offset += chunk) {
+            chunk = length - i < BLOCK_SIZE ? length - i : BLOCK_SIZE;
+            unsigned int hash = chunk == BLOCK_SIZE ? hashBlock(buffer + i) : 0, bit = hash % DEDUP_PENDING_FILTER;
+            int shared = 0;
+            if(chunk == BLOCK_SIZE) {
+                if(pendingCount > 0 && (filter[bit / 8] & 1 << bit % 8)) {
+                    ok = indexPendingBlocks(iNumber, pending, pendingCount, pendingStart, cache, 0);
+                    pendingCount = 0;
+                    memset(filter, 0, sizeof(filter));
+                }
+                shared = ok ? findIndexedBlock(buffer + i, hash) : 0;
+            }
+            if(shared != 0) {
+                if(pendingCount > 0) {
+                    ok = indexPendingBlocks(iNumber, pending, pendingCount, pendingStart, cache, 0);
+                    pendingCount = 0;
+                    memset(filter, 0, sizeof(filter));
+                }
+                if(!transactionOpen) {
+                    beginTransaction();
+                    sharing = 1;
+                }
+                ok = ok && mapSharedBlock(iNumber, offset / BLOCK_SIZE, shared, cache);
+                continue;
+            }
+            if(sharing) {
+                commitTransaction();
+                sharing = 0;
+            }
+            if(pendingCount == DELAYED_ALLOCATION_BLOCKS) {
+                ok = ok && indexPendingBlocks(iNumber, pending, pendingCount, pendingStart, cache, 0);
+                pendingCount = 0;
+                memset(filter, 0, sizeof(filter));
+            }
+            // the partial last block is written but not indexed, it may end up a packed tail
+            ok = ok && writeFileRange(iNumber, buffer + i, chunk, offset, cache) == chunk;
+            if(chunk == BLOCK_SIZE) {
+                if(pendingCount == 0)
+                    pendingStart = offset / BLOCK_SIZE;
+                pending[pendingCount++] = hash;
+                filter[bit / 8] |= 1 << bit % 8;
+            }
+        }
+    } while(ok && length == COPY_CHUNK);
+    if(sharing)
+        commitTransaction();
+    ok = ok && got >= 0 && indexPendingBlocks(iNumber, pending, pendingCount, pendingStart, cache, 1);
+    return ok;
+}
+
+/*
+    Copies a file (named fileName) from external filesystem into the current filesystem. The blocks for
+    the data of the source file are reserved before anything is written, so a file that does not fit
+    fails with ENOSPC right away; a copy that still fails part way is removed again. The holes of a
+    sparse source stay holes. With compression on, the file is compressed instead (see copyCompressed()),
+    and with dedup on, its blocks are shared with the files that hold the same data (see copyDeduplicated())
+*/
+int copyIn(char* sourceFilePath, char* fileName) {
+    int source, sparse = 0, compressing = 0, deduplicating = 0;
+    struct stat sourceStat;
+    if((source = open(sourceFilePath,O_RDWR|O_CREAT,0600))== -1) {
+        printf("\n Error while opening the file [%s]\n",strerror(errno));
+        return 0;
+    }
+
+    blockMapCache cache;
+    initBlockMapCache(&cache);
+    COUNT_STAT(syscalls, 1);
+    allocationGroup = inodeGroup(currentINodeNumber); // where createFileIn() will put the file
+    if(fstat(source, &sourceStat) == 0 && S_ISREG(sourceStat.st_mode)) {
+        // a sparse file only needs blocks for what the host has allocated
+        off_t allocated = (off_t)sourceStat.st_blocks * 512;
+        sparse = allocated < sourceStat.st_size;
+        if(sourceStat.st_size > MAX_FILE_SIZE)
+            errno = EFBIG;
+        off_t needed = sparse ? allocated : sourceStat.st_size;
+        if(sourceStat.st_size <= INLINE_DATA_BYTES)
+            needed = 0; // it goes inline
+        // how far a file compresses is not known up front, so a compressed one reserves nothing
+        compressing = compressionEnabled && !sparse && sourceStat.st_size > INLINE_DATA_BYTES;
+        // nor does a deduplicated one, whose blocks may all be there already
+        deduplicating = dedupEnabled && !sparse && !compressing && sourceStat.st_size > INLINE_DATA_BYTES;
+        if(compressing || deduplicating)
+            needed = 0;
+        if(sourceStat.st_size > MAX_FILE_SIZE || !reserveFileBlocks(&cache, needed)) {
+            printf("\nError while creating %s [%s]\n", fileName ? fileName : "", strerror(errno));
+            close(source);
+            return 0;
+        }
+    }
+
+    int iNumber = createFileIn(currentINodeNumber, fileName, INODE_ALLOCATED);
+    if(iNumber == 0) {
+        printf("\nError while creating %s [%s]\n", fileName ? fileName : "", strerror(errno));
+        releaseBlockMapCache(&cache);
+        close(source);
+        return 0;
+    }
+
+    int bytesRead = 0;
+    static char buffer[COPY_CHUNK];
+    unsigned int offset = 0;
+    int copied = sparse ? copyDataRegions(source, sourceStat.st_size, iNumber, &cache) : -1;
+    if(compressing)
+        copied = copyCompressed(source, iNumber, &cache);
+    else if(deduplicating)
+        copied = copyDeduplicated(source, iNumber, &cache);
+    if(copied == 0) {
+        printf("\n%s\n","FILE DOES NOT FIT!");
+        bytesRead = -1;
+    }
+    while(copied == -1 && (bytesRead = read(source,buffer,COPY_CHUNK)) > 0) {
+        COUNT_STAT(syscalls, 1);
+        if(writeFileRange(iNumber, buffer, bytesRead, offset, &cache) != bytesRead) {
+            printf("\n%s\n","FILE DOES NOT FIT!");
+            break;
+        }
+        offset += bytesRead;
+    }
+    COUNT_STAT(syscalls, 1);
+    if(!(copied == -1 ? flushPackingTail(&cache) : flushDelayedWrite(&cache))) {
+        printf("\n%s\n","FILE DOES NOT FIT!");
+        bytesRead = -1;
+    }
+    // a hole at the end of the source only shows in the size
+    if(bytesRead == 0 && sparse && getAnInode(iNumber).size < sourceStat.st_size)
+        truncateFile(iNumber, sourceStat.st_size);
+    releaseBlockMapCache(&cache);
+    close(source);
+    if(bytesRead != 0) {
+        removeDirectoryEntry(currentINodeNumber, fileName);
+        releaseInode(iNumber);
+        return 0;
+    }
+    return 1;
+}
+
+/*
+    Copies the file (named fileName) from current filesystem to the external filesystem. Runs of
+    unallocated blocks are skipped instead of written, so they come out as holes of the host file
+*/
+int copyOut(char* destinationFilePath, char* fileName) {
+    int dest,x,i;
+    static char buffer[COPY_CHUNK];
+    if((dest = open(destinationFilePath,O_RDWR|O_CREAT|O_TRUNC,0600))== -1) {
+        printf("\nError while opening the file [%s]\n",strerror(errno));
+        return 0;
+    }
+
+    Inode currentINode = getAnInode(currentINodeNumber);
+    directoryEntry directory[100];
+    readDirectoryEntries(&currentINode, directory);
+    for(i = 0; i < currentINode.size/sizeof(directoryEntry); i++) {
+        if(strcmp(fileName,directory[i].fileName)==0){
+            Inode file = getAnInode(directory[i].inode);
+            if((file.flags & ~INODE_DATA_LAYOUT) ==(1<<15)) {
+                unsigned int offset;
+                int result = 1;
+                blockMapCache cache;
+                initBlockMapCache(&cache);
+                for(offset = 0; offset < file.size; offset += x) {
+                    int fileBlock = offset / BLOCK_SIZE, mapped;
+                    if(!(file.flags & (INODE_INLINE | INODE_COMPRESSED)) && bmap(&file, fileBlock, &cache) == 0 && !isPackedTail(&file, fileBlock)) {
+                        x = BLOCK_SIZE;
+                        continue;
+                    }
+                    // read up to the next hole, the holes of a compressed file are in its clusters
+                    for (mapped = 1; mapped < COPY_CHUNK / BLOCK_SIZE
+                            && ((file.flags & INODE_COMPRESSED) || bmap(&file, fileBlock + mapped, &cache) != 0); mapped++)
+                        ;
+                    x = readFileRange(directory[i].inode, buffer, mapped * BLOCK_SIZE, offset, &cache);
+                    if(x <= 0) {
+                        printf("\nError while reading %s [%s]\n", fileName, strerror(errno));
+                        result = 0;
+                        break;
+                    }
+                    pwrite(dest,buffer,x,offset);
+                    COUNT_STAT(syscalls, 1);
+                }
+                if(ftruncate(dest, file.size) == 0) // the size, whether or not the file ends in a hole
+                    COUNT_STAT(syscalls, 1);
+                releaseBlockMapCache(&cache);
+                close(dest);
+                return result;
+            }
+            printf("\n%s\n","NOT A FILE!");
+            close(dest);
+            return 0;
+        }
+    }
+    printf("\n%s\n","NO SUCH FILE!");
+    close(dest);
+    return 0;
+}
+
+/*
+    Prints 'length' bytes of the file from byte 'offset' on (to the end of the file when the length is
+    left out). Only the blocks of that range are read
+*/
+int catFile(char* fileName, char* offsetText, char* lengthText) {
+    char buffer[BLOCK_SIZE];
+    if(fileName == NULL) {
+        printf("use: cat <file> [offset [length]]\n");
+        return 0;
+    }
+    int iNumber = lookupPath(fileName);
+    if(iNumber == -1) {
+        printf("\nError while opening %s [%s]\n", fileName, strerror(errno));
+        return 0;
+    }
+    Inode file = getAnInode(iNumber);
+    if(file.flags & INODE_DIRECTORY) {
+        printf("\n%s\n","NOT A FILE!");
+        return 0;
+    }
+    unsigned long offset = offsetText ? strtoul(offsetText, NULL, 0) : 0;
+    unsigned long length = lengthText ? strtoul(lengthText, NULL, 0) : file.size;
+    if(offset > file.size)
+        offset = file.size;
+    if(length > file.size - offset)
+        length = file.size - offset;
+
+    blockMapCache cache;
+    initBlockMapCache(&cache);
+    errno = 0;
+    while(length > 0) {
+        int chunk = length < BLOCK_SIZE ? length : BLOCK_SIZE;
+        chunk = readFileRange(iNumber, buffer, chunk, offset, &cache);
+        if(chunk <= 0)
+            break;
+        fwrite(buffer, 1, chunk, stdout);
+        offset += chunk;
+        length -= chunk;
+    }
+    releaseBlockMapCache(&cache);
+    if(length > 0) {
+        printf("\nError while reading %s [%s]\n", fileName, strerror(errno ? errno : EIO));
+        return 0;
+    }
+    return 1;
+}
+
+/*
+    Removes the file name 'fileName' from the filesystem if it exists
+*/
+int removeFile(char* fileName) {
+    int i;
+    Inode currentINode = getAnInode(currentINodeNumber);
+    directoryEntry directory[100];
+    readDirectoryEntries(&currentINode, directory);
+
+    for(i = 0; i < currentINode.size/sizeof(directoryEntry); i++) {
+        if(strcmp(fileName,directory[i].fileName)==0) {
+            Inode file = getAnInode(directory[i].inode);
+            if((file.flags & ~INODE_DATA_LAYOUT) ==(1<<15)) {
+                int iNumber = directory[i].inode;
+                directory[i]=directory[(currentINode.size/sizeof(directoryEntry))-1];
+                currentINode.size-=sizeof(directoryEntry);
+                writeBufferToBlock(currentINode.addr[0],directory,currentINode.size);
+                writeTheInode(currentINodeNumber,currentINode);
+                unlinkInode(iNumber); // after the entry is gone: a crash in between leaves an orphan for fsck
+                return 1;
+            }
+            printf("\n%s\n","NOT A FILE!");
+            return 0;
+        }
+    }
+    printf("\n%s\n","NO SUCH FILE!");
+    return 0;
+}
+
+/*
+    Removes the specified directory from the filesystem
+*/
+int removeDirectory(char* fileName) {
+    int i;
+    Inode currentINode = getAnInode(currentINodeNumber);
+    directoryEntry directory[100];
+    readDirectoryEntries(&currentINode, directory);
+
+    for(i = 0; i < currentINode.size/sizeof(directoryEntry); i++) {
+        if(strcmp(fileName,directory[i].fileName)==0){
+            Inode file = getAnInode(directory[i].inode);
+            if (file.flags ==( 1<<14 | 1<<15) && file.size > 2 * sizeof(directoryEntry)) {
+                printf("\n%s\n","DIRECTORY NOT EMPTY! (rmdir -r removes it with everything in it)");
+                return 0;
+            }
+            if (file.flags ==( 1<<14 | 1<<15)) {
+                int iNumber = directory[i].inode;
+                directory[i]=directory[(currentINode.size/sizeof(directoryEntry))-1];
+                currentINode.size-=sizeof(directoryEntry);
+                writeBufferToBlock(currentINode.addr[0],directory,currentINode.size);
+                writeTheInode(currentINodeNumber,currentINode);
+                unlinkInode(iNumber); // after the entry is gone: a crash in between leaves an orphan for fsck
+                return 1;
+            }
+            printf("\n%s\n","NOT A DIRECTORY!");
+            return 0;
+        }
+    }
+    printf("\n%s\n","NO SUCH DIRECTORY!");
+    return 0;
+}
+
+// a growable array of block or i-node numbers
+typedef struct {
+    int *numbers;
+    int count, capacity;
+} numberList;
+
+static int reserveNumbers(numberList *list, int more) {
+    if(list->count + more <= list->capacity)
+        return 1;
+    int capacity = list->capacity ? list->capacity : 1024;
+    while(capacity < list->count + more)
+        capacity *= 2;
+    int *numbers = realloc(list->numbers, capacity * sizeof(int));
+    if(numbers == NULL)
+        return 0;
+    list->numbers = numbers;
+    list->capacity = capacity;
+    return 1;
+}
+
+/*
+    Removes a directory of directory 'parentINumber' with everything below it. The entry goes first,
+    then the subtree is walked and every i-node and block in it is collected. The i-nodes are cleared in
+    i-number order inside one transaction, so each i-list block is written once, and the sorted blocks
+    and i-nodes go back to the maps in one batch each. A crash after the entry is gone only leaves orphans for fsck to clear
+*/
+static int removeTreeFrom(int parentINumber, char* directoryName) {
+    numberList pending = {0}, inodes = {0}, blocks = {0};
+    directoryEntry entries[BLOCK_SIZE / sizeof(directoryEntry)];
+    int i, ok = 1, opened = 0;
+
+    if(directoryName == NULL || strcmp(directoryName, ".") == 0 || strcmp(directoryName, "..") == 0) {
+        printf("\n%s\n","NO SUCH DIRECTORY!");
+        return 0;
+    }
+    int iNumber = findDirectoryEntry(parentINumber, directoryName);
+    if(iNumber == -1) {
+        printf("\n%s\n","NO SUCH DIRECTORY!");
+        return 0;
+    }
+    if(!(getAnInode(iNumber).flags & INODE_DIRECTORY)) {
+        printf("\n%s\n","NOT A DIRECTORY!");
+        return 0;
+    }
+    if(!transactionOpen) {
+        beginTransaction();
+        opened = 1;
+    }
+    removeDirectoryEntry(parentINumber, directoryName);
+
+    // collect the subtree, the directories still to read are kept on 'pending'
+    if(!reserveNumbers(&pending, 1) || !reserveNumbers(&inodes, 1))
+        ok = 0;
+    else {
+        pending.numbers[pending.count++] = iNumber;
+        inodes.numbers[inodes.count++] = iNumber;
+    }
+    while(ok && pending.count > 0) {
+        Inode directory = getAnInode(pending.numbers[--pending.count]);
+        int count = directory.size / sizeof(directoryEntry);
+        if(count > (int)(BLOCK_SIZE / sizeof(directoryEntry)))
+            count = BLOCK_SIZE / sizeof(directoryEntry);
+        directory.size = count * sizeof(directoryEntry);
+        readDirectoryEntries(&directory, entries);
+        for (i = 0; ok && i < count; i++) {
+            int child = entries[i].inode;
+            if(strcmp(entries[i].fileName, ".") == 0 || strcmp(entries[i].fileName, "..") == 0
+                    || child <= 0 || child >= (int)superBlock.ninodes || !(getAnInode(child).flags & INODE_ALLOCATED))
+                continue;
+            if(!reserveNumbers(&inodes, 1) || !reserveNumbers(&pending, 1))
+                ok = 0;
+            else {
+                inodes.numbers[inodes.count++] = child;
+                if(getAnInode(child).flags & INODE_DIRECTORY)
+                    pending.numbers[pending.count++] = child;
+            }
+        }
+    }
+
+    // clear the i-nodes and gather their blocks
+    qsort(inodes.numbers, inodes.count, sizeof(int), compareBlockNumbers);
+    for (i = 0; ok && i < inodes.count; i++) {
+        Inode inode = getAnInode(inodes.numbers[i]);
+        int count = inodeBlockCount(&inode);
+        if(!reserveNumbers(&blocks, count + count / ADDRESSES_PER_BLOCK + 3)) {
+            ok = 0;
+            break;
+        }
+        releaseFileBlocks(&inode, 0, blocks.numbers, &blocks.count);
+        inode.flags = 0;
+        inode.size = 0;
+        writeTheInode(inodes.numbers[i], inode);
+    }
+    if(opened)
+        commitTransaction(); // the cleared i-nodes are on disk before their blocks are handed out again
+    if(ok) {
+        qsort(blocks.numbers, blocks.count, sizeof(int), compareBlockNumbers);
+        addFreeBlocks(blocks.numbers, blocks.count);
+        addFreeInodes(inodes.numbers, inodes.count);
+    }
+    else
+        printf("\nOut of memory, the rest of the directory is left for fsck\n");
+    free(pending.numbers);
+    free(inodes.numbers);
+    free(blocks.numbers);
+    return ok;
+}
+
+/*
+    Removes the directory 'directoryName' of the current directory with everything below it
+*/
+int removeDirectoryTree(char* directoryName) {
+    return removeTreeFrom(currentINodeNumber, directoryName);
+}
+
+/*
+    Snapshots. 'snapshot name' freezes the tree under the root: every i-node in it gets a clone whose
+    block map points at the same data blocks, which become shared (see shareBlock()), so a file written
+    afterwards gets copies of its own of the blocks it changes and the snapshot keeps the old ones. Only
+    what holds i-numbers or is written in place is copied: directory blocks, indirect blocks and packed
+    tails. The roots of the snapshots are the entries of a directory that is in no directory
+    (superBlock.snapshots), at most 62 of them, and 'openfs image name' mounts one read-only
+    (mountedSnapshot). Used under engineLock
+*/
+
+// adds a reference to every block of the list. A block that cannot be shared ends it: it and the rest are cleared
+static int shareBlockList(unsigned short *addresses, int count) {
+    int i;
+    for (i = 0; i < count; i++) {
+        if(addresses[i] != 0 && (addresses[i] >= superBlock.fsize || !shareBlock(addresses[i]))) {
+            memset(addresses + i, 0, (count - i) * sizeof(unsigned short));
+            errno = EMLINK;
+            return 0;
+        }
+    }
+    return 1;
+}
+
+/*
+    Copies an indirect block ('level' 2 for the top of a double indirect tree) and adds a reference to
+    every data block below it. Returns the copy, 0 if there was no block for it. *ok is cleared, with
+    errno set, when the copy maps only part of what the original does
+*/
+static int cloneIndirectBlock(int blockNumber, int level, int *ok) {
+    unsigned short entries[ADDRESSES_PER_BLOCK];
+    int i, copy = getAFreeBlock();
+    if(copy == 0) {
+        errno = ENOSPC;
+        *ok = 0;
+        return 0;
+    }
+    if(!readFromBlockWithOffset(blockNumber, 0, entries, BLOCK_SIZE)) {
+        addAFreeBlock(copy);
+        *ok = 0;
+        return 0;
+    }
+    if(level == 1 && !shareBlockList(entries, ADDRESSES_PER_BLOCK))
+        *ok = 0;
+    for (i = 0; level == 2 && i < ADDRESSES_PER_BLOCK; i++)
+        if(entries[i] != 0)
+            entries[i] = *ok ? cloneIndirectBlock(entries[i], 1, ok) : 0;
+    writeBufferToBlock(copy, entries, BLOCK_SIZE);
+    return copy;
+}
+
+/*
+    Makes 'clone' a copy of the i-node that shares its data blocks. A directory's clone gets a block of
+    its own, which createSnapshot() fills in. Returns 0 with errno set if something did not fit; the clone
+    then maps only the blocks it holds a reference to, so releasing it frees the right ones
+*/
+static int cloneFile(int iNumber, Inode *clone) {
+    char tail[BLOCK_SIZE];
+    int ok = 1;
+    *clone = getAnInode(iNumber);
+    if(clone->flags & INODE_INLINE)
+        return 1;
+    if(clone->flags & INODE_DIRECTORY) {
+        memset(clone->addr, 0, sizeof(clone->addr));
+        if((clone->addr[0] = getAFreeBlock()) == 0) {
+            errno = ENOSPC;
+            return 0;
+        }
+        return 1;
+    }
+    if(clone->flags & INODE_TAIL_PACKED) {
+        // fragments belong to one file, the clone packs the tail again
+        unsigned int tailStart = (clone->size - 1) / BLOCK_SIZE * BLOCK_SIZE;
+        int length = tailLength(clone);
+        ok = readFromBlockWithOffset(clone->addr[TAIL_BLOCK], clone->addr[TAIL_FRAGMENT] * FRAGMENT_SIZE, tail, length);
+        clone->flags &= ~INODE_TAIL_PACKED;
+        clone->addr[TAIL_BLOCK] = clone->addr[TAIL_FRAGMENT] = 0;
+        if(!ok) {
+            memset(clone->addr, 0, sizeof(clone->addr));
+            return 0;
+        }
+        if(!shareBlockList(clone->addr, DIRECT_ADDRESSES))
+            return 0;
+        if(packTail(clone, tailStart, tail, length))
+            return 1;
+        // no fragments to be had, the tail gets a block
+        memset(tail + length, 0, BLOCK_SIZE - length);
+        if((clone->addr[tailStart / BLOCK_SIZE] = getAFreeBlock()) == 0) {
+            errno = ENOSPC;
+            return 0;
+        }
+        writeBufferToBlock(clone->addr[tailStart / BLOCK_SIZE], tail, BLOCK_SIZE);
+        return 1;
+    }
+    if(!shareBlockList(clone->addr, DIRECT_ADDRESSES)) {
+        clone->addr[SINGLE_INDIRECT] = clone->addr[DOUBLE_INDIRECT] = 0;
+        return 0;
+    }
+    if(clone->addr[SINGLE_INDIRECT] != 0)
+        clone->addr[SINGLE_INDIRECT] = cloneIndirectBlock(clone->addr[SINGLE_INDIRECT], 1, &ok);
+    if(clone->addr[DOUBLE_INDIRECT] != 0)
+        clone->addr[DOUBLE_INDIRECT] = ok ? cloneIndirectBlock(clone->addr[DOUBLE_INDIRECT], 2, &ok) : 0;
+    return ok;
+}
+
+/*
+    Gives i-node 'iNumber' a clone unless it has one already ('clones' maps the i-numbers of the tree to
+    those of their clones, so a file with several names gets one). The clone goes on 'cloned', and the
+    directory on 'pending' for its entries to be cloned. Returns the clone, 0 with errno set
+*/
+static int cloneINode(int iNumber, unsigned short *clones, numberList *cloned, numberList *pending) {
+    Inode clone;
+    if(clones[iNumber] != 0)
+        return clones[iNumber];
+    if(!reserveNumbers(cloned, 1) || !reserveNumbers(pending, 1)) {
+        errno = ENOMEM;
+        return 0;
+    }
+    allocationGroup = inodeGroup(iNumber);
+    int copy = getAFreeInode();
+    if(copy == 0) {
+        errno = ENOSPC;
+        return 0;
+    }
+    allocationGroup = inodeGroup(copy);
+    int ok = cloneFile(iNumber, &clone);
+    writeTheInode(copy, clone);
+    clones[iNumber] = copy;
+    cloned->numbers[cloned->count++] = copy;
+    if(ok && (clone.flags & INODE_DIRECTORY))
+        pending->numbers[pending->count++] = iNumber;
+    return ok ? copy : 0;
+}
+
+/*
+    Creates the directory that holds the roots of the snapshots. Returns 0 with errno = ENOSPC
+*/
+static int createSnapshotDirectory() {
+    directoryEntry directory[2];
+    Inode inode;
+    int blockNumber, iNumber = getAFreeInode();
+    if(iNumber == 0) {
+        errno = ENOSPC;
+        return 0;
+    }
+    if((blockNumber = getAFreeBlock()) == 0) {
+        addAFreeInode(iNumber);
+        errno = ENOSPC;
+        return 0;
+    }
+    memset(directory, 0, sizeof(directory));
+    directory[0].inode = directory[1].inode = iNumber;
+    strcpy(directory[0].fileName, ".");
+    strcpy(directory[1].fileName, "..");
+    writeBufferToBlock(blockNumber, directory, sizeof(directory));
+    memset(&inode, 0, sizeof(inode));
+    inode.flags = INODE_ALLOCATED | INODE_DIRECTORY;
+    inode.nlinks = 1;
+    inode.size = sizeof(directory);
+    inode.addr[0] = blockNumber;
+    inode.actime = inode.modtime = time(NULL);
+    writeTheInode(iNumber, inode);
+    superBlock.snapshots = iNumber;
+    writeSuperBlock();
+    return 1;
+}
+
+/*
+    Takes a snapshot of the whole tree, named 'name'. The clones are written in one transaction and only
+    linked in at the end, so a crash part way leaves orphans for fsck, and a snapshot that does not fit
+    is released again
+*/
+int createSnapshot(char *name) {
+    directoryEntry entries[BLOCK_SIZE / sizeof(directoryEntry)];
+    numberList pending = {0}, cloned = {0};
+    int i, ok = 1, opened = 0, error = 0;
+
+    if(name == NULL) {
+        printf("use: snapshot <name> | snapshot -d <name>\n");
+        return 0;
+    }
+    if(*name == 0 || strchr(name, '/') != NULL || strcmp(name, ".") == 0 || strcmp(name, "..") == 0)
+        error = EINVAL;
+    else if(strlen(name) >= sizeof(entries[0].fileName))
+        error = ENAMETOOLONG;
+    else if(superBlock.snapshots == 0 && !createSnapshotDirectory())
+        error = errno;
+    else if(findDirectoryEntry(superBlock.snapshots, name) != -1)
+        error = EEXIST;
+    else if(getAnInode(superBlock.snapshots).size + sizeof(directoryEntry) > BLOCK_SIZE)
+        error = ENOSPC;
+    unsigned short *clones = error == 0 ? calloc(superBlock.ninodes, sizeof(unsigned short)) : NULL;
+    if(clones == NULL) {
+        printf("\nError while creating snapshot %s [%s]\n", name, strerror(error ? error : ENOMEM));
+        return 0;
+    }
+    if(!transactionOpen) {
+        beginTransaction();
+        opened = 1;
+    }
+
+    // the root first, then the entries of every directory that got a clone
+    int root = cloneINode(0, clones, &cloned, &pending);
+    ok = root != 0;
+    while(ok && pending.count > 0) {
+        int directory = pending.numbers[--pending.count], kept = 0;
+        Inode source = getAnInode(directory);
+        int count = source.size / sizeof(directoryEntry);
+        if(count > (int)(BLOCK_SIZE / sizeof(directoryEntry)))
+            count = BLOCK_SIZE / sizeof(directoryEntry);
+        source.size = count * sizeof(directoryEntry);
+        readDirectoryEntries(&source, entries);
+        for (i = 0; ok && i < count; i++) {
+            int child = entries[i].inode;
+            if(child >= (int)superBlock.ninodes || !(getAnInode(child).flags & INODE_ALLOCATED))
+                continue; // left for fsck in the tree, not copied into the snapshot
+            entries[kept] = entries[i];
+            ok = (entries[kept++].inode = cloneINode(child, clones, &cloned, &pending)) != 0;
         }
+        Inode clone = getAnInode(clones[directory]);
+        clone.size = kept * sizeof(directoryEntry);
+        writeBufferToBlock(clone.addr[0], entries, clone.size);
+        writeTheInode(clones[directory], clone);
+    }
+    if(ok && !addDirectoryEntry(superBlock.snapshots, name, root))
+        ok = 0;
+    if(!ok) {
+        error = errno;
+        for (i = 0; i < cloned.count; i++)
+            releaseInode(cloned.numbers[i]);
+        printf("\nError while creating snapshot %s [%s]\n", name, strerror(error));
+    }
+    if(opened)
+        commitTransaction();
+    free(clones);
+    free(pending.numbers);
+    free(cloned.numbers);
+    return ok;
+}
+
+/*
+    Lists the snapshots, one name per line
+*/
+int listSnapshots() {
+    directoryEntry entries[BLOCK_SIZE / sizeof(directoryEntry)];
+    int i;
+    if(superBlock.snapshots == 0)
+        return 1;
+    Inode directory = getAnInode(superBlock.snapshots);
+    readDirectoryEntries(&directory, entries);
+    for (i = 0; i < directory.size / sizeof(directoryEntry); i++)
+        if(strcmp(entries[i].fileName, ".") != 0 && strcmp(entries[i].fileName, "..") != 0)
+            printf("%.14s\n", entries[i].fileName);
+    return 1;
+}
+
+/*
+    Deletes a snapshot. Blocks the tree or other snapshots still use only lose a reference
+*/
+int removeSnapshot(char *name) {
+    if(name == NULL || superBlock.snapshots == 0 || strcmp(name, ".") == 0 || strcmp(name, "..") == 0
+            || findDirectoryEntry(superBlock.snapshots, name) == -1) {
+        printf("\n%s\n","NO SUCH SNAPSHOT!");
+        return 0;
+    }
+    return removeTreeFrom(superBlock.snapshots, name);
+}
+
+/*
+    Makes the snapshot 'name' the root of the mounted image, read-only. Returns 0 with errno = ENOENT if
+    there is no such snapshot
+*/
+int mountSnapshot(const char *name) {
+    int iNumber = superBlock.snapshots == 0 ? -1 : findDirectoryEntry(superBlock.snapshots, name);
+    if(iNumber == -1 || strcmp(name, ".") == 0 || strcmp(name, "..") == 0) {
+        errno = ENOENT;
+        return 0;
+    }
+    mountedSnapshot = currentINodeNumber = iNumber;
+    strcpy(currentWorkingDirectory, "/");
+    return 1;
+}
+
+/*
+    Reflink copy: a new file 'name' in the directory that shares the data blocks of file 'iNumber' (see
+    cloneFile()), so whatever the size it costs an i-node and copies of the indirect blocks. Either file
+    gets copies of its own of the blocks it changes later. Returns the new i-number, 0 with errno set
+*/
+int cloneFileInto(int iNumber, int directoryINumber, const char *name) {
+    Inode clone;
+    if(getAnInode(iNumber).flags & INODE_DIRECTORY) {
+        errno = EISDIR;
+        return 0;
+    }
+    int copy = createFileIn(directoryINumber, name, INODE_ALLOCATED);
+    if(copy == 0)
+        return 0;
+    int ok = cloneFile(iNumber, &clone);
+    clone.nlinks = 1;
+    clone.actime = clone.modtime = time(NULL);
+    writeTheInode(copy, clone);
+    if(!ok) {
+        int error = errno;
+        removeDirectoryEntry(directoryINumber, name);
+        releaseInode(copy);
+        errno = error;
+        return 0;
+    }
+    return copy;
+}
+
+/*
+    Copies a file inside the filesystem without copying its data (see cloneFileInto()). A destination
+    that is a directory gets a file of the source's name
+*/
+int copyFile(char* sourcePath, char* destinationPath) {
+    char name[sizeof(((directoryEntry *)0)->fileName)];
+    int iNumber, directoryINumber;
+    if(sourcePath == NULL || destinationPath == NULL) {
+        printf("use: cp <file> <destination>\n");
+        return 0;
     }
+    if((iNumber = lookupPath(sourcePath)) == -1) {
+        printf("\nError while opening %s [%s]\n", sourcePath, strerror(errno));
+        return 0;
+    }
+    directoryINumber = lookupPath(destinationPath);
+    if(directoryINumber != -1 && (getAnInode(directoryINumber).flags & INODE_DIRECTORY))
+        lookupParent(sourcePath, name);
+    else
+        directoryINumber = lookupParent(destinationPath, name);
+    if(directoryINumber == -1 || cloneFileInto(iNumber, directoryINumber, name) == 0) {
+        printf("\nError while creating %s [%s]\n", destinationPath, strerror(errno));
+        return 0;
+    }
+    return 1;
 }
 
 /*
-    Copies a file (named fileName) from external filesystem into the current filesystem
+    Sets up the checksums of a mounted image that has a checksum area: read from the area, or with
+    'rebuild' computed from the blocks themselves, when the area may be behind them. Returns 0 if there
+    was no memory for them
 */
-void copyIn(char* sourceFilePath, char* fileName) {
-    int source,blockNumber;
-    if((source = open(sourceFilePath,O_RDWR|O_CREAT,0600))== -1) {
-        printf("\n Error while opening the file [%s]\n",strerror(errno));
-        return;
+int loadBlockChecksums(int rebuild) {
+    char *buffer;
+    int first, i;
+    size_t size = (size_t)superBlock.fsize * sizeof(unsigned int);
+    if(superBlock.checksumArea == 0)
+        return 1;
+    free(blockChecksums);
+    free(checksumUnknown);
+    blockChecksums = malloc(size);
+    checksumUnknown = calloc(superBlock.fsize / 8 + 1, 1);
+    buffer = rebuild ? malloc((size_t)SCRUB_CHUNK_BLOCKS * BLOCK_SIZE) : NULL;
+    if(blockChecksums == NULL || checksumUnknown == NULL || (rebuild && buffer == NULL)) {
+        free(blockChecksums);
+        free(checksumUnknown);
+        blockChecksums = NULL;
+        checksumUnknown = NULL;
+        return 0;
     }
-
-    int iNumber = getAFreeInode();
-    Inode inodeForFile;
-    inodeForFile.flags = 1<<15; // setting 15th bit to 1, 15: allocated
-    inodeForFile.nlinks = 1;
-    inodeForFile.uid = 0;
-    inodeForFile.gid = 0;
-    inodeForFile.size = 0;
-    inodeForFile.actime = time(NULL);
-    inodeForFile.modtime = time(NULL);
-
-    int bytesRead = BLOCK_SIZE;
-    char buffer[BLOCK_SIZE] = {0};
-    int i = 0;
-    while(bytesRead == BLOCK_SIZE) {
-        bytesRead = read(source,buffer,BLOCK_SIZE);
-        inodeForFile.size += bytesRead;
-        blockNumber = getAFreeBlock();
-        inodeForFile.addr[i++] = blockNumber;
-        writeBufferToBlock(blockNumber, buffer, bytesRead);
-    }
-    writeTheInode(iNumber,inodeForFile);
-
-    Inode currentINode = getAnInode(currentINodeNumber);
-    blockNumber = currentINode.addr[0];
-    directoryEntry newFile;
-    newFile.inode = iNumber ;
-    strcpy(newFile.fileName,fileName);
-    writeToBlockWithOffset(blockNumber,currentINode.size,&newFile,sizeof(directoryEntry));
-    currentINode.size += sizeof(directoryEntry);
-    writeTheInode(currentINodeNumber,currentINode);
+    pthread_once(&crcOnce, initChecksums);
+    COUNT_STAT(syscalls, 1);
+    if(!rebuild && pread(fileDescriptor, blockChecksums, size, (off_t)superBlock.checksumArea * BLOCK_SIZE) == (ssize_t)size)
+        return 1;
+    // a block the image file ends before reads as zeros
+    for (first = 0; first < (int)superBlock.fsize; first += SCRUB_CHUNK_BLOCKS) {
+        int count = superBlock.fsize - first < SCRUB_CHUNK_BLOCKS ? superBlock.fsize - first : SCRUB_CHUNK_BLOCKS;
+        ssize_t loaded = pread(fileDescriptor, buffer, (size_t)count * BLOCK_SIZE, (off_t)first * BLOCK_SIZE);
+        COUNT_STAT(syscalls, 1);
+        for (i = 0; i < count; i++)
+            blockChecksums[first + i] = loaded >= (ssize_t)(i + 1) * BLOCK_SIZE ? blockChecksum(buffer + i * BLOCK_SIZE) : zeroBlockChecksum;
+    }
+    free(buffer);
+    return 1;
 }
 
 /*
-    Copies the file (named fileName) from current filesystem to the external filesystem
+    Writes the checksums into the checksum area at unmount, after giving the blocks whose checksum is not
+    known one, and drops them
 */
-void copyOut(char* destinationFilePath, char* fileName) {
-    int dest,blockNumber,x,i;
-    char buffer[BLOCK_SIZE] = {0};
-    if((dest = open(destinationFilePath,O_RDWR|O_CREAT,0600))== -1) {
-        printf("\nError while opening the file [%s]\n",strerror(errno));
+void saveBlockChecksums() {
+    char data[BLOCK_SIZE];
+    int blockNumber;
+    if(blockChecksums == NULL)
         return;
+    for (blockNumber = 1; blockNumber < (int)superBlock.fsize; blockNumber++) {
+        if(!isChecksumUnknown(blockNumber))
+            continue;
+        if(pread(fileDescriptor, data, BLOCK_SIZE, (off_t)blockNumber * BLOCK_SIZE) != BLOCK_SIZE)
+            memset(data, 0, BLOCK_SIZE);
+        COUNT_STAT(syscalls, 1);
+        setBlockChecksum(blockNumber, blockChecksum(data));
     }
+    pwrite(fileDescriptor, blockChecksums, (size_t)superBlock.fsize * sizeof(unsigned int), (off_t)superBlock.checksumArea * BLOCK_SIZE);
+    COUNT_STAT(syscalls, 1);
+    free(blockChecksums);
+    free(checksumUnknown);
+    blockChecksums = NULL;
+    checksumUnknown = NULL;
+}
 
-    Inode currentINode = getAnInode(currentINodeNumber);
-    blockNumber = currentINode.addr[0];
-    directoryEntry directory[100];
-    readFromBlockWithOffset(blockNumber,0,directory,currentINode.size);
-    for(i = 0; i < currentINode.size/sizeof(directoryEntry); i++) {
-        if(strcmp(fileName,directory[i].fileName)==0){
-            Inode file = getAnInode(directory[i].inode);
-            unsigned short* source = file.addr;
-            if(file.flags ==(1<<15)) {
-                for(x = 0; x<file.size/BLOCK_SIZE; x++) {
-                    blockNumber = source[x];
-                    readFromBlockWithOffset(blockNumber, 0, buffer, BLOCK_SIZE);
-                    write(dest,buffer,BLOCK_SIZE);
-                }
-                blockNumber = source[x];
-                readFromBlockWithOffset(blockNumber, 0, buffer, file.size%BLOCK_SIZE);
-                write(dest,buffer,file.size%BLOCK_SIZE);
-            }
+static void * scrubWorker(void *unused) {
+    char *buffer = malloc((size_t)SCRUB_CHUNK_BLOCKS * BLOCK_SIZE);
+    int chunk, i, dataStart = INODE_TABLE_START + superBlock.isize;
+    while(buffer != NULL && (chunk = __atomic_fetch_add(&scrubNextChunk, 1, __ATOMIC_RELAXED)) * SCRUB_CHUNK_BLOCKS < (int)superBlock.fsize) {
+        int first = chunk * SCRUB_CHUNK_BLOCKS;
+        int count = superBlock.fsize - first < SCRUB_CHUNK_BLOCKS ? superBlock.fsize - first : SCRUB_CHUNK_BLOCKS;
+        ssize_t loaded = pread(fileDescriptor, buffer, (size_t)count * BLOCK_SIZE, (off_t)first * BLOCK_SIZE);
+        for (i = 0; i < count; i++) {
+            int blockNumber = first + i;
+            // free blocks hold nothing worth checking
+            if(!isChecksummed(blockNumber) || (blockNumber >= dataStart && freeBlockMap != NULL && isFreeInMap(freeBlockMap, blockNumber)))
+                continue;
+            if(isChecksumUnknown(blockNumber))
+                __atomic_fetch_add(&scrubUnverified, 1, __ATOMIC_RELAXED);
+            else if(loaded >= (ssize_t)(i + 1) * BLOCK_SIZE && blockChecksum(buffer + (size_t)i * BLOCK_SIZE) == blockChecksums[blockNumber])
+                __atomic_fetch_add(&scrubChecked, 1, __ATOMIC_RELAXED);
             else {
-                printf("\n%s\n","NOT A FILE!");
+                int error = __atomic_fetch_add(&scrubErrors, 1, __ATOMIC_RELAXED);
+                if(error < SCRUB_REPORTED_BLOCKS)
+                    scrubBadBlocks[error] = blockNumber;
             }
-            return;
         }
     }
+    free(buffer);
+    return NULL;
 }
 
 /*
-    Removes the file name 'fileName' from the filesystem if it exists
+    Checks every block in use against its checksum, with one thread per CPU (up to MAX_SCRUB_THREADS)
+    reading chunks of SCRUB_CHUNK_BLOCKS. Returns the number of damaged blocks, -1 if the image has no
+    checksums
 */
-void removeFile(char* fileName) {
-    int blockNumber,x,i;
-    Inode currentINode = getAnInode(currentINodeNumber);
-    blockNumber = currentINode.addr[0];
-    directoryEntry directory[100];
-    readFromBlockWithOffset(blockNumber,0,directory,currentINode.size);
-
-    for(i = 0; i < currentINode.size/sizeof(directoryEntry); i++) {
-        if(strcmp(fileName,directory[i].fileName)==0) {
-            Inode file = getAnInode(directory[i].inode);
-            if(file.flags ==(1<<15)) {
-                for(x = 0; x<file.size/BLOCK_SIZE; x++) {
-                    blockNumber = file.addr[x];
-                    addAFreeBlock(blockNumber);
-                }
-                if(0<file.size%BLOCK_SIZE) {
-                    blockNumber = file.addr[x];
-                    addAFreeBlock(blockNumber);
-                }
-                addAFreeInode(directory[i].inode);
-                directory[i]=directory[(currentINode.size/sizeof(directoryEntry))-1];
-                currentINode.size-=sizeof(directoryEntry);
-                writeBufferToBlock(currentINode.addr[0],directory,currentINode.size);
-                writeTheInode(currentINodeNumber,currentINode);
-            }
-            else {
-                printf("\n%s\n","NOT A FILE!");
-            }
-            return;
-        }
+int scrubImage() {
+    pthread_t threads[MAX_SCRUB_THREADS];
+    int threadCount = sysconf(_SC_NPROCESSORS_ONLN), started, i;
+    pthread_mutex_lock(&engineLock);
+    if(blockChecksums == NULL) {
+        printf("\nThe image has no block checksums\n");
+        pthread_mutex_unlock(&engineLock);
+        return -1;
     }
+    if(transactionOpen)
+        commitTransaction();
+    if(threadCount > MAX_SCRUB_THREADS)
+        threadCount = MAX_SCRUB_THREADS;
+    scrubNextChunk = scrubErrors = scrubChecked = scrubUnverified = 0;
+    unsigned long long start = monotonicNanoseconds();
+    for (started = 0; started < threadCount; started++)
+        if(pthread_create(&threads[started], NULL, scrubWorker, NULL) != 0)
+            break;
+    if(started == 0)
+        scrubWorker(NULL);
+    for (i = 0; i < started; i++)
+        pthread_join(threads[i], NULL);
+    for (i = 0; i < scrubErrors && i < SCRUB_REPORTED_BLOCKS; i++)
+        printf("\nblock %d: checksum mismatch, the block is damaged", scrubBadBlocks[i]);
+    printf("\nscrubbed %d blocks with %d threads in %.3fs: %d damaged, %d not checksummed yet\n", scrubChecked + scrubErrors,
+           started > 0 ? started : 1, (monotonicNanoseconds() - start) / 1e9, scrubErrors, scrubUnverified);
+    checksumErrors += scrubErrors;
+    pthread_mutex_unlock(&engineLock);
+    return scrubErrors;
 }
 
 /*
-    Removes the specified directory from the filesystem
+    Writes the in-memory superblock back to block 0
 */
-void removeDirectory(char* fileName) {
-    int blockNumber,x,i;
-    Inode currentINode = getAnInode(currentINodeNumber);
-    blockNumber = currentINode.addr[0];
-    directoryEntry directory[100];
-    readFromBlockWithOffset(blockNumber, 0, directory, currentINode.size);
+void writeSuperBlock() {
+    writeBufferToBlock(0, &superBlock, sizeof(superBlockType));
+}
 
-    for(i = 0; i < currentINode.size/sizeof(directoryEntry); i++) {
-        if(strcmp(fileName,directory[i].fileName)==0){
-            Inode file = getAnInode(directory[i].inode);
-            if (file.flags ==( 1<<14 | 1<<15)) {
-                for( x = 0; x<file.size/BLOCK_SIZE; x++) {
-                    blockNumber = file.addr[x];
-                    addAFreeBlock(blockNumber);
-                }
-                if(0<file.size%BLOCK_SIZE) {
-                    blockNumber = file.addr[x];
-                    addAFreeBlock(blockNumber);
-                }
-                addAFreeInode(directory[i].inode);
-                directory[i]=directory[(currentINode.size/sizeof(directoryEntry))-1];
-                currentINode.size-=sizeof(directoryEntry);
-                writeBufferToBlock(currentINode.addr[0],directory,currentINode.size);
-                writeTheInode(currentINodeNumber,currentINode);
-            }
-            else{
-                printf("\n%s\n","NOT A DIRECTORY!");
-            }
-            return;
-        }
+/*
+    Rebuilds the free-block maps from a map of the blocks in use (one byte per block, nonzero = used).
+    A NULL map frees every data block. The i-node maps are dropped, to be read again from the i-list.
+    saveFreeLists() turns the maps into the V6 lists on disk
+*/
+void rebuildFreeBlockList(const unsigned char *usedBlocks) {
+    int blockNumber;
+    setupAllocationGroups();
+    pthread_mutex_lock(&allocatorLock);
+    for (blockNumber = INODE_TABLE_START + superBlock.isize; blockNumber < superBlock.fsize; blockNumber++)
+        if(usedBlocks == NULL || !usedBlocks[blockNumber])
+            freeBlockInMap(blockNumber);
+    pthread_mutex_unlock(&allocatorLock);
+}
+
+static void markBlockUsed(void *usedBlocks, int fileBlock, int blockNumber) {
+    if(blockNumber < superBlock.fsize)
+        ((unsigned char *)usedBlocks)[blockNumber] = 1;
+}
+
+/*
+    Full consistency scan, only run when the image was not unmounted cleanly, because it reads every
+    i-node. Marks the blocks of all allocated i-nodes as used and rebuilds the free-block maps from
+    that, so lists lost by a crash are recovered. The i-node maps are built from the i-list anyway
+*/
+void checkFileSystem() {
+    int iNumber;
+    unsigned char *usedBlocks = calloc(superBlock.fsize, 1);
+
+    for (iNumber = 0; iNumber < totalINodesCount; iNumber++) {
+        Inode inode = getAnInode(iNumber);
+        if(!(inode.flags & INODE_ALLOCATED))
+            continue;
+        walkFileBlocks(fileDescriptor, superBlock.fsize, &inode, markBlockUsed, usedBlocks);
+    }
+    rebuildFreeBlockList(usedBlocks);
+    free(usedBlocks);
+}
+
+/*
+    Writes the free lists and the superblock with the clean flag set, and closes the image
+*/
+void unmountFileSystem() {
+    pthread_mutex_lock(&engineLock);
+    if(fileDescriptor == -1) {
+        pthread_mutex_unlock(&engineLock);
+        return;
     }
+    commitTransaction();
+    saveDedupIndex();
+    drainReadahead();
+    punchFreedBlocks(); // before saveFreeLists() writes the chain into free blocks
+    if(allocationGroups != NULL)
+        saveFreeLists();
+    releaseAllocationGroups();
+    releaseFragmentMap();
+    releaseDedupIndex();
+    saveBlockShares();
+    clusterINumber = -1;
+    mountedSnapshot = 0;
+    saveBlockChecksums(); // last, every block is on the image by now
+    superBlock.clean = FS_CLEAN;
+    writeSuperBlock();
+    close(fileDescriptor);
+    fileDescriptor = -1;
+    pthread_mutex_unlock(&engineLock);
 }
 
 /*
-    Loads an external filesystem into the current filesystem, and copies the contents (inodes, datablocks)
-    into the loaded filesystem
+    Mounts an existing image. Only the superblock is read here; i-list blocks are pulled into the
+    cache the first time they are used. The image is marked as mounted (clean = 0) on disk, so if the
+    program dies before quit() the next mount sees it and runs checkFileSystem()
 */
 int openFileSystem(const char *fileName) {
-	fileDescriptor = open(fileName,2);
-	lseek(fileDescriptor, BLOCK_SIZE, SEEK_SET);
-	read(fileDescriptor, &superBlock, sizeof(superBlock));
-	lseek(fileDescriptor, 2*BLOCK_SIZE, SEEK_SET);
-    Inode rootINode = getAnInode(1);
-	read(fileDescriptor, &rootINode, sizeof(rootINode));
-	return 1;
+    superBlockType loadedSuperBlock;
+    int fd = open(fileName, O_RDWR);
+    if(fd == -1) {
+        printf("\nError while opening the file [%s]\n",strerror(errno));
+        return 0;
+    }
+    if(pread(fd, &loadedSuperBlock, sizeof(superBlockType), 0) != sizeof(superBlockType)
+            || loadedSuperBlock.magic != FS_MAGIC) {
+        printf("\n%s is not a V6 filesystem\n", fileName);
+        close(fd);
+        return 0;
+    }
+
+    unmountFileSystem();
+    // the image may be the one just unmounted, which has only now been marked clean
+    pread(fd, &loadedSuperBlock, sizeof(superBlockType), 0);
+    fileDescriptor = fd;
+    superBlock = loadedSuperBlock;
+    totalINodesCount = superBlock.ninodes;
+    invalidateCache();
+    strcpy(fileSystemPath, fileName);
+    currentINodeNumber = 0;
+    strcpy(currentWorkingDirectory, "/");
+
+    // the checksum area is only written at unmount, after a crash the checksums come from the blocks
+    if(!loadBlockChecksums(superBlock.clean != FS_CLEAN)) {
+        printf("\nOut of memory for the block checksums\n");
+        close(fileDescriptor);
+        fileDescriptor = -1;
+        return 0;
+    }
+    checksumErrors = 0;
+    if(superBlock.clean != FS_CLEAN) {
+        printf("\nFilesystem was not unmounted cleanly, checking consistency\n");
+        checkFileSystem();
+    }
+    else
+        loadFreeBlockList();
+    // the blocks files share have to be known before anything is freed
+    if(!loadBlockShares()) {
+        printf("\nOut of memory for the shared block counts\n");
+        unmountFileSystem();
+        return 0;
+    }
+    if(superBlock.dedupIndex != 0 && !loadDedupIndex()) {
+        // a later load would trust entries for blocks that get other uses meanwhile
+        printf("\nOut of memory for the dedup index, it starts over\n");
+        truncateFile(superBlock.dedupIndex, 0);
+    }
+    superBlock.clean = 0;
+    writeSuperBlock();
+    if(superBlock.orphanList != 0)
+        startReclaimer(); // files removed before the image went down are still being freed
+    return 1;
 }
 
 /*
@@ -512,9 +4555,11 @@ int openFileSystem(const char *fileName) {
 */
 void initfs(char* filePath, int totalNumberOfBlocks, int totalNumberOfINodes) {
     printf("\nFilesystem is now initializing \n");
+    unmountFileSystem();
+    invalidateCache();
     totalINodesCount = totalNumberOfINodes;
     char emptyBlock[BLOCK_SIZE] = {0};
-    int no_of_bytes,i,blockNumber,iNumber;
+    int i;
 
     //init isize (Number of blocks for inode
     if(((totalNumberOfINodes*INODE_SIZE)%BLOCK_SIZE) == 0) // 300*64 % 1024
@@ -522,8 +4567,14 @@ void initfs(char* filePath, int totalNumberOfBlocks, int totalNumberOfINodes) {
     else
             superBlock.isize = (totalNumberOfINodes*INODE_SIZE)/BLOCK_SIZE+1;
 
-    //init fsize
-    superBlock.fsize = totalNumberOfBlocks;
+    //init fsize, the checksums and the share counts of the blocks take the end of the image
+    superBlock.fsize = totalNumberOfBlocks - RESERVED_AREA_BLOCKS(totalNumberOfBlocks);
+    while(superBlock.fsize + 1 + RESERVED_AREA_BLOCKS(superBlock.fsize + 1) <= (unsigned int)totalNumberOfBlocks)
+        superBlock.fsize++;
+    superBlock.checksumArea = superBlock.fsize;
+    superBlock.ninodes = totalNumberOfINodes;
+    superBlock.magic = FS_MAGIC;
+    superBlock.clean = 0;
 
     //create file for File System
     if((fileDescriptor = open(filePath,O_RDWR|O_CREAT,0600))== -1) {
@@ -532,17 +4583,13 @@ void initfs(char* filePath, int totalNumberOfBlocks, int totalNumberOfINodes) {
     }
     strcpy(fileSystemPath,filePath);
 
+    // before the image file gets its size, so a new one is not read through for them
+    if(!loadBlockChecksums(1))
+        superBlock.checksumArea = 0; // no memory for them, the image goes without
     writeBufferToBlock(totalNumberOfBlocks-1,emptyBlock,BLOCK_SIZE); // writing empty block to last block
 
-    // add all blocks to the free array
-    superBlock.nfree = 0;
-    for (blockNumber= 1+superBlock.isize; blockNumber< totalNumberOfBlocks; blockNumber++)
-            addAFreeBlock(blockNumber);
-
-    // add free Inodes to inode array
-    superBlock.ninode = 0;
-    for (iNumber=1; iNumber < totalNumberOfINodes ; iNumber++)
-            addAFreeInode(iNumber);
+    // add all blocks to the free maps, the i-node maps are read from the empty i-list when first used
+    rebuildFreeBlockList(NULL);
 
 
     superBlock.flock = 'f';
@@ -550,100 +4597,690 @@ void initfs(char* filePath, int totalNumberOfBlocks, int totalNumberOfINodes) {
     superBlock.fmod = 'f';
     superBlock.time[0] = 0;
     superBlock.time[1] = 0;
-
-    //write superBlock Block
-    writeBufferToBlock (0, &superBlock, BLOCK_SIZE);
+    superBlock.orphanList = 0;
+    superBlock.sharedBlocks = 0;
+    superBlock.dedupIndex = 0;
+    superBlock.snapshots = 0;
 
     //allocate empty space for i-nodes
-    for (i=1; i <= superBlock.isize; i++)
+    for (i=INODE_TABLE_START; i < INODE_TABLE_START + superBlock.isize; i++)
             writeBufferToBlock(i, emptyBlock, BLOCK_SIZE);
 
     initializeRootDirectory();
+
+    //write superBlock Block
+    writeSuperBlock();
+}
+
+/*
+    Current time in nanoseconds, for latency measurements
+*/
+unsigned long long monotonicNanoseconds() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (unsigned long long)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+/*
+    Histogram bucket of a value. Values below HISTOGRAM_SUB_BUCKETS get their own bucket, larger ones
+    are grouped by their highest set bit and the HISTOGRAM_SUB_BUCKETS values below it (HDR histogram layout)
+*/
+int histogramBucket(unsigned long long value) {
+    if(value < HISTOGRAM_SUB_BUCKETS)
+        return value;
+    int shift = (63 - __builtin_clzll(value)) - 4;
+    return HISTOGRAM_SUB_BUCKETS + shift * HISTOGRAM_SUB_BUCKETS + (int)(value >> shift) - HISTOGRAM_SUB_BUCKETS;
+}
+
+/*
+    Middle of the range of values that fall into the bucket
+*/
+unsigned long long histogramValue(int bucket) {
+    if(bucket < HISTOGRAM_SUB_BUCKETS)
+        return bucket;
+    int shift = (bucket - HISTOGRAM_SUB_BUCKETS) / HISTOGRAM_SUB_BUCKETS;
+    unsigned long long lowest = (unsigned long long)(HISTOGRAM_SUB_BUCKETS + bucket % HISTOGRAM_SUB_BUCKETS) << shift;
+    return lowest + ((1ULL << shift) >> 1);
+}
+
+unsigned long long histogramPercentile(commandStats *stats, double percentile) {
+    unsigned long long wanted = (unsigned long long)(percentile * stats->count + 0.5), seen = 0;
+    int bucket;
+    if(wanted == 0)
+        wanted = 1;
+    for (bucket = 0; bucket < HISTOGRAM_BUCKETS; bucket++) {
+        seen += stats->buckets[bucket];
+        if(seen >= wanted)
+            return histogramValue(bucket) < stats->maxNanoseconds ? histogramValue(bucket) : stats->maxNanoseconds;
+    }
+    return stats->maxNanoseconds;
+}
+
+/*
+    Adds the latency of a finished command and the counters collected while it ran to the command's
+    totals, then clears the counters for the next command
+*/
+void recordCommandStats(const char *commandName, unsigned long long nanoseconds) {
+    commandStats *stats = NULL;
+    int i;
+    for (i = 0; i < trackedCommandCount && stats == NULL; i++)
+        if(strcmp(trackedCommands[i].name, commandName) == 0)
+            stats = &trackedCommands[i];
+    if(stats == NULL) {
+        // unknown names share the last slot once the table is full
+        stats = &trackedCommands[trackedCommandCount < MAX_TRACKED_COMMANDS ? trackedCommandCount++ : MAX_TRACKED_COMMANDS - 1];
+        if(stats->count == 0)
+            snprintf(stats->name, sizeof(stats->name), "%s", trackedCommandCount < MAX_TRACKED_COMMANDS ? commandName : "other");
+    }
+    stats->count++;
+    stats->totalNanoseconds += nanoseconds;
+    if(nanoseconds > stats->maxNanoseconds)
+        stats->maxNanoseconds = nanoseconds;
+    stats->buckets[histogramBucket(nanoseconds)]++;
+    stats->io.syscalls += currentCounters.syscalls;
+    stats->io.bytesRead += currentCounters.bytesRead;
+    stats->io.bytesWritten += currentCounters.bytesWritten;
+    stats->io.cacheHits += currentCounters.cacheHits;
+    stats->io.cacheMisses += currentCounters.cacheMisses;
+    stats->io.allocatorRefills += currentCounters.allocatorRefills;
+    stats->io.allocatorSpills += currentCounters.allocatorSpills;
+    stats->io.inodeRescans += currentCounters.inodeRescans;
+    memset(&currentCounters, 0, sizeof(ioCounters));
+}
+
+/*
+    Prints the latency percentiles (microseconds) and I/O totals of every command run so far
+*/
+void printStats() {
+    int i;
+    printf("\n%-10s %8s %9s %9s %9s %9s %9s %10s %10s %8s %8s %7s %7s %7s\n", "command", "count", "mean(us)",
+           "p50(us)", "p90(us)", "p99(us)", "max(us)", "syscalls", "read(KB)", "write(KB)", "hits", "misses",
+           "refills", "spills");
+    for (i = 0; i < trackedCommandCount; i++) {
+        commandStats *stats = &trackedCommands[i];
+        printf("%-10s %8llu %9.1f %9.1f %9.1f %9.1f %9.1f %10llu %10llu %8llu %8llu %7llu %7llu %7llu\n", stats->name,
+               stats->count, stats->totalNanoseconds / 1000.0 / stats->count, histogramPercentile(stats, 0.50) / 1000.0,
+               histogramPercentile(stats, 0.90) / 1000.0, histogramPercentile(stats, 0.99) / 1000.0,
+               stats->maxNanoseconds / 1000.0, stats->io.syscalls, stats->io.bytesRead / 1024, stats->io.bytesWritten / 1024,
+               stats->io.cacheHits, stats->io.cacheMisses, stats->io.allocatorRefills, stats->io.allocatorSpills);
+    }
+}
+
+void resetStats() {
+    memset(trackedCommands, 0, sizeof(trackedCommands));
+    trackedCommandCount = 0;
+    memset(&currentCounters, 0, sizeof(ioCounters));
+}
+
+/*
+    Remembers a block read or write of the running command
+*/
+void traceBlockIO(int blockNumber, int isWrite) {
+    if(traceEventCount == TRACE_MAX_EVENTS) {
+        traceEventsDropped++;
+        return;
+    }
+    traceEvents[traceEventCount++] = (unsigned int)blockNumber << 1 | isWrite;
+}
+
+/*
+    LEB128: 7 bits per byte, the high bit tells that more bytes follow
+*/
+void writeVarint(FILE *file, unsigned long long value) {
+    while(value >= 0x80) {
+        fputc((int)(value & 0x7f) | 0x80, file);
+        value >>= 7;
+    }
+    fputc((int)value, file);
+}
+
+/*
+    Returns 0 at the end of the file
+*/
+int readVarint(FILE *file, unsigned long long *value) {
+    int byte, shift = 0;
+    *value = 0;
+    do {
+        if((byte = fgetc(file)) == EOF)
+            return 0;
+        *value |= (unsigned long long)(byte & 0x7f) << shift;
+        shift += 7;
+    } while(byte & 0x80);
+    return 1;
+}
+
+/*
+    Starts recording every command and its block I/O into the trace file
+*/
+int startTrace(const char *tracePath) {
+    traceHeader header;
+    stopTrace();
+    if((traceFile = fopen(tracePath, "wb")) == NULL) {
+        printf("\nError while opening the file [%s]\n",strerror(errno));
+        return 0;
+    }
+    header.magic = TRACE_MAGIC;
+    header.version = TRACE_VERSION;
+    header.fsize = fileDescriptor == -1 ? 0 : superBlock.fsize;
+    if(superBlock.checksumArea != 0 && header.fsize != 0)
+        header.fsize += RESERVED_AREA_BLOCKS(superBlock.fsize); // initfs takes them off again
+    header.ninodes = fileDescriptor == -1 ? 0 : superBlock.ninodes;
+    fwrite(&header, sizeof(header), 1, traceFile);
+    drainReadahead(); // blocks read ahead before the trace would save the traced reads of them
+    traceCapturing = 1;
+    traceLastCommandStart = monotonicNanoseconds();
+    return 1;
+}
+
+void stopTrace() {
+    if(traceFile == NULL)
+        return;
+    fclose(traceFile);
+    traceFile = NULL;
+    traceCapturing = 0;
+}
+
+void beginTracedCommand() {
+    traceEventCount = 0;
+    traceEventsDropped = 0;
+}
+
+/*
+    Appends the command and the block I/O collected since beginTracedCommand() to the trace. Block
+    numbers are stored as deltas to the previous event, so sequential runs take one byte per block
+*/
+void endTracedCommand(const char *commandLine, unsigned long long started, unsigned long long nanoseconds) {
+    int i, previousBlock = 0;
+    if(traceFile == NULL)
+        return;
+    writeVarint(traceFile, (started - traceLastCommandStart) / 1000);
+    writeVarint(traceFile, nanoseconds / 1000);
+    writeVarint(traceFile, strlen(commandLine));
+    fwrite(commandLine, 1, strlen(commandLine), traceFile);
+    writeVarint(traceFile, traceEventCount);
+    for (i = 0; i < traceEventCount; i++) {
+        int blockNumber = traceEvents[i] >> 1;
+        long long delta = (long long)blockNumber - previousBlock;
+        unsigned long long zigzag = delta < 0 ? ((unsigned long long)(-delta) << 1) - 1 : (unsigned long long)delta << 1;
+        writeVarint(traceFile, zigzag << 1 | (traceEvents[i] & 1));
+        previousBlock = blockNumber;
+    }
+    traceLastCommandStart = started;
 }
 
 /*
     Saves the filesystem and quits the program
 */
 void quit() {
-    close(fileDescriptor);
+    stopTrace();
+    if(trackedCommandCount > 0)
+        printStats();
+    unmountFileSystem();
     exit(0);
 }
 
+/*
+    Commands that change files or directories, refused while a snapshot is mounted
+*/
+static int changesFiles(const char *command) {
+    static const char *names[] = {"mkdir", "cpin", "cp", "rm", "remdir", "rmdir", "snapshot", NULL};
+    int i;
+    for (i = 0; names[i] != NULL; i++)
+        if(strcmp(command, names[i]) == 0)
+            return 1;
+    return 0;
+}
 
-int main(int argc, char *argv[]) {
-    char c;
+/*
+    How many arguments a command needs at least, and its use line printed when it gets fewer. Commands
+    that are not listed check their own, or take none
+*/
+static const struct {
+    const char *name;
+    int arguments;
+    const char *usage;
+} commandUsages[] = {
+    {"mkdir", 1, "mkdir <directory>"},
+    {"cd", 1, "cd <directory>"},
+    {"cpin", 2, "cpin <source> <file>"},
+    {"cp", 2, "cp <file> <destination>"},
+    {"cpout", 2, "cpout <destination> <file>"},
+    {"cat", 1, "cat <file> [offset [length]]"},
+    {"rm", 1, "rm <file>"},
+    {"remdir", 1, "remdir [-r] <directory>"},
+    {"rmdir", 1, "rmdir [-r] <directory>"},
+    {"openfs", 1, "openfs <image> [snapshot]"},
+    {"snapshot", 1, "snapshot <name> | snapshot -d <name>"},
+    {NULL, 0, NULL}
+};
 
-    printf("\n Clearing screen \n");
-    system("clear");
+/*
+    Prints the use line of the command and returns 0 if the line has too few arguments for it
+*/
+static int checkArguments(const char *command, const char *commandLine) {
+    int i, arguments = -1; // the command itself is not one
+    while(*commandLine != 0) {
+        commandLine += strspn(commandLine, " ");
+        if(*commandLine == 0)
+            break;
+        arguments++;
+        commandLine += strcspn(commandLine, " ");
+    }
+    for (i = 0; commandUsages[i].name != NULL; i++) {
+        if(strcmp(command, commandUsages[i].name) == 0 && arguments < commandUsages[i].arguments) {
+            printf("use: %s\n", commandUsages[i].usage);
+            return 0;
+        }
+    }
+    return 1;
+}
 
+static int runCommand(char *commandLine) {
     unsigned int blk_no =0, inode_no=0;
     char *fs_path;
     char *arg1, *arg2;
-    char *my_argv, cmd[512];
+    char *my_argv;
+    char commandName[16], originalLine[512];
+    unsigned long long commandStart = 0;
+    int ok = 1;
 
-    while(1) {
-        printf("\n%s@%s>>>",fileSystemPath,currentWorkingDirectory);
-        scanf(" %[^\n]s", cmd);
-        my_argv = strtok(cmd," ");
+    snprintf(originalLine, sizeof(originalLine), "%s", commandLine);
+    my_argv = strtok(commandLine," ");
+    if(my_argv == NULL)
+        return 0;
+    snprintf(commandName, sizeof(commandName), "%s", my_argv);
+    if(statsEnabled || traceCapturing)
+        commandStart = monotonicNanoseconds();
+    if(traceCapturing)
+        beginTracedCommand();
 
-        if(strcmp(my_argv, "initfs")==0) {
-            fs_path = strtok(NULL, " ");
-            arg1 = strtok(NULL, " ");
-            arg2 = strtok(NULL, " ");
-            if(access(fs_path, X_OK) != -1) {
-                printf("filesystem already exists. \n");
-                printf("same file system will be used\n");
+    if(mountedSnapshot != 0 && changesFiles(my_argv)) {
+        printf("%s: the snapshot is mounted read-only\n", my_argv);
+        ok = 0;
+    }
+    else if(!checkArguments(my_argv, originalLine))
+        ok = 0;
+    else if(strcmp(my_argv, "initfs")==0) {
+        fs_path = strtok(NULL, " ");
+        arg1 = strtok(NULL, " ");
+        arg2 = strtok(NULL, " ");
+        if(fs_path == NULL) {
+            printf("Insufficient arguments, cannot proceed\n");
+            ok = 0;
+        }
+        else if(access(fs_path, F_OK) != -1) {
+            printf("filesystem already exists. \n");
+            printf("same file system will be used\n");
+            ok = openFileSystem(fs_path);
+        }
+        else {
+            if (!arg1 || !arg2) {
+                printf("Insufficient arguments, cannot proceed\n");
+                ok = 0;
             }
             else {
-                if (!arg1 || !arg2)
-                    printf("Insufficient arguments, cannot proceed\n");
-                else {
-                    blk_no = atoi(arg1);
-                    inode_no = atoi(arg2);
-                    // Initialize the filesystem
-                    initfs(fs_path,blk_no, inode_no);
-                }
+                blk_no = atoi(arg1);
+                inode_no = atoi(arg2);
+                // Initialize the filesystem
+                initfs(fs_path,blk_no, inode_no);
+                ok = fileDescriptor != -1;
             }
-            my_argv = NULL;
-        }
-        // Call the respective functions for the commands
-        else if(strcmp(my_argv, "q")==0){
-            quit();
         }
-        else if(strcmp(my_argv, "ls")==0){
-            ls();
+        my_argv = NULL;
+    }
+    // Call the respective functions for the commands
+    else if(strcmp(my_argv, "q")==0){
+        quit();
+    }
+    else if(strcmp(my_argv, "ls")==0){
+        if(fileDescriptor == -1) {
+            printf("no filesystem is mounted\n");
+            ok = 0;
         }
-        else if(strcmp(my_argv, "mkdir")==0){
+        else
+            ok = ls();
+    }
+    else if(strcmp(my_argv, "mkdir")==0){
+        arg1 = strtok(NULL, " ");
+        ok = makeDirectory(arg1);
+    }
+    else if(strcmp(my_argv, "cd")==0){
+        arg1 = strtok(NULL, " ");
+        ok = changeDirectory(arg1);
+    }
+    else if(strcmp(my_argv, "cpin")==0){
+        arg1 = strtok(NULL, " ");
+        arg2 = strtok(NULL, " ");
+        ok = copyIn(arg1,arg2);
+    }
+    else if(strcmp(my_argv, "cp")==0){
+        arg1 = strtok(NULL, " ");
+        arg2 = strtok(NULL, " ");
+        ok = copyFile(arg1,arg2);
+    }
+    else if(strcmp(my_argv, "cpout")==0){
+        arg1 = strtok(NULL, " ");
+        arg2 = strtok(NULL, " ");
+        ok = copyOut(arg1,arg2);
+    }
+    else if(strcmp(my_argv, "cat")==0){
+        char *arg3;
+        arg1 = strtok(NULL, " ");
+        arg2 = strtok(NULL, " ");
+        arg3 = strtok(NULL, " ");
+        ok = catFile(arg1, arg2, arg3);
+    }
+    else if(strcmp(my_argv, "rm")==0){
+        arg1 = strtok(NULL, " ");
+        ok = removeFile(arg1);
+    }
+    else if(strcmp(my_argv, "remdir")==0 || strcmp(my_argv, "rmdir")==0){
+        arg1 = strtok(NULL, " ");
+        if(strcmp(arg1, "-r")==0) {
             arg1 = strtok(NULL, " ");
-            makeDirectory(arg1);
+            if(arg1 == NULL) {
+                printf("use: %s [-r] <directory>\n", my_argv);
+                ok = 0;
+            }
+            else
+                ok = removeDirectoryTree(arg1);
         }
-        else if(strcmp(my_argv, "cd")==0){
-            arg1 = strtok(NULL, " ");
-            changeDirectory(arg1);
+        else
+            ok = removeDirectory(arg1);
+    }else if(strcmp(my_argv, "openfs")==0){
+        arg1 = strtok(NULL, " ");
+        arg2 = strtok(NULL, " ");
+        ok = openFileSystem(arg1);
+        // with a snapshot name, that snapshot is mounted read-only instead of the live tree
+        if(ok && arg2 != NULL && !mountSnapshot(arg2)) {
+            printf("\nNO SUCH SNAPSHOT!\n");
+            unmountFileSystem();
+            ok = 0;
         }
-        else if(strcmp(my_argv, "cpin")==0){
-            arg1 = strtok(NULL, " ");
-            arg2 = strtok(NULL, " ");
-            copyIn(arg1,arg2);
+    }
+    else if(strcmp(my_argv, "snapshot")==0){
+        arg1 = strtok(NULL, " ");
+        if(strcmp(arg1, "-d")==0)
+            ok = removeSnapshot(strtok(NULL, " "));
+        else
+            ok = createSnapshot(arg1);
+    }
+    else if(strcmp(my_argv, "snapshots")==0){
+        ok = listSnapshots();
+    }
+    else if(strcmp(my_argv, "currentWorkingDirectory")==0){
+        printf("%s\n",currentWorkingDirectory);
+    }
+    else if(strcmp(my_argv, "trace")==0){
+        arg1 = strtok(NULL, " ");
+        arg2 = strtok(NULL, " ");
+        if(arg1 && strcmp(arg1, "start")==0 && arg2)
+            return startTrace(arg2);
+        if(arg1 && strcmp(arg1, "stop")==0) {
+            stopTrace();
+            return 1;
         }
-        else if(strcmp(my_argv, "cpout")==0){
-            arg1 = strtok(NULL, " ");
-            arg2 = strtok(NULL, " ");
-            copyOut(arg1,arg2);
+        printf("use: trace start <file> | trace stop\n");
+        return 0;
+    }
+    else if(strcmp(my_argv, "readahead")==0){
+        arg1 = strtok(NULL, " ");
+        if(arg1 && strcmp(arg1, "on")==0)
+            readaheadEnabled = 1;
+        else if(arg1 && strcmp(arg1, "off")==0)
+            readaheadEnabled = 0;
+        else {
+            printf("use: readahead on | off\n");
+            ok = 0;
         }
-        else if(strcmp(my_argv, "rm")==0){
-            arg1 = strtok(NULL, " ");
-            removeFile(arg1);
+    }
+    else if(strcmp(my_argv, "discard")==0){
+        arg1 = strtok(NULL, " ");
+        if(arg1 && strcmp(arg1, "on")==0)
+            discardEnabled = 1;
+        else if(arg1 && strcmp(arg1, "off")==0)
+            discardEnabled = 0;
+        else {
+            printf("use: discard on | off\n");
+            ok = 0;
         }
-        else if(strcmp(my_argv, "remdir")==0){
-            arg1 = strtok(NULL, " ");
-            removeDirectory(arg1);
-        }else if(strcmp(my_argv, "openfs")==0){
-            arg1 = strtok(NULL, " ");
-            openFileSystem(arg1);
+    }
+    else if(strcmp(my_argv, "tailpack")==0){
+        arg1 = strtok(NULL, " ");
+        if(arg1 && strcmp(arg1, "on")==0)
+            tailPacking = 1;
+        else if(arg1 && strcmp(arg1, "off")==0)
+            tailPacking = 0;
+        else {
+            printf("use: tailpack on | off\n");
+            ok = 0;
+        }
+    }
+    else if(strcmp(my_argv, "compress")==0){
+        arg1 = strtok(NULL, " ");
+        if(arg1 && strcmp(arg1, "on")==0)
+            compressionEnabled = 1;
+        else if(arg1 && strcmp(arg1, "off")==0)
+            compressionEnabled = 0;
+        else {
+            printf("use: compress on | off\n");
+            ok = 0;
+        }
+    }
+    else if(strcmp(my_argv, "dedup")==0){
+        arg1 = strtok(NULL, " ");
+        if(arg1 && strcmp(arg1, "on")==0)
+            dedupEnabled = 1;
+        else if(arg1 && strcmp(arg1, "off")==0)
+            dedupEnabled = 0;
+        else {
+            printf("use: dedup on | off\n");
+            ok = 0;
+        }
+    }
+    else if(strcmp(my_argv, "scrub")==0){
+        if(fileDescriptor == -1) {
+            printf("no filesystem is mounted\n");
+            ok = 0;
+        }
+        else
+            ok = scrubImage() == 0;
+    }
+    else if(strcmp(my_argv, "fstrim")==0){
+        if(fileDescriptor == -1) {
+            printf("no filesystem is mounted\n");
+            ok = 0;
+        }
+        else
+            ok = trimFreeBlocks() >= 0;
+    }
+    else if(strcmp(my_argv, "stats")==0){
+        arg1 = strtok(NULL, " ");
+        if(arg1 == NULL)
+            printStats();
+        else if(strcmp(arg1, "reset")==0)
+            resetStats();
+#ifndef V6FS_NO_STATS
+        else if(strcmp(arg1, "on")==0)
+            statsEnabled = 1;
+        else if(strcmp(arg1, "off")==0)
+            statsEnabled = 0;
+#endif
+        return 1;
+    }
+    else {
+        printf("%s: unknown command\n", my_argv);
+        ok = 0;
+    }
+    if(traceCapturing)
+        endTracedCommand(originalLine, commandStart, monotonicNanoseconds() - commandStart);
+    if(statsEnabled)
+        recordCommandStats(commandName, monotonicNanoseconds() - commandStart);
+    return ok;
+}
+
+/*
+    Runs one command line of the shell. Its latency and I/O counters go to the statistics and, while a
+    trace is being recorded, the command and the blocks it touched are appended to the trace.
+    The reclaimer waits while it runs. Returns 1 if the command succeeded, 0 otherwise
+*/
+int executeCommand(char *commandLine) {
+    pthread_mutex_lock(&engineLock);
+    int ok = runCommand(commandLine);
+    pthread_mutex_unlock(&engineLock);
+    return ok;
+}
+
+/*
+    Metadata commands only touch directory and i-list blocks, so consecutive ones can share a transaction
+*/
+int isMetadataCommand(const char *commandLine) {
+    static const char *names[] = {"mkdir", "cd", "ls", "rm", "remdir", "rmdir", "currentWorkingDirectory", NULL};
+    int i, length = strcspn(commandLine, " ");
+    for (i = 0; names[i] != NULL; i++)
+        if(strlen(names[i]) == length && strncmp(commandLine, names[i], length) == 0)
+            return 1;
+    return 0;
+}
+
+/*
+    Writes the text as a JSON string, without the blank lines the commands print around their messages
+*/
+void printJSONString(FILE *out, const char *text, size_t length) {
+    while(length > 0 && isspace((unsigned char)text[0])) {
+        text++;
+        length--;
+    }
+    while(length > 0 && isspace((unsigned char)text[length-1]))
+        length--;
+    fputc('"', out);
+    for (; length > 0; text++, length--) {
+        unsigned char c = *text;
+        if(c == '"' || c == '\\')
+            fprintf(out, "\\%c", c);
+        else if(c == '\n')
+            fputs("\\n", out);
+        else if(c == '\t')
+            fputs("\\t", out);
+        else if(c < 0x20)
+            fprintf(out, "\\u%04x", c);
+        else
+            fputc(c, out);
+    }
+    fputc('"', out);
+}
+
+/*
+    Runs the commands of a script ("-" reads standard input) without prompts and prints one JSON line per
+    command: {"line":N,"command":"...","ok":true,"us":T,"output":"..."}. Runs of metadata commands are
+    pipelined into one transaction of up to BATCH_TRANSACTION_COMMANDS commands; anything else commits
+    first. Empty lines and lines starting with '#' are skipped, "q" ends the script.
+    Returns 0 if every command succeeded, 1 otherwise
+*/
+int runBatch(const char *scriptPath) {
+    FILE *script = strcmp(scriptPath, "-") == 0 ? stdin : fopen(scriptPath, "r");
+    FILE *results = stdout;
+    char line[512], commandLine[512];
+    int lineNumber = 0, pipelined = 0, failed = 0;
+
+    if(script == NULL) {
+        printf("Error while opening the file [%s]\n", strerror(errno));
+        return 1;
+    }
+    pthread_mutex_lock(&engineLock); // the pipelined transactions span commands
+    while(fgets(line, sizeof(line), script) != NULL) {
+        char *start = line, *output = NULL;
+        size_t outputLength = 0;
+        lineNumber++;
+        line[strcspn(line, "\r\n")] = 0;
+        while(isspace((unsigned char)*start))
+            start++;
+        if(*start == 0 || *start == '#')
+            continue;
+        if(strcmp(start, "q") == 0)
+            break;
+
+        if(isMetadataCommand(start) && fileDescriptor != -1 && !traceCapturing) {
+            // traces are replayed command by command, so they are recorded without pipelining
+            if(!transactionOpen || pipelined == BATCH_TRANSACTION_COMMANDS) {
+                commitTransaction();
+                beginTransaction();
+                pipelined = 0;
+            }
+            pipelined++;
+        }
+        else if(transactionOpen)
+            commitTransaction();
+
+        // the commands print to stdout, collect that into the result instead
+        FILE *capture = open_memstream(&output, &outputLength);
+        stdout = capture;
+        snprintf(commandLine, sizeof(commandLine), "%s", start);
+        unsigned long long started = monotonicNanoseconds();
+        int ok = executeCommand(commandLine);
+        unsigned long long elapsed = monotonicNanoseconds() - started;
+        fclose(capture);
+        stdout = results;
+        failed |= !ok;
+
+        fprintf(results, "{\"line\":%d,\"command\":", lineNumber);
+        printJSONString(results, start, strlen(start));
+        fprintf(results, ",\"ok\":%s,\"us\":%.1f,\"output\":", ok ? "true" : "false", elapsed / 1e3);
+        printJSONString(results, output, outputLength);
+        fputs("}\n", results);
+        free(output);
+
+        // the reclaimer gets in between two transactions, as it does between two commands of the shell
+        if(!transactionOpen) {
+            pthread_mutex_unlock(&engineLock);
+            sched_yield();
+            pthread_mutex_lock(&engineLock);
+        }
+    }
+    pthread_mutex_unlock(&engineLock);
+    if(script != stdin)
+        fclose(script);
+    stopTrace();
+    // what the reclaimer has not got to yet is freed now that no command waits for it, rather than at
+    // the next mount
+    if(fileDescriptor != -1)
+        reclaimOrphans();
+    unmountFileSystem();
+    return failed;
+}
+
+#ifndef V6FS_NO_MAIN
+int main(int argc, char *argv[]) {
+    char cmd[512];
+    int option;
+    const char *scriptPath = NULL;
+
+    while((option = getopt(argc, argv, "st:b:")) != -1) {
+        if(option == 's') {
+#ifndef V6FS_NO_STATS
+            statsEnabled = 1;
+#endif
         }
-        else if(strcmp(my_argv, "currentWorkingDirectory")==0){
-            printf("%s\n",currentWorkingDirectory);
+        else if(option == 't')
+            startTrace(optarg);
+        else if(option == 'b')
+            scriptPath = optarg;
+        else {
+            printf("use: %s [-s] [-t trace] [-b script|-]\n", argv[0]);
+            return 1;
         }
     }
+    if(scriptPath != NULL)
+        return runBatch(scriptPath);
+
+    printf("\n Clearing screen \n");
+    system("clear");
+
+    while(1) {
+        printf("\n%s@%s>>>",fileSystemPath,currentWorkingDirectory);
+        if(scanf(" %[^\n]s", cmd) != 1)
+            quit();
+        executeCommand(cmd);
+    }
 }
+#endif
@@ -0,0 +1,423 @@
+/*
+
+ Filename       : fileSystem.h
+ Description    : On-disk structures and engine functions of the V6 filesystem, shared by the
+                  interactive shell (fileSystem.c), the tools built on top of it (v6fsck.c, v6bench.c,
+                  v6replay.c) and the library (libv6fs.c)
+
+*/
+
+#ifndef FILESYSTEM_H
+#define FILESYSTEM_H
+
+#include <stddef.h>
+#include <stdio.h>
+#include <pthread.h>
+
+/*
+*
+* Initializing the static values like the block size (in bytes), free array size and inode size
+*
+*/
+
+#define BLOCK_SIZE 1024
+#define FREE_ARRAY_SIZE 240 // free and inode array size
+#define INODE_SIZE 64
+#define ADDRESS_COUNT 22 // block addresses held by an i-node
+#define INLINE_DATA_BYTES (ADDRESS_COUNT * 2) // file data small enough to live in addr[] itself
+#define DIRECT_ADDRESSES 20 // addr[0..19] point at data blocks
+#define SINGLE_INDIRECT 20 // addr[20] points at a block of block numbers
+#define DOUBLE_INDIRECT 21 // addr[21] points at a block of single indirect blocks
+#define ADDRESSES_PER_BLOCK (BLOCK_SIZE / 2) // 16 bit block numbers in an indirect block
+#define MAX_FILE_BLOCKS (DIRECT_ADDRESSES + ADDRESSES_PER_BLOCK + ADDRESSES_PER_BLOCK * ADDRESSES_PER_BLOCK)
+#define MAX_FILE_SIZE ((unsigned int)MAX_FILE_BLOCKS * BLOCK_SIZE) // about 257 MB, more than a 16 bit image holds
+#define INDIRECT_MAP_SLOTS (2 + ADDRESSES_PER_BLOCK) // indirect blocks a file can have
+#define INODE_TABLE_START 1 // block 0 holds the superblock, the i-list starts right after it
+#define CACHE_BLOCKS 64 // number of i-list blocks kept in memory
+// Consecutive blocks get different slots; folding in the higher bits keeps the first blocks of the data
+// area and of each allocation group (directories) from sharing slots with the start of the i-list
+#define CACHE_SLOT(blockNumber) (((unsigned int)(blockNumber) ^ ((unsigned int)(blockNumber) >> 6)) % CACHE_BLOCKS)
+#define GROUP_BLOCKS 4096 // data blocks per allocation group, 4 MB
+#define READAHEAD_CACHE_BLOCKS 2048 // data blocks the readahead worker can keep ready, 2 MB
+#define READAHEAD_MIN_BLOCKS 4 // first readahead window of a sequential reader
+#define READAHEAD_MAX_BLOCKS 256 // the window doubles up to this
+#define READAHEAD_MAX_RUN 64 // blocks read by the worker with one pread
+#define READAHEAD_QUEUE_LENGTH 256 // runs waiting for the worker, a full window of scattered blocks
+#define COPY_CHUNK (64 * BLOCK_SIZE) // bytes cpin and cpout move per call
+#define DELAYED_ALLOCATION_BLOCKS 1024 // appends buffered per open file before blocks are allocated, 1 MB
+#define MAGAZINE_SIZE 64 // blocks or i-nodes a thread takes from the group maps at a time
+#define DEPOT_REFILL_CHUNKS 4 // chunks put on a group's depot each time a thread has to go to the maps
+#define RECLAIM_BATCH_BLOCKS 1024 // blocks the reclaimer frees from an orphan before it lets a command in
+#define DISCARD_QUEUE_BLOCKS 4096 // freed blocks collected before their runs are punched out of the image
+#define FRAGMENT_SIZE 64 // unit in which packed tails share a block
+#define FRAGMENTS_PER_BLOCK (BLOCK_SIZE / FRAGMENT_SIZE)
+#define TAIL_BLOCK SINGLE_INDIRECT // a packed file (at most DIRECT_ADDRESSES blocks) keeps its tail's block here
+#define TAIL_FRAGMENT DOUBLE_INDIRECT // and the first fragment of its tail in that block here
+#define FRAGMENT_FILE_BLOCK -2 // what walkFileBlocks() passes for the shared block of a packed tail
+#define CLUSTER_BLOCKS 16 // blocks cpin compresses as one piece, with compression on
+#define CLUSTER_SIZE (CLUSTER_BLOCKS * BLOCK_SIZE) // at most 64 KB, the built-in codec has 16 bit offsets
+#define CODEC_LZ 1 // built-in LZ77, in the LZ4 block format
+#define LZ_HASH_BITS 12 // size of the built-in codec's table of earlier 4 byte words
+#define DEDUP_UNINDEXED -2 // dedupNext[] of a block that is not in the hash index
+#define DEDUP_PENDING_FILTER 8192 // bits of the filter cpin keeps of the hashes of its unflushed blocks
+#define CODEC_ZLIB 2 // deflate, when built with -DV6FS_ZLIB (and -lz)
+#define CHECKSUM_AREA_BLOCKS(fsize) (((fsize) * 4 + BLOCK_SIZE - 1) / BLOCK_SIZE) // a CRC32C for each block
+#define SHARE_AREA_BLOCKS(fsize) (((fsize) * 2 + BLOCK_SIZE - 1) / BLOCK_SIZE) // the share count of each block, after the checksums
+#define RESERVED_AREA_BLOCKS(fsize) (CHECKSUM_AREA_BLOCKS(fsize) + SHARE_AREA_BLOCKS(fsize)) // what initfs keeps after fsize
+#define SCRUB_CHUNK_BLOCKS 256 // blocks a scrub thread reads with one pread
+#define MAX_SCRUB_THREADS 16
+#define SCRUB_REPORTED_BLOCKS 20 // damaged blocks scrub lists before the rest are only counted
+
+#define FS_MAGIC 0x56364653 // "V6FS", written by initfs and checked by openfs
+#define FS_CLEAN 1 // superBlock.clean value once the image has been unmounted by quit()
+#define SHARES_SAVED 2 // superBlock.sharedBlocks value once unmount has written the share counts
+
+#define INODE_ALLOCATED (1<<15)
+#define INODE_DIRECTORY (1<<14)
+#define INODE_ORPHAN (1<<13) // unlinked, waiting for the reclaimer; actime links the orphan list
+#define INODE_INLINE (1<<12) // no blocks, the data is kept in addr[]
+#define INODE_TAIL_PACKED (1<<11) // the last, partial block is in fragments of a shared block
+#define INODE_COMPRESSED (1<<10) // stored in clusters, those whose last block is a hole are compressed
+#define INODE_DATA_LAYOUT (INODE_INLINE | INODE_TAIL_PACKED | INODE_COMPRESSED) // how, not what, a file stores
+
+#define HISTOGRAM_SUB_BUCKETS 16 // 4 significant bits per power of two, about 6% resolution
+#define HISTOGRAM_BUCKETS (HISTOGRAM_SUB_BUCKETS * 61) // enough for any 64 bit nanosecond value
+#define MAX_TRACKED_COMMANDS 32
+
+#define TRACE_MAGIC 0x52543656 // "V6TR"
+#define TRACE_VERSION 1
+#define TRACE_MAX_EVENTS 65536 // block I/O events kept per command, further ones are dropped
+
+#define BATCH_TRANSACTION_COMMANDS 1024 // metadata commands pipelined into one transaction in batch mode
+
+
+/*************** superBlock block structure**********************/
+typedef struct {
+    unsigned int magic; // FS_MAGIC
+    unsigned int clean; // FS_CLEAN if unmounted cleanly, 0 while mounted
+    unsigned int isize; // 4 byte
+    unsigned int fsize;
+    unsigned int ninodes; // total number of i-nodes in the i-list
+    unsigned int nfree;
+    unsigned short free[FREE_ARRAY_SIZE];
+    unsigned int ninode;
+    unsigned short inode[FREE_ARRAY_SIZE];
+    unsigned short flock;
+    unsigned short ilock;
+    unsigned short fmod;
+    unsigned int time[2];
+    unsigned int orphanList; // first i-node waiting for the reclaimer, 0 if none
+    unsigned int sharedBlocks; // set once a block may belong to several files, SHARES_SAVED with the counts on the image
+    unsigned int dedupIndex; // i-node of the saved hash index of the data blocks, 0 if none
+    unsigned int checksumArea; // first block of the block checksums, right after fsize; 0 if there are none
+    unsigned int snapshots; // i-node of the directory of the snapshots' roots, 0 if none was taken
+} superBlockType;
+
+// the superblock is written to block 0 as a whole, so it must fit into one block
+typedef char superBlockFitsInABlock[sizeof(superBlockType) <= BLOCK_SIZE ? 1 : -1];
+
+/****************inode structure ************************/
+typedef struct {
+    unsigned short flags; // 2 bytes
+    char nlinks;  // 1 byte
+    char uid;
+    char gid;
+    unsigned int size; // 32bits  2^32 = 4GB filesize
+    unsigned short addr[ADDRESS_COUNT]; // 20 direct, 1 single and 1 double indirect address, 64 byte inode size
+    unsigned int actime;
+    unsigned int modtime;
+} Inode;
+
+/********** Structure of the directory entry ************/
+typedef struct {
+    unsigned short inode;
+    char fileName[14];
+} directoryEntry;
+
+/********** In-memory copy of an i-list block ************/
+typedef struct {
+    int blockNumber; // -1 when the slot is empty
+    int dirty; // changed inside a transaction and not written to the image yet
+    char data[BLOCK_SIZE];
+} cachedBlock;
+
+/********** Data block read ahead by the readahead worker ************/
+#define READAHEAD_EMPTY 0
+#define READAHEAD_LOADING 1 // the worker is reading it, readers wait for it
+#define READAHEAD_VALID 2
+typedef struct {
+    int blockNumber; // -1 when the slot is empty
+    int state;
+    int checked; // compared with the block's checksum, done when a reader first takes it
+    char data[BLOCK_SIZE];
+} readaheadBlock;
+
+/*
+    Copies of a file's indirect blocks, kept by an open file (or a command reading a whole file) so that
+    mapping an offset to a block costs no I/O once they have been read. It also tracks the file's
+    sequential reads for the readahead worker
+*/
+typedef struct {
+    unsigned int generation; // blockMapGeneration when the copies were made
+    int blockNumbers[INDIRECT_MAP_SLOTS]; // block each slot holds a copy of, 0 if none
+    unsigned short *entries[INDIRECT_MAP_SLOTS];
+    int readaheadNext; // file block a sequential read would start at
+    int readaheadWindow; // blocks queued per window, READAHEAD_MIN_BLOCKS..READAHEAD_MAX_BLOCKS
+    int readaheadEnd; // file block after the last one queued
+    int delayedINumber; // file the buffered appends belong to
+    unsigned int delayedOffset; // file offset of the first buffered byte, block aligned
+    int delayedLength;
+    char *delayedData; // DELAYED_ALLOCATION_BLOCKS blocks, allocated on the first append
+    int *reservedBlocks; // blocks set aside by reserveFileBlocks(), ascending
+    int reservedNext; // the next data block is reservedBlocks[reservedNext]
+    int reservedCount; // indirect blocks are taken from here downwards
+} blockMapCache;
+
+/********** An allocation group: a range of data blocks and a range of i-nodes ************/
+typedef struct {
+    int firstBlock;
+    int blockCount;
+    int freeBlocks;
+    int blockRotor; // where the search for a free block starts
+    int firstInode;
+    int inodeCount;
+    int freeInodes; // only known once inodeMapLoaded is set
+    int inodeRotor; // no i-node below it is free
+    int inodeMapLoaded;
+} allocationGroupType;
+
+/*
+    A thread's private stock of free blocks or i-nodes, taken from the group maps in one go so that
+    most allocations and frees need no lock. The next one handed out is rounds[count - 1]
+*/
+typedef struct {
+    int group; // allocationGroup the rounds were taken for, -1 when the magazine has not been used
+    int count;
+    int rounds[MAGAZINE_SIZE];
+} magazine;
+
+typedef struct magazineSet {
+    magazine blocks;
+    magazine inodes;
+    struct magazineSet *next; // the next thread's
+} magazineSet;
+
+/********** Up to a magazine of free blocks or i-nodes parked on a depot ************/
+typedef struct {
+    int next; // 1 + index of the chunk below it on its stack, 0 for none
+    int count;
+    int rounds[MAGAZINE_SIZE]; // in magazine order, rounds[count - 1] is handed out first
+} depotChunk;
+
+/*
+    The chunks of one group, a lock-free (Treiber) stack. The low 32 bits of 'top' are 1 + the index of
+    the top chunk, the high 32 bits a tag every push and pop moves on, so a pop that was overtaken by
+    another pop and a push of the same chunk fails its compare-and-swap
+*/
+typedef struct {
+    unsigned long long top;
+    int rounds; // blocks or i-nodes on the stack
+} depot;
+
+/********** A block shared by packed tails ************/
+typedef struct {
+    int blockNumber;
+    unsigned short used; // one bit per fragment
+} fragmentBlock;
+
+/********** Start of the first block of a compressed cluster, followed by the compressed bytes ************/
+typedef struct {
+    unsigned short length; // of the compressed bytes
+    unsigned char codec;
+    unsigned char unused;
+} clusterHeader;
+
+/********** An entry of the saved hash index (dedup on) ************/
+typedef struct {
+    unsigned int hash;
+    unsigned int blockNumber;
+} dedupEntry;
+
+/********** I/O counters of the command that is running ************/
+typedef struct {
+    unsigned long long syscalls; // reads and writes on the image and on host files
+    unsigned long long bytesRead; // bytes read from the image
+    unsigned long long bytesWritten; // bytes written to the image
+    unsigned long long cacheHits;
+    unsigned long long cacheMisses;
+    unsigned long long allocatorRefills; // free-list chain blocks read at mount
+    unsigned long long allocatorSpills; // free-list chain blocks written at unmount
+    unsigned long long inodeRescans; // groups whose part of the i-list was scanned for free i-nodes
+} ioCounters;
+
+/********** Latency histogram and totals of one shell command ************/
+typedef struct {
+    char name[16];
+    unsigned long long count;
+    unsigned long long totalNanoseconds;
+    unsigned long long maxNanoseconds;
+    unsigned long long buckets[HISTOGRAM_BUCKETS];
+    ioCounters io;
+} commandStats;
+
+/*
+    Header of a trace file. It is followed by one record per command, all numbers as LEB128 varints:
+    microseconds since the previous command started, duration in microseconds, length and text of the
+    command line, number of block I/O events, then the events as zigzag block-number deltas shifted left
+    by one, with the low bit set for writes
+*/
+typedef struct {
+    unsigned int magic; // TRACE_MAGIC
+    unsigned int version;
+    unsigned int fsize; // geometry of the image mounted when recording started, 0 if none was
+    unsigned int ninodes;
+} traceHeader;
+
+/*
+    Instrumentation. Compiling with -DV6FS_NO_STATS turns statsEnabled into the constant 0, so every
+    counter update is removed by the compiler. Otherwise it is off, a branch predicted not taken, until
+    it is switched on at run time with "stats on" or the shell's -s
+*/
+#ifdef V6FS_NO_STATS
+#define statsEnabled 0
+#else
+extern int statsEnabled;
+#endif
+extern ioCounters currentCounters;
+#define COUNT_STAT(field, amount) do { if(__builtin_expect(statsEnabled, 0)) currentCounters.field += (amount); } while(0)
+
+extern int traceCapturing;
+extern unsigned int traceEvents[TRACE_MAX_EVENTS]; // blockNumber << 1 | isWrite
+extern int traceEventCount, traceEventsDropped;
+
+// Global state of the mounted filesystem (defined in fileSystem.c)
+extern superBlockType superBlock;
+extern int fileDescriptor, currentINodeNumber, totalINodesCount;
+extern int mountedSnapshot; // root of the snapshot mounted read-only, 0 for the live tree
+extern char currentWorkingDirectory[100];
+extern char fileSystemPath[100];
+extern int transactionOpen;
+extern unsigned int blockMapGeneration; // moves on whenever any file's block map changes
+extern int readaheadEnabled;
+extern int discardEnabled; // punch freed blocks out of the image file
+extern int tailPacking; // cpin packs the partial last block of small files into shared blocks
+extern int compressionEnabled; // cpin compresses files in clusters of CLUSTER_SIZE
+extern int dedupEnabled; // cpin maps blocks the image already holds instead of writing them again
+extern unsigned int checksumErrors; // blocks that failed verification since the image was mounted
+extern allocationGroupType *allocationGroups;
+extern int allocationGroupCount, inodesPerGroup;
+extern __thread int allocationGroup; // group the calling thread takes new blocks and i-nodes from first
+extern int depotLocked; // the depots take a mutex instead of compare-and-swap, for comparison in v6bench
+extern pthread_mutex_t engineLock; // held by whoever uses the engine: a shell command, a libv6fs call, the reclaimer
+
+// Block I/O and the i-list cache
+void invalidateCache();
+char * getCachedBlock(int blockNumber);
+void writeBufferToBlock (int blockNumber, void * buffer, int numberOfBytes);
+void writeToBlockWithOffset (int blockNumber, int offset, void * buffer, int numberOfBytes);
+int readFromBlockWithOffset(int blockNumber, int offset, void * buffer, int numberOfBytes);
+void drainReadahead();
+void beginTransaction();
+void commitTransaction();
+
+// Block checksums
+unsigned int blockChecksum(const void *data);
+int loadBlockChecksums(int rebuild);
+void saveBlockChecksums();
+int scrubImage();
+
+// Allocation groups, free maps and i-nodes
+void setupAllocationGroups();
+void releaseAllocationGroups();
+int blockGroup(int blockNumber);
+int inodeGroup(int iNumber);
+int directoryGroup(int parentINumber);
+void loadFreeBlockList();
+void loadInodeMap(int group);
+void saveFreeLists();
+void addAFreeBlock(int blockNumber);
+int getAFreeBlock();
+int getFreeBlocks(int *blocks, int count);
+void addAFreeInode(int iNumber);
+void addFreeBlocks(const int *blocks, int count);
+void addFreeInodes(const int *iNumbers, int count);
+void punchFreedBlocks();
+int trimFreeBlocks();
+Inode getAnInode(int iNumber);
+int getAFreeInode();
+void writeTheInode(int iNumber, Inode inode);
+int inodeBlockCount(const Inode *inode);
+void readDirectoryEntries(const Inode *directoryInode, directoryEntry *entries);
+
+// Byte-range file I/O and path lookup, shared by the shell and libv6fs
+void initBlockMapCache(blockMapCache *cache);
+void releaseBlockMapCache(blockMapCache *cache);
+int bmap(const Inode *inode, int fileBlock, blockMapCache *cache);
+int bmapAllocate(Inode *inode, int fileBlock, int *fresh, blockMapCache *cache);
+int bmapReplace(Inode *inode, int fileBlock, int blockNumber);
+void freeFileBlocks(Inode *inode, int firstFileBlock);
+void walkFileBlocks(int descriptor, unsigned int fsize, const Inode *inode,
+                    void (*visit)(void *context, int fileBlock, int blockNumber), void *context);
+void releaseInode(int iNumber);
+void unlinkInode(int iNumber);
+int reclaimOrphans();
+void startReclaimer();
+int readFileRange(int iNumber, void *buffer, int length, unsigned int offset, blockMapCache *cache);
+int writeFileRange(int iNumber, const void *buffer, int length, unsigned int offset, blockMapCache *cache);
+int flushDelayedWrite(blockMapCache *cache);
+int blocksForSize(unsigned int size);
+int reserveFileBlocks(blockMapCache *cache, unsigned int size);
+void releaseReservedBlocks(blockMapCache *cache);
+int truncateFile(int iNumber, unsigned int size);
+int findDirectoryEntry(int directoryINumber, const char *name);
+int addDirectoryEntry(int directoryINumber, const char *name, int iNumber);
+int removeDirectoryEntry(int directoryINumber, const char *name);
+int createFileIn(int directoryINumber, const char *name, int flags);
+int lookupPath(const char *path);
+int lookupParent(const char *path, char *name);
+int cloneFileInto(int iNumber, int directoryINumber, const char *name);
+
+// Shell commands, the int ones return 1 on success and 0 on failure
+void initializeRootDirectory();
+int ls();
+int makeDirectory (char* dirName);
+int changeDirectory(char* directoryName);
+int copyIn(char* sourceFilePath, char* fileName);
+int copyOut(char* destinationFilePath, char* fileName);
+int copyFile(char* sourcePath, char* destinationPath);
+int removeFile(char* fileName);
+int removeDirectory(char* fileName);
+int removeDirectoryTree(char* directoryName);
+int createSnapshot(char *name);
+int listSnapshots();
+int removeSnapshot(char *name);
+int mountSnapshot(const char *name);
+int catFile(char* fileName, char* offsetText, char* lengthText);
+void initfs(char* filePath, int totalNumberOfBlocks, int totalNumberOfINodes);
+void quit();
+
+// Instrumentation
+unsigned long long monotonicNanoseconds();
+void recordCommandStats(const char *commandName, unsigned long long nanoseconds);
+void printStats();
+void resetStats();
+
+// Trace recording
+void traceBlockIO(int blockNumber, int isWrite);
+void writeVarint(FILE *file, unsigned long long value);
+int readVarint(FILE *file, unsigned long long *value);
+int startTrace(const char *tracePath);
+void stopTrace();
+void beginTracedCommand();
+void endTracedCommand(const char *commandLine, unsigned long long started, unsigned long long nanoseconds);
+int executeCommand(char *commandLine);
+int runBatch(const char *scriptPath);
+
+// Mounting and consistency
+void writeSuperBlock();
+void rebuildFreeBlockList(const unsigned char *usedBlocks);
+void checkFileSystem();
+void unmountFileSystem();
+int openFileSystem(const char *fileName);
+
+#endif
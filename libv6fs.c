@@ -0,0 +1,409 @@
+/*
+
+ Filename       : libv6fs.c
+ Description    : libv6fs, file handles with pread/pwrite semantics on top of the engine in fileSystem.c.
+                  Byte offsets are mapped to blocks through the i-node's block list, so a range of a large
+                  file can be read or rewritten without copying the whole file out of the image.
+
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <limits.h>
+#include <pthread.h>
+
+#include "fileSystem.h"
+#include "libv6fs.h"
+
+struct v6fsHandle {
+    v6fsFile *openFiles;
+};
+
+struct v6fsFile {
+    v6fsHandle *fs;
+    int iNumber;
+    int flags;
+    blockMapCache mapCache; // the file's indirect blocks, so random reads cost one block read each
+    v6fsFile *next;
+};
+
+static v6fsHandle *mountedHandle;
+
+static v6fsHandle *attachHandle() {
+    v6fsHandle *fs = calloc(1, sizeof(v6fsHandle));
+    if(fs == NULL) {
+        unmountFileSystem();
+        errno = ENOMEM;
+        return NULL;
+    }
+    mountedHandle = fs;
+    return fs;
+}
+
+v6fsHandle *v6fsMount(const char *imagePath) {
+    v6fsHandle *fs = NULL;
+    pthread_mutex_lock(&engineLock);
+    if(mountedHandle != NULL)
+        errno = EBUSY;
+    else if(!openFileSystem(imagePath))
+        errno = EINVAL;
+    else
+        fs = attachHandle();
+    pthread_mutex_unlock(&engineLock);
+    return fs;
+}
+
+v6fsHandle *v6fsMountSnapshot(const char *imagePath, const char *snapshot) {
+    v6fsHandle *fs = NULL;
+    pthread_mutex_lock(&engineLock);
+    if(mountedHandle != NULL)
+        errno = EBUSY;
+    else if(!openFileSystem(imagePath))
+        errno = EINVAL;
+    else if(!mountSnapshot(snapshot)) {
+        unmountFileSystem();
+        errno = ENOENT;
+    }
+    else
+        fs = attachHandle();
+    pthread_mutex_unlock(&engineLock);
+    return fs;
+}
+
+v6fsHandle *v6fsFormat(const char *imagePath, int blocks, int inodes) {
+    v6fsHandle *fs = NULL;
+    char path[sizeof(fileSystemPath)];
+    pthread_mutex_lock(&engineLock);
+    if(mountedHandle != NULL)
+        errno = EBUSY;
+    else if(blocks <= 0 || inodes <= 0 || blocks > 65536 || inodes > 65536 || strlen(imagePath) >= sizeof(path))
+        errno = EINVAL;
+    else {
+        strcpy(path, imagePath);
+        initfs(path, blocks, inodes);
+        if(fileDescriptor != -1)
+            fs = attachHandle();
+    }
+    pthread_mutex_unlock(&engineLock);
+    return fs;
+}
+
+/*
+    Writes the appends buffered by the open files of i-node 'iNumber' (of every file for -1), so the
+    engine sees them. Returns 0 with errno = ENOSPC if any of them did not fit
+*/
+static int flushOpenFiles(v6fsHandle *fs, int iNumber) {
+    v6fsFile *file;
+    int result = 1;
+    for (file = fs->openFiles; file != NULL; file = file->next)
+        if((iNumber == -1 || file->iNumber == iNumber) && !flushDelayedWrite(&file->mapCache))
+            result = 0;
+    return result;
+}
+
+/*
+    Unmounts the image, closing any file that is still open. Returns -1 with errno = ENOSPC if the
+    appends buffered by those files did not all fit
+*/
+int v6fsUnmount(v6fsHandle *fs) {
+    int result = 0;
+    pthread_mutex_lock(&engineLock);
+    if(!flushOpenFiles(fs, -1))
+        result = -1;
+    while(fs->openFiles != NULL) {
+        v6fsFile *file = fs->openFiles;
+        fs->openFiles = file->next;
+        releaseBlockMapCache(&file->mapCache);
+        free(file);
+    }
+    unmountFileSystem();
+    mountedHandle = NULL;
+    free(fs);
+    pthread_mutex_unlock(&engineLock);
+    return result;
+}
+
+static void countBlock(void *blocks, int fileBlock, int blockNumber) {
+    (*(unsigned int *)blocks)++;
+}
+
+static int isOpen(v6fsHandle *fs, int iNumber) {
+    v6fsFile *file;
+    for (file = fs->openFiles; file != NULL; file = file->next)
+        if(file->iNumber == iNumber)
+            return 1;
+    return 0;
+}
+
+v6fsFile *v6fsOpen(v6fsHandle *fs, const char *path, int flags) {
+    v6fsFile *file = NULL;
+    char name[sizeof(((directoryEntry *)0)->fileName)];
+    if(mountedSnapshot != 0 && ((flags & O_ACCMODE) != O_RDONLY || (flags & (O_CREAT | O_TRUNC)))) {
+        errno = EROFS;
+        return NULL;
+    }
+    pthread_mutex_lock(&engineLock);
+    int iNumber = lookupPath(path);
+    if(iNumber == -1 && errno == ENOENT && (flags & O_CREAT)) {
+        int directoryINumber = lookupParent(path, name);
+        if(directoryINumber != -1)
+            iNumber = createFileIn(directoryINumber, name, INODE_ALLOCATED);
+        if(iNumber == 0)
+            iNumber = -1;
+    }
+    else if(iNumber != -1 && (flags & O_CREAT) && (flags & O_EXCL)) {
+        errno = EEXIST;
+        iNumber = -1;
+    }
+    if(iNumber != -1) {
+        if(getAnInode(iNumber).flags & INODE_DIRECTORY)
+            errno = EISDIR;
+        else if((file = calloc(1, sizeof(v6fsFile))) == NULL)
+            errno = ENOMEM;
+        else {
+            file->fs = fs;
+            file->iNumber = iNumber;
+            file->flags = flags;
+            initBlockMapCache(&file->mapCache);
+            file->next = fs->openFiles;
+            fs->openFiles = file;
+            if((flags & O_TRUNC) && (flags & O_ACCMODE) != O_RDONLY)
+                truncateFile(iNumber, 0);
+        }
+    }
+    pthread_mutex_unlock(&engineLock);
+    return file;
+}
+
+/*
+    Closes the file. Returns -1 with errno = ENOSPC if the appends it still buffered did not all fit
+*/
+int v6fsClose(v6fsFile *file) {
+    v6fsFile **link;
+    int result = 0;
+    pthread_mutex_lock(&engineLock);
+    if(!flushDelayedWrite(&file->mapCache))
+        result = -1;
+    for (link = &file->fs->openFiles; *link != NULL; link = &(*link)->next) {
+        if(*link == file) {
+            *link = file->next;
+            break;
+        }
+    }
+    releaseBlockMapCache(&file->mapCache);
+    pthread_mutex_unlock(&engineLock);
+    free(file);
+    return result;
+}
+
+ssize_t v6fsPread(v6fsFile *file, void *buffer, size_t length, off_t offset) {
+    if((file->flags & O_ACCMODE) == O_WRONLY) {
+        errno = EBADF;
+        return -1;
+    }
+    if(offset < 0) {
+        errno = EINVAL;
+        return -1;
+    }
+    if(offset >= MAX_FILE_SIZE)
+        return 0;
+    if(length > INT_MAX)
+        length = INT_MAX;
+    pthread_mutex_lock(&engineLock);
+    flushOpenFiles(file->fs, file->iNumber);
+    errno = 0;
+    ssize_t result = readFileRange(file->iNumber, buffer, (int)length, (unsigned int)offset, &file->mapCache);
+    if(result == 0 && errno == EIO)
+        result = -1; // the first block is damaged, or its cluster does not decompress
+    pthread_mutex_unlock(&engineLock);
+    return result;
+}
+
+ssize_t v6fsPwrite(v6fsFile *file, const void *buffer, size_t length, off_t offset) {
+    off_t limit = MAX_FILE_SIZE;
+    if((file->flags & O_ACCMODE) == O_RDONLY) {
+        errno = EBADF;
+        return -1;
+    }
+    if(offset < 0) {
+        errno = EINVAL;
+        return -1;
+    }
+    if(length == 0)
+        return 0;
+    if(offset >= limit) {
+        errno = EFBIG;
+        return -1;
+    }
+    if(length > limit - offset)
+        length = limit - offset;
+    pthread_mutex_lock(&engineLock);
+    // appends through one handle are buffered by it, anything else must land behind them
+    v6fsFile *other;
+    for (other = file->fs->openFiles; other != NULL; other = other->next)
+        if(other != file && other->iNumber == file->iNumber)
+            flushDelayedWrite(&other->mapCache);
+    ssize_t result = writeFileRange(file->iNumber, buffer, (int)length, (unsigned int)offset, &file->mapCache);
+    pthread_mutex_unlock(&engineLock);
+    if(result == 0) {
+        errno = ENOSPC;
+        return -1;
+    }
+    return result;
+}
+
+int v6fsTruncate(v6fsFile *file, off_t size) {
+    int result = 0;
+    if((file->flags & O_ACCMODE) == O_RDONLY) {
+        errno = EBADF;
+        return -1;
+    }
+    if(size < 0) {
+        errno = EINVAL;
+        return -1;
+    }
+    pthread_mutex_lock(&engineLock);
+    flushOpenFiles(file->fs, file->iNumber);
+    if(size > MAX_FILE_SIZE) {
+        errno = EFBIG;
+        result = -1;
+    }
+    else if(!truncateFile(file->iNumber, (unsigned int)size))
+        result = -1; // ENOSPC, inline data that no longer fits found no block
+    pthread_mutex_unlock(&engineLock);
+    return result;
+}
+
+int v6fsStat(v6fsHandle *fs, const char *path, v6fsAttributes *attributes) {
+    int result = -1;
+    pthread_mutex_lock(&engineLock);
+    int iNumber = lookupPath(path);
+    if(iNumber != -1) {
+        flushOpenFiles(fs, iNumber);
+        Inode inode = getAnInode(iNumber);
+        memset(attributes, 0, sizeof(*attributes));
+        attributes->inode = iNumber;
+        attributes->isDirectory = (inode.flags & INODE_DIRECTORY) != 0;
+        attributes->size = inode.size;
+        walkFileBlocks(fileDescriptor, superBlock.fsize, &inode, countBlock, &attributes->blocks);
+        attributes->nlinks = inode.nlinks;
+        attributes->uid = inode.uid;
+        attributes->gid = inode.gid;
+        attributes->accessTime = inode.actime;
+        attributes->modifyTime = inode.modtime;
+        result = 0;
+    }
+    pthread_mutex_unlock(&engineLock);
+    return result;
+}
+
+/*
+    Calls the callback for every entry, "." and ".." included. The entries are copied out first, so the
+    callback may call back into the library. Returns the number of entries visited
+*/
+int v6fsReaddir(v6fsHandle *fs, const char *path, v6fsDirectoryCallback callback, void *context) {
+    directoryEntry directory[BLOCK_SIZE / sizeof(directoryEntry)];
+    char name[sizeof(directory[0].fileName) + 1];
+    int i, count = -1;
+    pthread_mutex_lock(&engineLock);
+    int iNumber = lookupPath(path);
+    if(iNumber != -1) {
+        Inode inode = getAnInode(iNumber);
+        if(!(inode.flags & INODE_DIRECTORY))
+            errno = ENOTDIR;
+        else {
+            readDirectoryEntries(&inode, directory);
+            count = inode.size / sizeof(directoryEntry);
+        }
+    }
+    pthread_mutex_unlock(&engineLock);
+    for (i = 0; i < count; i++) {
+        memcpy(name, directory[i].fileName, sizeof(directory[i].fileName));
+        name[sizeof(directory[i].fileName)] = 0;
+        if(callback(context, name, directory[i].inode))
+            return i + 1;
+    }
+    return count;
+}
+
+int v6fsMkdir(v6fsHandle *fs, const char *path) {
+    char name[sizeof(((directoryEntry *)0)->fileName)];
+    int result = -1;
+    if(mountedSnapshot != 0) {
+        errno = EROFS;
+        return -1;
+    }
+    pthread_mutex_lock(&engineLock);
+    int directoryINumber = lookupParent(path, name);
+    if(directoryINumber != -1 && createFileIn(directoryINumber, name, INODE_ALLOCATED | INODE_DIRECTORY) != 0)
+        result = 0;
+    pthread_mutex_unlock(&engineLock);
+    return result;
+}
+
+/*
+    Makes 'destinationPath' a copy of the file that shares its blocks, see cloneFileInto()
+*/
+int v6fsClone(v6fsHandle *fs, const char *sourcePath, const char *destinationPath) {
+    char name[sizeof(((directoryEntry *)0)->fileName)];
+    int result = -1;
+    if(mountedSnapshot != 0) {
+        errno = EROFS;
+        return -1;
+    }
+    pthread_mutex_lock(&engineLock);
+    int iNumber = lookupPath(sourcePath);
+    int directoryINumber = iNumber == -1 ? -1 : lookupParent(destinationPath, name);
+    if(directoryINumber != -1 && flushOpenFiles(fs, iNumber) && cloneFileInto(iNumber, directoryINumber, name) != 0)
+        result = 0;
+    pthread_mutex_unlock(&engineLock);
+    return result;
+}
+
+/*
+    Removes a file (directory = 0) or an empty directory (directory = 1) from its parent
+*/
+static int removePath(v6fsHandle *fs, const char *path, int directory) {
+    char name[sizeof(((directoryEntry *)0)->fileName)];
+    int result = -1;
+    if(mountedSnapshot != 0) {
+        errno = EROFS;
+        return -1;
+    }
+    pthread_mutex_lock(&engineLock);
+    int directoryINumber = lookupParent(path, name);
+    int iNumber = directoryINumber == -1 ? -1 : findDirectoryEntry(directoryINumber, name);
+    if(directoryINumber != -1 && iNumber == -1)
+        errno = ENOENT;
+    else if(iNumber != -1) {
+        Inode inode = getAnInode(iNumber);
+        int isDirectory = (inode.flags & INODE_DIRECTORY) != 0;
+        if(strcmp(name, ".") == 0 || strcmp(name, "..") == 0)
+            errno = EINVAL;
+        else if(isDirectory && !directory)
+            errno = EISDIR;
+        else if(!isDirectory && directory)
+            errno = ENOTDIR;
+        else if(isDirectory && inode.size > 2 * sizeof(directoryEntry))
+            errno = ENOTEMPTY;
+        else if(isOpen(fs, iNumber))
+            errno = EBUSY;
+        else {
+            removeDirectoryEntry(directoryINumber, name);
+            unlinkInode(iNumber);
+            result = 0;
+        }
+    }
+    pthread_mutex_unlock(&engineLock);
+    return result;
+}
+
+int v6fsRmdir(v6fsHandle *fs, const char *path) {
+    return removePath(fs, path, 1);
+}
+
+int v6fsUnlink(v6fsHandle *fs, const char *path) {
+    return removePath(fs, path, 0);
+}
@@ -0,0 +1,74 @@
+/*
+
+ Filename       : libv6fs.h
+ Description    : Library interface to V6 filesystem images, for programs that want to read and write
+                  files inside an image directly instead of going through the shell.
+                  Errors are reported POSIX style: the call returns -1 (or NULL) and sets errno.
+
+ Build          : gcc -c -DV6FS_NO_MAIN libv6fs.c fileSystem.c && ar rcs libv6fs.a libv6fs.o fileSystem.o
+                  then link with -lv6fs -lpthread
+
+*/
+
+#ifndef LIBV6FS_H
+#define LIBV6FS_H
+
+#include <fcntl.h>
+#include <sys/types.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+typedef struct v6fsHandle v6fsHandle; // a mounted image
+typedef struct v6fsFile v6fsFile; // an open file of a mounted image
+
+/********** What v6fsStat returns about a file or directory ************/
+typedef struct {
+    int inode;
+    int isDirectory;
+    unsigned int size;
+    unsigned int blocks; // blocks in use, indirect blocks included and holes excluded
+    int nlinks;
+    int uid;
+    int gid;
+    unsigned int accessTime;
+    unsigned int modifyTime;
+} v6fsAttributes;
+
+// Called by v6fsReaddir for every entry; returning nonzero stops the listing
+typedef int (*v6fsDirectoryCallback)(void *context, const char *name, int inode);
+
+/*
+    The engine keeps the mounted filesystem in global state, so one image can be mounted at a time.
+    All calls are serialized by the engine lock, which the background reclaimer of removed files also
+    takes, and may come from any thread
+*/
+v6fsHandle *v6fsMount(const char *imagePath);
+v6fsHandle *v6fsMountSnapshot(const char *imagePath, const char *snapshot); // read-only, writes fail with EROFS
+v6fsHandle *v6fsFormat(const char *imagePath, int blocks, int inodes);
+int v6fsUnmount(v6fsHandle *fs);
+
+/*
+    flags: O_RDONLY, O_WRONLY or O_RDWR, optionally with O_CREAT, O_EXCL and O_TRUNC.
+    Appends at the end of a file are buffered by its handle and only get blocks when the buffer fills,
+    the file is read, or it is closed; v6fsClose (or v6fsUnmount) fails with ENOSPC if they did not fit
+*/
+v6fsFile *v6fsOpen(v6fsHandle *fs, const char *path, int flags);
+int v6fsClose(v6fsFile *file);
+ssize_t v6fsPread(v6fsFile *file, void *buffer, size_t length, off_t offset);
+ssize_t v6fsPwrite(v6fsFile *file, const void *buffer, size_t length, off_t offset);
+int v6fsTruncate(v6fsFile *file, off_t size);
+
+int v6fsStat(v6fsHandle *fs, const char *path, v6fsAttributes *attributes);
+int v6fsReaddir(v6fsHandle *fs, const char *path, v6fsDirectoryCallback callback, void *context);
+int v6fsMkdir(v6fsHandle *fs, const char *path);
+int v6fsRmdir(v6fsHandle *fs, const char *path);
+int v6fsUnlink(v6fsHandle *fs, const char *path);
+int v6fsClone(v6fsHandle *fs, const char *sourcePath, const char *destinationPath); // shares the blocks until written
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -0,0 +1,551 @@
+/*
+
+ Filename       : v6bench.c
+ Description    : Benchmarks for the allocator, directory and copy hot paths of the V6 filesystem.
+                  Every workload runs against a freshly initialized image through the same functions the
+                  shell calls, and the results are written as JSON so runs of different versions can be
+                  compared.
+
+ Usage          : v6bench [-i image] [-o output.json] [-W workload,...] [-n files] [-s smallSize]
+                          [-S hugeSize] [-H hugeFiles] [-d depth] [-w width] [-c churnCycles] [-a allocations]
+                          [-r randomReads] [-t threads]
+
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <time.h>
+#include <pthread.h>
+
+#include "fileSystem.h"
+
+#define BENCH_BLOCKS 60000
+#define BENCH_INODES 8192
+#define FILES_PER_DIRECTORY 60 // a directory lives in one block of 64 entries, two of them are . and ..
+#define MAX_DEPTH 40 // currentWorkingDirectory holds 100 characters, each level adds "/d"
+#define MAX_THREADS 64
+
+/********** Measurements of one workload ************/
+typedef struct {
+    const char *name;
+    long operations;
+    long long bytes;
+    double seconds;
+    double *latencies; // microseconds, one per operation
+    long capacity;
+    long long syscallsBefore;
+} workloadResult;
+
+/********** One thread of a parallel allocator workload ************/
+typedef struct {
+    pthread_t thread;
+    int group; // allocationGroup the thread allocates from
+    int inodes; // allocates i-nodes instead of blocks
+    int batch; // allocations before they are all freed again
+    long operations;
+    double *latencies;
+} allocatorThread;
+
+char imagePath[256] = "/tmp/v6bench.img";
+char scratchDirectory[256];
+FILE *jsonOut;
+int firstResult = 1;
+
+double now() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/*
+    Read and write system calls issued by this process so far, from /proc/self/io. -1 if unavailable
+*/
+long long syscallCount() {
+    char line[128];
+    long long reads = -1, writes = -1, value;
+    FILE *io = fopen("/proc/self/io", "r");
+    if(io == NULL)
+        return -1;
+    while(fgets(line, sizeof(line), io)) {
+        if(sscanf(line, "syscr: %lld", &value) == 1)
+            reads = value;
+        else if(sscanf(line, "syscw: %lld", &value) == 1)
+            writes = value;
+    }
+    fclose(io);
+    return (reads < 0 || writes < 0) ? -1 : reads + writes;
+}
+
+void startWorkload(workloadResult *result, const char *name, long expectedOperations) {
+    memset(result, 0, sizeof(workloadResult));
+    result->name = name;
+    result->capacity = expectedOperations > 0 ? expectedOperations : 1;
+    result->latencies = malloc(result->capacity * sizeof(double));
+    initfs(imagePath, BENCH_BLOCKS, BENCH_INODES);
+    result->syscallsBefore = syscallCount();
+}
+
+void recordOperation(workloadResult *result, double started, long long bytes) {
+    double elapsed = now() - started;
+    if(result->operations == result->capacity) {
+        result->capacity *= 2;
+        result->latencies = realloc(result->latencies, result->capacity * sizeof(double));
+    }
+    result->latencies[result->operations++] = elapsed * 1e6;
+    result->seconds += elapsed;
+    result->bytes += bytes;
+}
+
+int compareDoubles(const void *a, const void *b) {
+    double x = *(const double *)a, y = *(const double *)b;
+    return (x > y) - (x < y);
+}
+
+double percentile(workloadResult *result, double p) {
+    long index = (long)(p * (result->operations - 1) + 0.5);
+    return result->operations ? result->latencies[index] : 0;
+}
+
+void finishWorkload(workloadResult *result) {
+    long long syscallsAfter = syscallCount();
+    double syscallsPerOperation = -1;
+    // the count includes the syscalls made by this function's own fopen/read of /proc/self/io
+    if(result->syscallsBefore >= 0 && syscallsAfter >= 0 && result->operations)
+        syscallsPerOperation = (double)(syscallsAfter - result->syscallsBefore) / result->operations;
+    qsort(result->latencies, result->operations, sizeof(double), compareDoubles);
+
+    fprintf(jsonOut, "%s\n    {\"name\": \"%s\", \"ops\": %ld, \"bytes\": %lld, \"seconds\": %.6f, "
+            "\"ops_per_sec\": %.1f, \"mb_per_sec\": %.2f, \"p50_us\": %.2f, \"p99_us\": %.2f, \"syscalls_per_op\": %.2f}",
+            firstResult ? "" : ",", result->name, result->operations, result->bytes, result->seconds,
+            result->seconds > 0 ? result->operations / result->seconds : 0,
+            result->seconds > 0 ? result->bytes / result->seconds / (1024 * 1024) : 0,
+            percentile(result, 0.50), percentile(result, 0.99), syscallsPerOperation);
+    fflush(jsonOut);
+    firstResult = 0;
+    free(result->latencies);
+    unmountFileSystem();
+}
+
+/*
+    Creates a host file of the given size filled with a repeating pattern, used as cpin source
+*/
+void makeSourceFile(char *path, const char *name, int size) {
+    char buffer[BLOCK_SIZE];
+    int i, written = 0;
+    sprintf(path, "%s/%s", scratchDirectory, name);
+    int fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0600);
+    for (i = 0; i < BLOCK_SIZE; i++)
+        buffer[i] = 'a' + i % 26;
+    while(written < size) {
+        int chunk = size - written < BLOCK_SIZE ? size - written : BLOCK_SIZE;
+        write(fd, buffer, chunk);
+        written += chunk;
+    }
+    close(fd);
+}
+
+/*
+    Many small files, spread over subdirectories because a directory holds at most FILES_PER_DIRECTORY
+    names. Measures cpin of every file, then cpout of every file
+*/
+void smallFiles(int files, int size) {
+    workloadResult result;
+    char source[300], target[300], name[14], directory[14];
+    int i;
+    double started;
+    makeSourceFile(source, "small", size);
+    sprintf(target, "%s/small.out", scratchDirectory);
+
+    startWorkload(&result, "small_files_cpin", files);
+    for (i = 0; i < files; i++) {
+        if(i % FILES_PER_DIRECTORY == 0) {
+            if(i)
+                changeDirectory("..");
+            sprintf(directory, "s%d", i / FILES_PER_DIRECTORY);
+            makeDirectory(directory);
+            changeDirectory(directory);
+        }
+        sprintf(name, "f%d", i);
+        started = now();
+        copyIn(source, name);
+        recordOperation(&result, started, size);
+    }
+    finishWorkload(&result);
+
+    // same tree again, this time timing the copies out
+    startWorkload(&result, "small_files_cpout", files);
+    for (i = 0; i < files; i++) {
+        if(i % FILES_PER_DIRECTORY == 0) {
+            if(i)
+                changeDirectory("..");
+            sprintf(directory, "s%d", i / FILES_PER_DIRECTORY);
+            makeDirectory(directory);
+            changeDirectory(directory);
+        }
+        sprintf(name, "f%d", i);
+        copyIn(source, name);
+    }
+    changeDirectory("..");
+    result.syscallsBefore = syscallCount(); // the copies in were only setup
+    for (i = 0; i < files; i++) {
+        if(i % FILES_PER_DIRECTORY == 0) {
+            if(i)
+                changeDirectory("..");
+            sprintf(directory, "s%d", i / FILES_PER_DIRECTORY);
+            changeDirectory(directory);
+        }
+        sprintf(name, "f%d", i);
+        unlink(target);
+        started = now();
+        copyOut(target, name);
+        recordOperation(&result, started, size);
+    }
+    finishWorkload(&result);
+}
+
+/*
+    A few large files, by default big enough to need the double indirect block
+*/
+void hugeFiles(int files, int size) {
+    workloadResult result;
+    char source[300], target[300], name[14];
+    int i;
+    double started;
+    makeSourceFile(source, "huge", size);
+    sprintf(target, "%s/huge.out", scratchDirectory);
+
+    startWorkload(&result, "huge_files_cpin", files);
+    for (i = 0; i < files; i++) {
+        sprintf(name, "h%d", i);
+        started = now();
+        copyIn(source, name);
+        recordOperation(&result, started, size);
+    }
+    finishWorkload(&result);
+
+    startWorkload(&result, "huge_files_cpout", files);
+    for (i = 0; i < files; i++) {
+        sprintf(name, "h%d", i);
+        copyIn(source, name);
+    }
+    result.syscallsBefore = syscallCount(); // the copies in were only setup
+    for (i = 0; i < files; i++) {
+        sprintf(name, "h%d", i);
+        unlink(target);
+        started = now();
+        copyOut(target, name);
+        recordOperation(&result, started, size);
+    }
+    finishWorkload(&result);
+}
+
+/*
+    Random 4 KiB reads from one large file, through a block-map cache like an open libv6fs file.
+    Once the indirect blocks are cached each read costs one block read per block it covers
+*/
+void randomReads(int reads, int size) {
+    workloadResult result;
+    char source[300], buffer[4 * BLOCK_SIZE];
+    int i;
+    double started;
+    blockMapCache cache;
+    makeSourceFile(source, "random", size);
+
+    startWorkload(&result, "random_reads_4k", reads);
+    copyIn(source, "r");
+    int iNumber = lookupPath("r");
+    initBlockMapCache(&cache);
+    srand(1);
+    result.syscallsBefore = syscallCount();
+    for (i = 0; i < reads; i++) {
+        unsigned int offset = (unsigned int)(((double)rand() / RAND_MAX) * (size - sizeof(buffer))) & ~(BLOCK_SIZE - 1);
+        started = now();
+        readFileRange(iNumber, buffer, sizeof(buffer), offset, &cache);
+        recordOperation(&result, started, sizeof(buffer));
+    }
+    releaseBlockMapCache(&cache);
+    finishWorkload(&result);
+}
+
+/*
+    A chain of nested directories: mkdir + cd on the way down, cd .. on the way up
+*/
+void deepTree(int depth) {
+    workloadResult result;
+    int i;
+    double started;
+    if(depth > MAX_DEPTH)
+        depth = MAX_DEPTH;
+    startWorkload(&result, "deep_tree", 3 * depth);
+    for (i = 0; i < depth; i++) {
+        started = now();
+        makeDirectory("d");
+        recordOperation(&result, started, 0);
+        started = now();
+        changeDirectory("d");
+        recordOperation(&result, started, 0);
+    }
+    for (i = 0; i < depth; i++) {
+        started = now();
+        changeDirectory("..");
+        recordOperation(&result, started, 0);
+    }
+    finishWorkload(&result);
+}
+
+/*
+    One directory filled with subdirectories, then listed repeatedly
+*/
+void wideDirectory(int width) {
+    workloadResult result;
+    char name[14];
+    int i;
+    double started;
+    if(width > FILES_PER_DIRECTORY)
+        width = FILES_PER_DIRECTORY;
+    startWorkload(&result, "wide_directory", 2 * width);
+    for (i = 0; i < width; i++) {
+        sprintf(name, "w%d", i);
+        started = now();
+        makeDirectory(name);
+        recordOperation(&result, started, 0);
+    }
+    for (i = 0; i < width; i++) {
+        started = now();
+        ls();
+        recordOperation(&result, started, 0);
+    }
+    finishWorkload(&result);
+}
+
+/*
+    Create/delete cycles, which keep pushing blocks and i-nodes back onto the free lists
+*/
+void churn(int cycles, int size) {
+    workloadResult result;
+    char source[300], name[14];
+    int i, j;
+    double started;
+    makeSourceFile(source, "churn", size);
+    startWorkload(&result, "churn", 2 * cycles);
+    for (i = 0; i < cycles; i++) {
+        for (j = 0; j < 8; j++) {
+            sprintf(name, "c%d", j);
+            started = now();
+            copyIn(source, name);
+            recordOperation(&result, started, size);
+        }
+        for (j = 0; j < 8; j++) {
+            sprintf(name, "c%d", j);
+            started = now();
+            removeFile(name);
+            recordOperation(&result, started, 0);
+        }
+    }
+    finishWorkload(&result);
+}
+
+/*
+    The allocator on its own: batches of getAFreeBlock() followed by addAFreeBlock() on the group
+    maps, and getAFreeInode()/addAFreeInode() pairs
+*/
+void allocator(int allocations) {
+    workloadResult result;
+    int blocks[FREE_ARRAY_SIZE * 2];
+    int i, j, batch = FREE_ARRAY_SIZE * 2;
+    double started;
+
+    startWorkload(&result, "alloc_blocks", allocations);
+    for (i = 0; i < allocations; i += batch) {
+        for (j = 0; j < batch; j++) {
+            started = now();
+            blocks[j] = getAFreeBlock();
+            recordOperation(&result, started, 0);
+        }
+        for (j = batch - 1; j >= 0; j--) {
+            started = now();
+            addAFreeBlock(blocks[j]);
+            recordOperation(&result, started, 0);
+        }
+    }
+    finishWorkload(&result);
+
+    startWorkload(&result, "alloc_inodes", allocations);
+    for (i = 0; i < allocations; i++) {
+        started = now();
+        int iNumber = getAFreeInode();
+        addAFreeInode(iNumber);
+        recordOperation(&result, started, 0);
+    }
+    finishWorkload(&result);
+}
+
+void *allocatorWorker(void *argument) {
+    allocatorThread *t = argument;
+    int items[FREE_ARRAY_SIZE * 2];
+    long target = t->operations;
+    int j;
+    double started;
+    allocationGroup = t->group;
+    t->operations = 0;
+    while(t->operations < target) {
+        for (j = 0; j < t->batch; j++) {
+            started = now();
+            items[j] = t->inodes ? getAFreeInode() : getAFreeBlock();
+            t->latencies[t->operations++] = (now() - started) * 1e6;
+        }
+        for (j = t->batch - 1; j >= 0; j--) {
+            started = now();
+            if(t->inodes)
+                addAFreeInode(items[j]);
+            else
+                addAFreeBlock(items[j]);
+            t->latencies[t->operations++] = (now() - started) * 1e6;
+        }
+    }
+    return NULL;
+}
+
+/*
+    The allocator under contention: 'threads' threads, each in a group of its own or all in group 0,
+    allocate batches of blocks (or i-nodes) and free them again at the same time. Throughput is over
+    the wall clock
+*/
+void parallelAllocator(const char *name, int inodes, int allocations, int threads, int oneGroup) {
+    workloadResult result;
+    allocatorThread workers[MAX_THREADS];
+    int i, available = inodes ? BENCH_INODES : BENCH_BLOCKS - BENCH_INODES / 16;
+    long j;
+
+    startWorkload(&result, name, allocations);
+    for (i = 0; i < threads; i++) {
+        workers[i].group = oneGroup ? 0 : i % allocationGroupCount;
+        workers[i].inodes = inodes;
+        // every thread's batch has to fit next to the others'
+        workers[i].batch = available / 2 / threads < FREE_ARRAY_SIZE * 2 ? available / 2 / threads : FREE_ARRAY_SIZE * 2;
+        workers[i].operations = allocations / threads;
+        workers[i].latencies = malloc((workers[i].operations + 2 * workers[i].batch) * sizeof(double));
+    }
+    double started = now();
+    for (i = 0; i < threads; i++)
+        pthread_create(&workers[i].thread, NULL, allocatorWorker, &workers[i]);
+    for (i = 0; i < threads; i++)
+        pthread_join(workers[i].thread, NULL);
+    result.seconds = now() - started;
+    for (i = 0; i < threads; i++) {
+        if(result.capacity < result.operations + workers[i].operations) {
+            result.capacity = result.operations + workers[i].operations;
+            result.latencies = realloc(result.latencies, result.capacity * sizeof(double));
+        }
+        for (j = 0; j < workers[i].operations; j++)
+            result.latencies[result.operations++] = workers[i].latencies[j];
+        free(workers[i].latencies);
+    }
+    finishWorkload(&result);
+}
+
+/*
+    Whether 'name' is one of the comma separated names. A name may also be the start of another one
+    (alloc, alloc_mt), so every place it occurs is looked at
+*/
+int selected(const char *workloads, const char *name) {
+    const char *found;
+    size_t length = strlen(name);
+    for (found = strstr(workloads, name); found != NULL; found = strstr(found + 1, name))
+        if((found == workloads || found[-1] == ',') && (found[length] == ',' || found[length] == 0))
+            return 1;
+    return 0;
+}
+
+int main(int argc, char *argv[]) {
+    char outputPath[256] = "";
+    char workloads[256] = "small,huge,random,deep,wide,churn,alloc,alloc_mt,depot";
+    int files = 2000, smallSize = 512, hugeSize = 4 * 1024 * 1024, hugeCount = 4;
+    int depth = 32, width = 60, cycles = 500, allocations = 100000, reads = 20000, threads = 8, option;
+
+    while((option = getopt(argc, argv, "i:o:W:n:s:S:H:d:w:c:a:r:t:")) != -1) {
+        switch(option) {
+            case 'i': strncpy(imagePath, optarg, sizeof(imagePath) - 1); break;
+            case 'o': strncpy(outputPath, optarg, sizeof(outputPath) - 1); break;
+            case 'W': strncpy(workloads, optarg, sizeof(workloads) - 1); break;
+            case 'n': files = atoi(optarg); break;
+            case 's': smallSize = atoi(optarg); break;
+            case 'S': hugeSize = atoi(optarg); break;
+            case 'H': hugeCount = atoi(optarg); break;
+            case 'd': depth = atoi(optarg); break;
+            case 'w': width = atoi(optarg); break;
+            case 'c': cycles = atoi(optarg); break;
+            case 'a': allocations = atoi(optarg); break;
+            case 'r': reads = atoi(optarg); break;
+            case 't': threads = atoi(optarg); break;
+            default:
+                printf("use: v6bench [-i image] [-o output.json] [-W small,huge,random,deep,wide,churn,alloc,alloc_mt,depot] [-n files]\n"
+                       "               [-s smallSize] [-S hugeSize] [-H hugeFiles] [-d depth] [-w width] [-c churnCycles]\n"
+                       "               [-a allocations] [-r randomReads] [-t threads]\n");
+                return 1;
+        }
+    }
+    // every huge file has to fit on the image next to the others
+    if(hugeCount < 1)
+        hugeCount = 1;
+    if(hugeSize > (BENCH_BLOCKS - BENCH_INODES / 16) / 2 / hugeCount * BLOCK_SIZE)
+        hugeSize = (BENCH_BLOCKS - BENCH_INODES / 16) / 2 / hugeCount * BLOCK_SIZE;
+    if(hugeSize < 8 * BLOCK_SIZE)
+        hugeSize = 8 * BLOCK_SIZE;
+    if(files > FILES_PER_DIRECTORY * FILES_PER_DIRECTORY)
+        files = FILES_PER_DIRECTORY * FILES_PER_DIRECTORY;
+    if(threads < 1)
+        threads = 1;
+    if(threads > MAX_THREADS)
+        threads = MAX_THREADS;
+
+    // the engine reports on stdout, keep that away from the results
+    jsonOut = outputPath[0] ? fopen(outputPath, "w") : fdopen(dup(1), "w");
+    if(jsonOut == NULL) {
+        printf("Error while opening the file [%s]\n", strerror(errno));
+        return 1;
+    }
+    freopen("/dev/null", "w", stdout);
+    strcpy(scratchDirectory, "/tmp/v6benchXXXXXX");
+    mkdtemp(scratchDirectory);
+
+    fprintf(jsonOut, "{\n  \"format\": 1,\n  \"timestamp\": %ld,\n  \"image_blocks\": %d,\n  \"image_inodes\": %d,\n"
+            "  \"block_size\": %d,\n  \"workloads\": [", (long)time(NULL), BENCH_BLOCKS, BENCH_INODES, BLOCK_SIZE);
+    if(selected(workloads, "small"))
+        smallFiles(files, smallSize);
+    if(selected(workloads, "huge"))
+        hugeFiles(hugeCount, hugeSize);
+    if(selected(workloads, "random"))
+        randomReads(reads, hugeSize);
+    if(selected(workloads, "deep"))
+        deepTree(depth);
+    if(selected(workloads, "wide"))
+        wideDirectory(width);
+    if(selected(workloads, "churn"))
+        churn(cycles, smallSize);
+    if(selected(workloads, "alloc"))
+        allocator(allocations);
+    if(selected(workloads, "alloc_mt")) {
+        parallelAllocator("alloc_blocks_mt", 0, allocations, threads, 0);
+        parallelAllocator("alloc_inodes_mt", 1, allocations, threads, 0);
+    }
+    if(selected(workloads, "depot")) {
+        // every thread on the same group's depot, taking chunks off it with a mutex and then lock-free
+        depotLocked = 1;
+        parallelAllocator("depot_mutex", 0, allocations, threads, 1);
+        depotLocked = 0;
+        parallelAllocator("depot_lockfree", 0, allocations, threads, 1);
+    }
+    fprintf(jsonOut, "\n  ]\n}\n");
+    fclose(jsonOut);
+
+    char command[300];
+    sprintf(command, "rm -rf %s", scratchDirectory);
+    system(command);
+    unlink(imagePath);
+    return 0;
+}
@@ -0,0 +1,569 @@
+/*
+
+ Filename       : v6fsck.c
+ Description    : Consistency checker for V6 filesystem images. Scans the i-list in parallel chunks,
+                  walks the directory tree with a work-stealing queue and reports (or repairs with -y)
+                  orphaned i-nodes, double-allocated blocks, bad link counts and a damaged free list.
+                  The free-block and free-inode lists are rebuilt from the maps built during the scan.
+
+ Usage          : v6fsck [-y] [-j threads] image
+
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <sched.h>
+#include <pthread.h>
+#include <sys/time.h>
+
+#include "fileSystem.h"
+
+#define SCAN_CHUNK_BLOCKS 64 // i-list blocks read with a single pread during pass 1
+#define INODES_PER_BLOCK (BLOCK_SIZE / INODE_SIZE)
+#define ENTRIES_PER_BLOCK (BLOCK_SIZE / sizeof(directoryEntry))
+#define MAX_REPORTED 20 // problems of one kind printed before the rest are only counted
+
+/********** Per-thread queue of directories still to be walked ************/
+typedef struct {
+    pthread_mutex_t lock;
+    int *items;
+    int head; // thieves take from the head
+    int tail; // the owner pushes and pops at the tail
+    int capacity;
+} workDeque;
+
+/********** Directory entry that points to a free or invalid i-node ************/
+typedef struct {
+    int directory;
+    char fileName[14];
+} badEntry;
+
+int imageDescriptor;
+superBlockType checkedSuperBlock;
+int threadCount, dataStart;
+Inode *inodeTable; // whole i-list, read in pass 1
+unsigned long long *usedInodes, *visitedDirectories, *pendingOrphans; // bitmaps, one bit per i-node
+unsigned short *blockClaims; // number of i-nodes pointing at each block
+unsigned short *tailSharers; // number of packed tails in each block, which count as one claim together
+unsigned char *indirectBlocks; // blocks claimed as indirect blocks, which files never share
+unsigned int *linkReferences; // number of directory entries naming each i-node
+unsigned char *onFreeList;
+int nextChunk, pendingDirectories, badPointers;
+workDeque *deques;
+badEntry *badEntries;
+int badEntryCount, badEntryCapacity;
+pthread_mutex_t badEntryLock = PTHREAD_MUTEX_INITIALIZER;
+
+double now() {
+    struct timeval tv;
+    gettimeofday(&tv, NULL);
+    return tv.tv_sec + tv.tv_usec / 1e6;
+}
+
+int testBit(unsigned long long *bitmap, int n) {
+    return (__atomic_load_n(&bitmap[n / 64], __ATOMIC_RELAXED) >> (n % 64)) & 1;
+}
+
+/*
+    Sets the bit and returns its previous value, safe to call from several threads
+*/
+int setBit(unsigned long long *bitmap, int n) {
+    unsigned long long mask = 1ULL << (n % 64);
+    return (__atomic_fetch_or(&bitmap[n / 64], mask, __ATOMIC_RELAXED) & mask) != 0;
+}
+
+/*
+    Counts one claim on a block of i-node *context, or reports the address if it is outside the data area.
+    Holes (address 0) are never passed in. A block holding packed tails is claimed by its first tail only
+*/
+void claimBlock(void *context, int fileBlock, int blockNumber) {
+    if(blockNumber < dataStart || blockNumber >= (int)checkedSuperBlock.fsize) {
+        if(__atomic_fetch_add(&badPointers, 1, __ATOMIC_RELAXED) < MAX_REPORTED)
+            printf("i-node %d: block address %d out of range\n", *(int *)context, blockNumber);
+        return;
+    }
+    if(fileBlock == FRAGMENT_FILE_BLOCK && __atomic_fetch_add(&tailSharers[blockNumber], 1, __ATOMIC_RELAXED) != 0)
+        return;
+    if(fileBlock == -1)
+        __atomic_store_n(&indirectBlocks[blockNumber], 1, __ATOMIC_RELAXED);
+    __atomic_fetch_add(&blockClaims[blockNumber], 1, __ATOMIC_RELAXED);
+}
+
+void unclaimBlock(void *context, int fileBlock, int blockNumber) {
+    if(blockNumber < dataStart || blockNumber >= (int)checkedSuperBlock.fsize)
+        return;
+    if(fileBlock != FRAGMENT_FILE_BLOCK || --tailSharers[blockNumber] == 0)
+        blockClaims[blockNumber]--;
+}
+
+/*
+    Pass 1 worker. Takes chunks of the i-list until none are left, marks every allocated i-node in the
+    used-inode bitmap and counts the claims on every block it points at
+*/
+void * scanInodeChunks(void *unused) {
+    int chunk;
+    while((chunk = __atomic_fetch_add(&nextChunk, 1, __ATOMIC_RELAXED)) * SCAN_CHUNK_BLOCKS < (int)checkedSuperBlock.isize) {
+        int firstBlock = chunk * SCAN_CHUNK_BLOCKS;
+        int blocks = checkedSuperBlock.isize - firstBlock;
+        if(blocks > SCAN_CHUNK_BLOCKS)
+            blocks = SCAN_CHUNK_BLOCKS;
+        pread(imageDescriptor, (char *)inodeTable + (size_t)firstBlock * BLOCK_SIZE, (size_t)blocks * BLOCK_SIZE,
+              (off_t)(INODE_TABLE_START + firstBlock) * BLOCK_SIZE);
+
+        int iNumber = firstBlock * INODES_PER_BLOCK;
+        int lastINumber = (firstBlock + blocks) * INODES_PER_BLOCK;
+        if(lastINumber > (int)checkedSuperBlock.ninodes)
+            lastINumber = checkedSuperBlock.ninodes;
+        for (; iNumber < lastINumber; iNumber++) {
+            Inode *inode = &inodeTable[iNumber];
+            if(!(inode->flags & INODE_ALLOCATED))
+                continue;
+            setBit(usedInodes, iNumber);
+            walkFileBlocks(imageDescriptor, checkedSuperBlock.fsize, inode, claimBlock, &iNumber);
+        }
+    }
+    return NULL;
+}
+
+void pushDirectory(workDeque *deque, int iNumber) {
+    pthread_mutex_lock(&deque->lock);
+    if(deque->tail == deque->capacity) {
+        // compact first, grow only if the deque is really full
+        memmove(deque->items, deque->items + deque->head, (deque->tail - deque->head) * sizeof(int));
+        deque->tail -= deque->head;
+        deque->head = 0;
+        if(deque->tail == deque->capacity) {
+            deque->capacity *= 2;
+            deque->items = realloc(deque->items, deque->capacity * sizeof(int));
+        }
+    }
+    deque->items[deque->tail++] = iNumber;
+    pthread_mutex_unlock(&deque->lock);
+}
+
+/*
+    Takes work from the own deque (newest first, keeps the walk depth-first and cache friendly) or,
+    when that is empty, steals the oldest entry of another thread's deque. Returns -1 if nothing was found
+*/
+int takeDirectory(int self) {
+    int i, iNumber = -1;
+    for (i = 0; i < threadCount && iNumber == -1; i++) {
+        workDeque *deque = &deques[(self + i) % threadCount];
+        pthread_mutex_lock(&deque->lock);
+        if(deque->head < deque->tail)
+            iNumber = (i == 0) ? deque->items[--deque->tail] : deque->items[deque->head++];
+        pthread_mutex_unlock(&deque->lock);
+    }
+    return iNumber;
+}
+
+void recordBadEntry(int directory, const char *fileName) {
+    pthread_mutex_lock(&badEntryLock);
+    if(badEntryCount == badEntryCapacity) {
+        badEntryCapacity = badEntryCapacity ? badEntryCapacity * 2 : 64;
+        badEntries = realloc(badEntries, badEntryCapacity * sizeof(badEntry));
+    }
+    badEntries[badEntryCount].directory = directory;
+    memcpy(badEntries[badEntryCount].fileName, fileName, 14);
+    badEntryCount++;
+    pthread_mutex_unlock(&badEntryLock);
+}
+
+/*
+    Reads the entries of one directory, counts a link for every name and queues the subdirectories
+    that have not been seen yet
+*/
+void walkDirectory(int self, int directory) {
+    directoryEntry entries[ENTRIES_PER_BLOCK];
+    Inode *dir = &inodeTable[directory];
+    int total = dir->size / sizeof(directoryEntry);
+    int blocks = inodeBlockCount(dir);
+    int x, i;
+
+    for (x = 0; x < blocks && total > 0; x++) {
+        int count = total < (int)ENTRIES_PER_BLOCK ? total : (int)ENTRIES_PER_BLOCK;
+        total -= count;
+        if(dir->addr[x] < dataStart || dir->addr[x] >= checkedSuperBlock.fsize)
+            continue;
+        pread(imageDescriptor, entries, count * sizeof(directoryEntry), (off_t)dir->addr[x] * BLOCK_SIZE);
+        for (i = 0; i < count; i++) {
+            int child = entries[i].inode;
+            if(strcmp(entries[i].fileName, ".") == 0 || strcmp(entries[i].fileName, "..") == 0)
+                continue;
+            if(child >= (int)checkedSuperBlock.ninodes || !testBit(usedInodes, child)) {
+                recordBadEntry(directory, entries[i].fileName);
+                continue;
+            }
+            __atomic_fetch_add(&linkReferences[child], 1, __ATOMIC_RELAXED);
+            if((inodeTable[child].flags & INODE_DIRECTORY) && !setBit(visitedDirectories, child)) {
+                __atomic_fetch_add(&pendingDirectories, 1, __ATOMIC_RELAXED);
+                pushDirectory(&deques[self], child);
+            }
+        }
+    }
+}
+
+/*
+    Pass 2 worker. Runs until every queued directory has been walked
+*/
+void * walkDirectories(void *argument) {
+    int self = (int)(long)argument;
+    while(1) {
+        int directory = takeDirectory(self);
+        if(directory == -1) {
+            if(__atomic_load_n(&pendingDirectories, __ATOMIC_ACQUIRE) == 0)
+                break;
+            sched_yield();
+            continue;
+        }
+        walkDirectory(self, directory);
+        __atomic_fetch_sub(&pendingDirectories, 1, __ATOMIC_RELEASE);
+    }
+    return NULL;
+}
+
+void runThreads(void * (*worker)(void *)) {
+    pthread_t *threads = malloc(threadCount * sizeof(pthread_t));
+    int i;
+    for (i = 0; i < threadCount; i++)
+        pthread_create(&threads[i], NULL, worker, (void *)(long)i);
+    for (i = 0; i < threadCount; i++)
+        pthread_join(threads[i], NULL);
+    free(threads);
+}
+
+/*
+    Marks every block on the free list, including the blocks that hold the chained parts of the list.
+    Returns the number of problems found while following the chain
+*/
+int scanFreeList() {
+    unsigned short list[FREE_ARRAY_SIZE];
+    int count = checkedSuperBlock.nfree, problems = 0, i;
+    memcpy(list, checkedSuperBlock.free, sizeof(list));
+    if(count > FREE_ARRAY_SIZE) {
+        printf("superblock: nfree %d is larger than the free array\n", count);
+        return 1;
+    }
+    while(count > 0) {
+        for (i = count - 1; i >= 0; i--) {
+            int blockNumber = list[i];
+            if(i == 0 && blockNumber == 0)
+                return problems;
+            if(blockNumber < dataStart || blockNumber >= (int)checkedSuperBlock.fsize) {
+                printf("free list: block %d out of range\n", blockNumber);
+                return problems + 1;
+            }
+            if(onFreeList[blockNumber]++) {
+                printf("free list: block %d appears twice, the chain is corrupt\n", blockNumber);
+                return problems + 1;
+            }
+        }
+        pread(imageDescriptor, list, sizeof(list), (off_t)list[0] * BLOCK_SIZE);
+        count = FREE_ARRAY_SIZE;
+    }
+    return problems;
+}
+
+/*
+    The saved dedup index and the directory of the snapshots are in no directory on purpose
+*/
+int isHiddenInode(int iNumber) {
+    return linkReferences[iNumber] == 0 && (iNumber == (int)checkedSuperBlock.dedupIndex || iNumber == (int)checkedSuperBlock.snapshots);
+}
+
+/*
+    Follows the orphan list from the superblock and marks the removed i-nodes the reclaimer has not freed
+    yet. Returns the number of bad entries, the list ends at the first one
+*/
+int scanOrphanList() {
+    int iNumber = checkedSuperBlock.orphanList, steps;
+    for (steps = 0; iNumber != 0 && steps < (int)checkedSuperBlock.ninodes; steps++) {
+        if(iNumber < 0 || iNumber >= (int)checkedSuperBlock.ninodes) {
+            printf("orphan list: i-node %d out of range\n", iNumber);
+            return 1;
+        }
+        if((inodeTable[iNumber].flags & (INODE_ALLOCATED | INODE_ORPHAN)) != (INODE_ALLOCATED | INODE_ORPHAN)) {
+            printf("orphan list: i-node %d is not waiting for the reclaimer\n", iNumber);
+            return 1;
+        }
+        if(setBit(pendingOrphans, iNumber)) {
+            printf("orphan list: i-node %d appears twice, the chain is corrupt\n", iNumber);
+            return 1;
+        }
+        iNumber = inodeTable[iNumber].actime;
+    }
+    return 0;
+}
+
+typedef struct {
+    Inode inode;
+    unsigned char *firstOwnerSeen;
+    int changed, cloned;
+} cloneContext;
+
+void cloneIfDuplicate(void *context, int fileBlock, int blockNumber) {
+    cloneContext *clone = context;
+    char buffer[BLOCK_SIZE];
+    // doubly claimed indirect blocks are only reported, fileBlock is -1 for them. Data blocks of an
+    // image with dedup are shared on purpose
+    if(fileBlock < 0 || checkedSuperBlock.sharedBlocks || blockNumber < dataStart || blockNumber >= (int)checkedSuperBlock.fsize || blockClaims[blockNumber] < 2)
+        return;
+    if(!clone->firstOwnerSeen[blockNumber]) {
+        clone->firstOwnerSeen[blockNumber] = 1;
+        return;
+    }
+    int copy = getAFreeBlock();
+    if(copy == 0)
+        return;
+    readFromBlockWithOffset(blockNumber, 0, buffer, BLOCK_SIZE);
+    writeBufferToBlock(copy, buffer, BLOCK_SIZE);
+    if(bmapReplace(&clone->inode, fileBlock, copy)) {
+        clone->changed = 1;
+        clone->cloned++;
+    }
+}
+
+/*
+    Gives every i-node after the first owner of a doubly claimed block its own copy of that block.
+    Runs after the free list was rebuilt, so getAFreeBlock() hands out blocks nobody uses
+*/
+int cloneDuplicateBlocks() {
+    cloneContext clone;
+    int iNumber;
+    clone.firstOwnerSeen = calloc(checkedSuperBlock.fsize, 1);
+    clone.cloned = 0;
+    for (iNumber = 0; iNumber < (int)checkedSuperBlock.ninodes; iNumber++) {
+        clone.inode = getAnInode(iNumber);
+        clone.changed = 0;
+        if(!(clone.inode.flags & INODE_ALLOCATED))
+            continue;
+        walkFileBlocks(imageDescriptor, checkedSuperBlock.fsize, &clone.inode, cloneIfDuplicate, &clone);
+        if(clone.changed)
+            writeTheInode(iNumber, clone.inode);
+    }
+    free(clone.firstOwnerSeen);
+    return clone.cloned;
+}
+
+/*
+    Removes the entry from its directory the same way removeFile() does: the last entry moves into the hole
+*/
+void removeBadEntry(badEntry *entry) {
+    Inode dir = getAnInode(entry->directory);
+    directoryEntry entries[ENTRIES_PER_BLOCK];
+    int i, count = dir.size / sizeof(directoryEntry);
+    if(count > (int)ENTRIES_PER_BLOCK)
+        return;
+    readFromBlockWithOffset(dir.addr[0], 0, entries, dir.size);
+    for (i = 0; i < count; i++) {
+        if(strncmp(entries[i].fileName, entry->fileName, 14) == 0) {
+            entries[i] = entries[count - 1];
+            dir.size -= sizeof(directoryEntry);
+            writeBufferToBlock(dir.addr[0], entries, dir.size);
+            writeTheInode(entry->directory, dir);
+            return;
+        }
+    }
+}
+
+int main(int argc, char *argv[]) {
+    int repair = 0, option, iNumber, blockNumber, i;
+    int orphans = 0, badLinks = 0, duplicates = 0, lostBlocks = 0, busyFreeBlocks = 0, freeListProblems;
+    int pending = 0, shared = 0;
+    double start = now(), passStart;
+
+    threadCount = sysconf(_SC_NPROCESSORS_ONLN);
+    while((option = getopt(argc, argv, "yj:")) != -1) {
+        if(option == 'y')
+            repair = 1;
+        else if(option == 'j')
+            threadCount = atoi(optarg);
+        else {
+            printf("use: v6fsck [-y] [-j threads] image\n");
+            return 8;
+        }
+    }
+    if(optind >= argc) {
+        printf("use: v6fsck [-y] [-j threads] image\n");
+        return 8;
+    }
+    if(threadCount < 1)
+        threadCount = 1;
+
+    if((imageDescriptor = open(argv[optind], repair ? O_RDWR : O_RDONLY)) == -1) {
+        printf("Error while opening the file [%s]\n", strerror(errno));
+        return 8;
+    }
+    if(pread(imageDescriptor, &checkedSuperBlock, sizeof(superBlockType), 0) != sizeof(superBlockType)
+            || checkedSuperBlock.magic != FS_MAGIC) {
+        printf("%s is not a V6 filesystem\n", argv[optind]);
+        return 8;
+    }
+    printf("%s: %u blocks, %u i-nodes, %s\n", argv[optind], checkedSuperBlock.fsize, checkedSuperBlock.ninodes,
+           checkedSuperBlock.clean == FS_CLEAN ? "clean" : "not cleanly unmounted");
+
+    int ninodes = checkedSuperBlock.ninodes;
+    dataStart = INODE_TABLE_START + checkedSuperBlock.isize;
+    inodeTable = malloc((size_t)checkedSuperBlock.isize * BLOCK_SIZE);
+    usedInodes = calloc(ninodes / 64 + 1, sizeof(unsigned long long));
+    visitedDirectories = calloc(ninodes / 64 + 1, sizeof(unsigned long long));
+    pendingOrphans = calloc(ninodes / 64 + 1, sizeof(unsigned long long));
+    linkReferences = calloc(ninodes, sizeof(unsigned int));
+    blockClaims = calloc(checkedSuperBlock.fsize, sizeof(unsigned short));
+    tailSharers = calloc(checkedSuperBlock.fsize, sizeof(unsigned short));
+    indirectBlocks = calloc(checkedSuperBlock.fsize, 1);
+    onFreeList = calloc(checkedSuperBlock.fsize, 1);
+
+    passStart = now();
+    runThreads(scanInodeChunks);
+    printf("Pass 1: scanned the i-list with %d threads (%.3fs)\n", threadCount, now() - passStart);
+
+    passStart = now();
+    deques = calloc(threadCount, sizeof(workDeque));
+    for (i = 0; i < threadCount; i++) {
+        pthread_mutex_init(&deques[i].lock, NULL);
+        deques[i].capacity = 256;
+        deques[i].items = malloc(deques[i].capacity * sizeof(int));
+    }
+    if(testBit(usedInodes, 0) && (inodeTable[0].flags & INODE_DIRECTORY)) {
+        setBit(visitedDirectories, 0);
+        pendingDirectories = 1;
+        pushDirectory(&deques[0], 0);
+        // the snapshots hang off a directory of their own, walked like a second root
+        int snapshots = checkedSuperBlock.snapshots;
+        if(snapshots > 0 && snapshots < ninodes && testBit(usedInodes, snapshots) && (inodeTable[snapshots].flags & INODE_DIRECTORY)
+                && !setBit(visitedDirectories, snapshots)) {
+            pendingDirectories++;
+            pushDirectory(&deques[0], snapshots);
+        }
+        runThreads(walkDirectories);
+    }
+    else
+        printf("root i-node 0 is not an allocated directory\n");
+    printf("Pass 2: walked the directory tree (%.3fs)\n", now() - passStart);
+
+    passStart = now();
+    for (i = 0; i < badEntryCount; i++)
+        if(i < MAX_REPORTED)
+            printf("directory i-node %d: entry '%.14s' points to a free i-node\n", badEntries[i].directory, badEntries[i].fileName);
+
+    freeListProblems = scanOrphanList();
+    for (iNumber = 1; iNumber < ninodes; iNumber++) {
+        if(!testBit(usedInodes, iNumber) || isHiddenInode(iNumber))
+            continue;
+        if(testBit(pendingOrphans, iNumber) && linkReferences[iNumber] != 0) {
+            printf("orphan list: i-node %d is still in a directory\n", iNumber);
+            pendingOrphans[iNumber / 64] &= ~(1ULL << (iNumber % 64));
+            freeListProblems++;
+        }
+        if(linkReferences[iNumber] == 0 && testBit(pendingOrphans, iNumber))
+            pending++; // removed, its blocks stay claimed until the reclaimer frees them
+        else if(linkReferences[iNumber] == 0) {
+            if(orphans++ < MAX_REPORTED)
+                printf("i-node %d: allocated but not in any directory (orphan)\n", iNumber);
+            // an orphan gets cleared on repair, its blocks are no longer claimed
+            walkFileBlocks(imageDescriptor, checkedSuperBlock.fsize, &inodeTable[iNumber], unclaimBlock, NULL);
+        }
+        else if((unsigned int)inodeTable[iNumber].nlinks != linkReferences[iNumber]) {
+            if(badLinks++ < MAX_REPORTED)
+                printf("i-node %d: link count %d, should be %u\n", iNumber, inodeTable[iNumber].nlinks, linkReferences[iNumber]);
+        }
+    }
+
+    freeListProblems += scanFreeList();
+    for (blockNumber = dataStart; blockNumber < (int)checkedSuperBlock.fsize; blockNumber++) {
+        if(blockClaims[blockNumber] > 1 && checkedSuperBlock.sharedBlocks && !indirectBlocks[blockNumber])
+            shared++;
+        else if(blockClaims[blockNumber] > 1 && duplicates++ < MAX_REPORTED)
+            printf("block %d: claimed by %d i-nodes\n", blockNumber, blockClaims[blockNumber]);
+        if(blockClaims[blockNumber] && onFreeList[blockNumber] && busyFreeBlocks++ < MAX_REPORTED)
+            printf("block %d: in use but on the free list\n", blockNumber);
+        if(!blockClaims[blockNumber] && !onFreeList[blockNumber] && lostBlocks++ < MAX_REPORTED)
+            printf("block %d: neither in use nor on the free list\n", blockNumber);
+    }
+    for (i = 0; i < (int)checkedSuperBlock.ninode && i < FREE_ARRAY_SIZE; i++) {
+        if(checkedSuperBlock.inode[i] < ninodes && testBit(usedInodes, checkedSuperBlock.inode[i])) {
+            printf("free i-node list: i-node %d is allocated\n", checkedSuperBlock.inode[i]);
+            freeListProblems++;
+        }
+    }
+    printf("Pass 3: checked link counts, block claims and the free lists (%.3fs)\n", now() - passStart);
+    if(pending > 0)
+        printf("%d i-nodes waiting for the reclaimer\n", pending);
+    if(shared > 0)
+        printf("%d blocks shared by several files\n", shared);
+
+    int problems = badPointers + badEntryCount + orphans + badLinks + duplicates + busyFreeBlocks + lostBlocks + freeListProblems;
+    printf("\n%d orphans, %d bad link counts, %d doubly allocated blocks, %d bad entries, %d bad addresses,\n"
+           "%d used blocks on the free list, %d lost blocks, %d free list problems\n",
+           orphans, badLinks, duplicates, badEntryCount, badPointers, busyFreeBlocks, lostBlocks, freeListProblems);
+
+    if(!repair || (problems == 0 && checkedSuperBlock.clean == FS_CLEAN)) {
+        printf("%s (%.3fs)\n", problems ? "Filesystem has errors, run with -y to repair" : "Filesystem is clean", now() - start);
+        close(imageDescriptor);
+        return problems ? 4 : 0;
+    }
+
+    // repair through the engine, which takes over the image from here
+    fileDescriptor = imageDescriptor;
+    superBlock = checkedSuperBlock;
+    totalINodesCount = ninodes;
+    invalidateCache();
+
+    for (i = 0; i < badEntryCount; i++)
+        removeBadEntry(&badEntries[i]);
+    for (iNumber = 1; iNumber < ninodes; iNumber++) {
+        if(!testBit(usedInodes, iNumber) || isHiddenInode(iNumber))
+            continue;
+        Inode inode = getAnInode(iNumber);
+        if(testBit(pendingOrphans, iNumber))
+            continue;
+        if(linkReferences[iNumber] == 0) {
+            inode.flags = 0;
+            writeTheInode(iNumber, inode);
+            usedInodes[iNumber / 64] &= ~(1ULL << (iNumber % 64));
+        }
+        else if((unsigned int)inode.nlinks != linkReferences[iNumber]) {
+            inode.nlinks = linkReferences[iNumber];
+            writeTheInode(iNumber, inode);
+        }
+    }
+
+    // bitmap reconstruction: both free lists are rebuilt from what pass 1 found in use
+    unsigned char *usedBlocks = calloc(checkedSuperBlock.fsize, 1);
+    for (blockNumber = dataStart; blockNumber < (int)checkedSuperBlock.fsize; blockNumber++)
+        usedBlocks[blockNumber] = blockClaims[blockNumber] > 0;
+    rebuildFreeBlockList(usedBlocks);
+    if(duplicates)
+        printf("cloned %d doubly allocated blocks\n", cloneDuplicateBlocks());
+
+    // the orphan list is linked again from the removed i-nodes that were found, the engine frees them
+    superBlock.orphanList = 0;
+    for (iNumber = ninodes - 1; iNumber > 0; iNumber--) {
+        if(!testBit(pendingOrphans, iNumber))
+            continue;
+        Inode inode = getAnInode(iNumber);
+        inode.actime = superBlock.orphanList;
+        writeTheInode(iNumber, inode);
+        superBlock.orphanList = iNumber;
+    }
+
+    // the free-inode list comes from the repaired i-list
+    saveFreeLists();
+    releaseAllocationGroups();
+    // the repairs went around the block checksums, they are taken from the repaired image
+    if(loadBlockChecksums(1))
+        saveBlockChecksums();
+    // and so did they around the saved share counts, the next mount counts them again
+    if(superBlock.sharedBlocks)
+        superBlock.sharedBlocks = 1;
+    superBlock.clean = FS_CLEAN;
+    writeSuperBlock();
+    close(imageDescriptor);
+    printf("Filesystem repaired (%.3fs)\n", now() - start);
+    return 1;
+}
@@ -0,0 +1,180 @@
+/*
+
+ Filename       : v6replay.c
+ Description    : Replays a trace recorded by the shell (trace start <file>, or ./a.out -t <file>) against a
+                  fresh image, either as fast as possible or with the pacing of the original session.
+                  Every command's block I/O is compared with the recorded pattern, so a replay also shows
+                  where the engine behaves differently from the version that recorded the trace.
+
+ Usage          : v6replay [-p] [-v] [-i image] trace
+
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+
+#include "fileSystem.h"
+
+#define MAX_REPORTED 10 // diverging commands printed before the rest are only counted
+
+unsigned int recordedEvents[TRACE_MAX_EVENTS];
+
+/*
+    Reads the next command record. Returns 0 at the end of the trace
+*/
+int readRecord(FILE *trace, unsigned long long *gap, unsigned long long *duration, char *commandLine,
+               int *eventCount) {
+    unsigned long long length, count, value;
+    int i, previousBlock = 0;
+    if(!readVarint(trace, gap) || !readVarint(trace, duration) || !readVarint(trace, &length) || length >= 512)
+        return 0;
+    if(fread(commandLine, 1, length, trace) != length)
+        return 0;
+    commandLine[length] = 0;
+    if(!readVarint(trace, &count))
+        return 0;
+    for (i = 0; i < (int)count; i++) {
+        if(!readVarint(trace, &value))
+            return 0;
+        unsigned long long zigzag = value >> 1;
+        long long delta = (zigzag & 1) ? -(long long)((zigzag + 1) >> 1) : (long long)(zigzag >> 1);
+        previousBlock += delta;
+        if(i < TRACE_MAX_EVENTS)
+            recordedEvents[i] = (unsigned int)previousBlock << 1 | (value & 1);
+    }
+    *eventCount = count < TRACE_MAX_EVENTS ? count : TRACE_MAX_EVENTS;
+    return 1;
+}
+
+/*
+    Points initfs and openfs at the replay image. Returns 0 for commands that are not replayed
+*/
+int rewriteCommand(char *commandLine, const char *imagePath) {
+    char copy[512], rewritten[512];
+    char *command, *path, *blocks, *inodes;
+    snprintf(copy, sizeof(copy), "%s", commandLine);
+    command = strtok(copy, " ");
+    if(command == NULL || strcmp(command, "q") == 0 || strcmp(command, "trace") == 0)
+        return 0;
+    if(strcmp(command, "initfs") == 0) {
+        path = strtok(NULL, " ");
+        blocks = strtok(NULL, " ");
+        inodes = strtok(NULL, " ");
+        if(path == NULL || blocks == NULL || inodes == NULL)
+            return 0;
+        // the shell opens an existing image instead of initializing it, so start from scratch
+        unmountFileSystem();
+        unlink(imagePath);
+        snprintf(rewritten, sizeof(rewritten), "initfs %s %s %s", imagePath, blocks, inodes);
+        strcpy(commandLine, rewritten);
+    }
+    else if(strcmp(command, "openfs") == 0) {
+        char *snapshot;
+        strtok(NULL, " ");
+        snapshot = strtok(NULL, " ");
+        snprintf(rewritten, sizeof(rewritten), "openfs %s%s%s", imagePath, snapshot ? " " : "", snapshot ? snapshot : "");
+        strcpy(commandLine, rewritten);
+    }
+    return 1;
+}
+
+void sleepUntil(double wallClockTarget, double replayStart) {
+    double remaining = wallClockTarget - (monotonicNanoseconds() / 1e9 - replayStart);
+    if(remaining > 0) {
+        struct timespec ts;
+        ts.tv_sec = (time_t)remaining;
+        ts.tv_nsec = (long)((remaining - ts.tv_sec) * 1e9);
+        nanosleep(&ts, NULL);
+    }
+}
+
+int main(int argc, char *argv[]) {
+    char imagePath[256] = "/tmp/v6replay.img", commandLine[512];
+    int paced = 0, verbose = 0, option, recordedCount, commands = 0, diverged = 0;
+    unsigned long long gap, duration, recordedBusy = 0, recordedEventTotal = 0, replayedEventTotal = 0;
+    double recordedOffset = 0, replayBusy = 0, replayStart;
+    traceHeader header;
+    FILE *trace;
+
+    while((option = getopt(argc, argv, "pvi:")) != -1) {
+        if(option == 'p')
+            paced = 1;
+        else if(option == 'v')
+            verbose = 1;
+        else if(option == 'i')
+            snprintf(imagePath, sizeof(imagePath), "%s", optarg);
+        else {
+            printf("use: v6replay [-p] [-v] [-i image] trace\n");
+            return 1;
+        }
+    }
+    if(optind >= argc) {
+        printf("use: v6replay [-p] [-v] [-i image] trace\n");
+        return 1;
+    }
+    if((trace = fopen(argv[optind], "rb")) == NULL) {
+        printf("Error while opening the file [%s]\n", strerror(errno));
+        return 1;
+    }
+    if(fread(&header, sizeof(header), 1, trace) != 1 || header.magic != TRACE_MAGIC || header.version != TRACE_VERSION) {
+        printf("%s is not a V6 trace\n", argv[optind]);
+        return 1;
+    }
+
+    // the summary goes to the real stdout, the engine's own output only with -v
+    fflush(stdout);
+    int savedStdout = dup(1);
+    if(!verbose)
+        freopen("/dev/null", "w", stdout);
+
+    unlink(imagePath);
+    if(header.fsize != 0)
+        initfs(imagePath, header.fsize, header.ninodes);
+#ifndef V6FS_NO_STATS
+    statsEnabled = 1; // for the summary printed at the end
+#endif
+    resetStats();
+
+    traceCapturing = 1;
+    replayStart = monotonicNanoseconds() / 1e9;
+    while(readRecord(trace, &gap, &duration, commandLine, &recordedCount)) {
+        recordedOffset += gap / 1e6;
+        if(!rewriteCommand(commandLine, imagePath))
+            continue;
+        if(paced)
+            sleepUntil(recordedOffset, replayStart);
+
+        char traceLine[512];
+        strcpy(traceLine, commandLine);
+        double started = monotonicNanoseconds() / 1e9;
+        executeCommand(commandLine);
+        replayBusy += monotonicNanoseconds() / 1e9 - started;
+        recordedBusy += duration;
+        commands++;
+
+        recordedEventTotal += recordedCount;
+        replayedEventTotal += traceEventCount;
+        if(traceEventCount != recordedCount || memcmp(traceEvents, recordedEvents, recordedCount * sizeof(unsigned int)) != 0) {
+            if(diverged++ < MAX_REPORTED)
+                dprintf(savedStdout, "command %d '%s': block I/O differs from the trace (%d events recorded, %d replayed)\n",
+                        commands, traceLine, recordedCount, traceEventCount);
+        }
+    }
+    traceCapturing = 0;
+    fclose(trace);
+    double wallClock = monotonicNanoseconds() / 1e9 - replayStart;
+
+    fflush(stdout);
+    dup2(savedStdout, 1);
+    printf("replayed %d commands %s\n", commands, paced ? "with the original pacing" : "at full speed");
+    printf("recorded: %.3fs busy, %.3fs elapsed, %llu block I/Os\n", recordedBusy / 1e6, recordedOffset, recordedEventTotal);
+    printf("replayed: %.3fs busy, %.3fs elapsed, %llu block I/Os\n", replayBusy, wallClock, replayedEventTotal);
+    printf("%d commands with a different block I/O pattern\n", diverged);
+    printStats();
+    unmountFileSystem();
+    return diverged ? 2 : 0;
+}